@@ -0,0 +1,1209 @@
+// tevbroker: multiplexes many local producer processes onto a single tev connection.
+//
+// Producers connect with a regular tevclient::Client, either over loopback TCP
+// (Client("127.0.0.1", 14159)) or through the Unix domain socket
+// (Client("unix:/tmp/tevbroker.sock")). The broker decodes the incoming packets,
+// coalesces image updates per image and forwards everything over one paced
+// upstream connection to tev. While too much data waits for tev, producers are
+// not read from, so their sends block instead of the broker buffering without bound.
+//
+// Running with --sink <port> turns the executable into a stand-in tev that
+// prints a summary line for every packet it receives. This is useful for
+// testing producers and the broker itself without a running tev instance.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "tevclient.h"
+
+namespace
+{
+
+namespace protocol = tevclient::protocol;
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<bool> sStop{false};
+
+/// Upper bound for a single frame, so that a corrupt length cannot make the broker buffer gigabytes.
+/// Producers split larger images into multiple updates.
+constexpr uint32_t MaxFrameSize = 1u << 30;
+
+/// Upper bound for a merged tile (in floats), keeps pacing granular.
+constexpr size_t MaxMergedTileFloats = 4 * 1024 * 1024;
+
+/// Bytes read from one connection per poll, so a fast producer cannot monopolize the broker.
+constexpr size_t MaxReadPerPoll = 4 * 1024 * 1024;
+
+const char *packetTypeName(uint8_t type)
+{
+    switch (type)
+    {
+    case protocol::OpenImage:
+        return "OpenImage";
+    case protocol::ReloadImage:
+        return "ReloadImage";
+    case protocol::CloseImage:
+        return "CloseImage";
+    case protocol::UpdateImage:
+        return "UpdateImage";
+    case protocol::CreateImage:
+        return "CreateImage";
+    case protocol::UpdateImageV2:
+        return "UpdateImageV2";
+    case protocol::UpdateImageV3:
+        return "UpdateImageV3";
+    case protocol::OpenImageV2:
+        return "OpenImageV2";
+    case protocol::VectorGraphics:
+        return "VectorGraphics";
+    default:
+        return "Unknown";
+    }
+}
+
+struct Options
+{
+    std::string upstreamHost{"127.0.0.1"};
+    uint16_t upstreamPort{14158};
+    uint16_t listenPort{14159};
+    std::string socketPath{"/tmp/tevbroker.sock"};
+    double rateMBps{0.0};
+    double bufferMB{256.0};
+    int intervalMs{16};
+    int sinkPort{-1};
+    bool verbose{false};
+};
+
+/// Decoded packet. Image data is repacked into interleaved layout.
+struct Packet
+{
+    uint8_t type{0};
+    bool grabFocus{false};
+    std::string imageName;
+    std::string channelSelector;
+    uint32_t x{0}, y{0}, width{0}, height{0};
+    std::vector<std::string> channelNames;
+    std::vector<float> data;
+    bool append{false};
+    std::vector<tevclient::VgCommand> commands;
+};
+
+/// Decodes a packet with the shared protocol schemas and copies it into an owning packet.
+bool decodePacket(const uint8_t *data, size_t size, Packet &packet, std::string &error)
+{
+    if (size == 0)
+    {
+        error = "empty packet";
+        return false;
+    }
+
+    protocol::DecodeArena arena;
+    const uint8_t *end = nullptr;
+    packet.type = data[0];
+    switch (packet.type)
+    {
+    case protocol::OpenImageV2: {
+        protocol::OpenImageV2Packet view;
+        if ((end = protocol::decodePacket(data, size, view, arena)))
+        {
+            packet.grabFocus = view.grabFocus;
+            packet.imageName = view.imagePath;
+            packet.channelSelector = view.channelSelector;
+        }
+        break;
+    }
+    case protocol::ReloadImage: {
+        protocol::ReloadImagePacket view;
+        if ((end = protocol::decodePacket(data, size, view, arena)))
+        {
+            packet.grabFocus = view.grabFocus;
+            packet.imageName = view.imageName;
+        }
+        break;
+    }
+    case protocol::CloseImage: {
+        protocol::CloseImagePacket view;
+        if ((end = protocol::decodePacket(data, size, view, arena)))
+        {
+            packet.imageName = view.imageName;
+        }
+        break;
+    }
+    case protocol::CreateImage: {
+        protocol::CreateImagePacket view;
+        if ((end = protocol::decodePacket(data, size, view, arena)))
+        {
+            packet.grabFocus = view.grabFocus;
+            packet.imageName = view.imageName;
+            packet.width = view.width;
+            packet.height = view.height;
+            packet.channelNames.assign(view.channelNames, view.channelNames + view.channelCount);
+            if (view.width == 0 || view.height == 0 || view.channelCount == 0)
+            {
+                error = "empty image";
+                return false;
+            }
+        }
+        break;
+    }
+    case protocol::UpdateImageV3: {
+        protocol::UpdateImageV3Packet view;
+        if (!(end = protocol::decodePacket(data, size, view, arena)))
+        {
+            break;
+        }
+        packet.grabFocus = view.grabFocus;
+        packet.imageName = view.imageName;
+        packet.channelNames.assign(view.channelNames, view.channelNames + view.channelCount);
+        packet.x = view.x;
+        packet.y = view.y;
+        packet.width = view.width;
+        packet.height = view.height;
+        if (view.channelCount == 0 || view.width == 0 || view.height == 0)
+        {
+            error = "empty image update";
+            return false;
+        }
+
+        // Image data follows the decoded fields.
+        uint32_t channelCount = view.channelCount;
+        size_t pixelCount = static_cast<size_t>(packet.width) * packet.height;
+        size_t floatCount = static_cast<size_t>(data + size - end) / sizeof(float);
+        if (pixelCount > MaxFrameSize / sizeof(float) / channelCount)
+        {
+            error = "image update region too large";
+            return false;
+        }
+        for (uint32_t c = 0; c < channelCount; ++c)
+        {
+            uint64_t offset = view.channelOffsets[c], stride = view.channelStrides[c];
+            if (offset >= floatCount || (stride != 0 && (pixelCount - 1) > (floatCount - 1 - offset) / stride))
+            {
+                error = "image data too small for region";
+                return false;
+            }
+        }
+
+        packet.data.resize(pixelCount * channelCount);
+        for (size_t i = 0; i < pixelCount; ++i)
+        {
+            for (uint32_t c = 0; c < channelCount; ++c)
+            {
+                uint64_t index = view.channelOffsets[c] + i * view.channelStrides[c];
+                std::memcpy(&packet.data[i * channelCount + c], end + index * sizeof(float), sizeof(float));
+            }
+        }
+        break;
+    }
+    case protocol::VectorGraphics: {
+        protocol::VectorGraphicsPacket view;
+        if ((end = protocol::decodePacket(data, size, view, arena)))
+        {
+            packet.grabFocus = view.grabFocus;
+            packet.imageName = view.imageName;
+            packet.append = view.append;
+            packet.commands.assign(view.commands, view.commands + view.commandCount);
+        }
+        break;
+    }
+    default:
+        error = std::string("unsupported packet type ") + packetTypeName(packet.type);
+        return false;
+    }
+
+    if (!end)
+    {
+        error = std::string("truncated or malformed ") + packetTypeName(packet.type) + " packet";
+        return false;
+    }
+    return true;
+}
+
+/// A connected producer (or, in sink mode, a connected client).
+struct Connection
+{
+    int fd{-1};
+    std::vector<uint8_t> buffer;
+};
+
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+int listenTcp(uint16_t port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 64) != 0 ||
+        !setNonBlocking(fd))
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listenUnix(const std::string &path)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // Only replace a socket left behind by a broker that is no longer running.
+    struct stat info;
+    if (::lstat(path.c_str(), &info) == 0)
+    {
+        if (!S_ISSOCK(info.st_mode))
+        {
+            std::fprintf(stderr, "tevbroker: %s exists and is not a socket\n", path.c_str());
+            return -1;
+        }
+        int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        bool inUse = probe >= 0 && ::connect(probe, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0;
+        if (probe >= 0)
+        {
+            ::close(probe);
+        }
+        if (inUse)
+        {
+            std::fprintf(stderr, "tevbroker: %s is in use by another process\n", path.c_str());
+            return -1;
+        }
+        ::unlink(path.c_str());
+    }
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 64) != 0 ||
+        !setNonBlocking(fd))
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accepts connections on a set of listening sockets and splits the incoming
+ * byte streams into frames. Used both by the broker and the sink. The handler
+ * returns false to close the connection a frame arrived on.
+ */
+class FrameServer
+{
+public:
+    using FrameHandler = std::function<bool(const uint8_t *data, size_t size)>;
+
+    explicit FrameServer(FrameHandler handler) : mHandler(std::move(handler))
+    {
+    }
+
+    ~FrameServer()
+    {
+        for (int fd : mListeners)
+        {
+            ::close(fd);
+        }
+        for (auto &connection : mConnections)
+        {
+            ::close(connection.fd);
+        }
+    }
+
+    void addListener(int fd)
+    {
+        mListeners.push_back(fd);
+    }
+
+    size_t connectionCount() const
+    {
+        return mConnections.size();
+    }
+
+    /// While reading is disabled, connections are not polled, so their senders block once the socket buffers fill.
+    void setReading(bool reading)
+    {
+        mReading = reading;
+    }
+
+    /// Wait for activity for at most timeoutMs and process it.
+    void poll(int timeoutMs)
+    {
+        std::vector<struct pollfd> fds;
+        for (int fd : mListeners)
+        {
+            fds.push_back({fd, POLLIN, 0});
+        }
+        if (mReading)
+        {
+            for (auto &connection : mConnections)
+            {
+                fds.push_back({connection.fd, POLLIN, 0});
+            }
+        }
+
+        if (::poll(fds.data(), fds.size(), timeoutMs) <= 0)
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < mListeners.size(); ++i)
+        {
+            if (fds[i].revents & POLLIN)
+            {
+                accept(mListeners[i]);
+            }
+        }
+
+        std::vector<int> closed;
+        for (size_t i = mListeners.size(); i < fds.size(); ++i)
+        {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                auto &connection = mConnections[i - mListeners.size()];
+                if (!read(connection))
+                {
+                    closed.push_back(connection.fd);
+                }
+            }
+        }
+
+        for (int fd : closed)
+        {
+            ::close(fd);
+            mConnections.erase(std::remove_if(mConnections.begin(), mConnections.end(),
+                                              [fd](const Connection &c) { return c.fd == fd; }),
+                               mConnections.end());
+        }
+    }
+
+private:
+    void accept(int listener)
+    {
+        for (;;)
+        {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0)
+            {
+                return;
+            }
+            setNonBlocking(fd);
+            Connection connection;
+            connection.fd = fd;
+            mConnections.push_back(std::move(connection));
+        }
+    }
+
+    // Returns false if the connection should be closed.
+    bool read(Connection &connection)
+    {
+        static constexpr size_t ReadSize = 256 * 1024;
+        bool open = true;
+        // The rest is read on the next poll, the buffer only grows beyond this for a single large frame.
+        for (size_t total = 0; open && total < MaxReadPerPoll; total += ReadSize)
+        {
+            size_t oldSize = connection.buffer.size();
+            connection.buffer.resize(oldSize + ReadSize);
+            ssize_t count = ::recv(connection.fd, connection.buffer.data() + oldSize, ReadSize, 0);
+            connection.buffer.resize(oldSize + std::max<ssize_t>(count, 0));
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            // Still process the frames that arrived before the peer closed the connection.
+            open = count > 0;
+        }
+
+        size_t pos = 0;
+        while (connection.buffer.size() - pos >= 4)
+        {
+            uint32_t length;
+            std::memcpy(&length, connection.buffer.data() + pos, 4);
+            if (length < 5 || length > MaxFrameSize)
+            {
+                std::fprintf(stderr, "tevbroker: invalid frame length %u, dropping connection\n", length);
+                return false;
+            }
+            if (connection.buffer.size() - pos < length)
+            {
+                break;
+            }
+            if (!mHandler(connection.buffer.data() + pos + 4, length - 4))
+            {
+                return false;
+            }
+            pos += length;
+        }
+        connection.buffer.erase(connection.buffer.begin(), connection.buffer.begin() + pos);
+        return open;
+    }
+
+    FrameHandler mHandler;
+    std::vector<int> mListeners;
+    std::vector<Connection> mConnections;
+    bool mReading{true};
+};
+
+struct Tile
+{
+    uint32_t x, y, width, height;
+    std::vector<float> data;
+
+    bool covers(const Tile &other) const
+    {
+        return x <= other.x && y <= other.y && x + width >= other.x + other.width &&
+               y + height >= other.y + other.height;
+    }
+
+    bool overlaps(const Tile &other) const
+    {
+        return x < other.x + other.width && other.x < x + width && y < other.y + other.height &&
+               other.y < y + height;
+    }
+};
+
+/// Pending work for the upstream connection, kept in arrival order.
+struct Entry
+{
+    bool isUpdate{false};
+    Packet control;
+
+    // Coalesced updates of one image with one channel layout.
+    std::string imageName;
+    std::vector<std::string> channelNames;
+    bool grabFocus{false};
+    std::vector<Tile> tiles;
+
+    /// Image data and commands held by the entry.
+    size_t bytes{0};
+    /// Set once sending started, after which no more tiles are added.
+    bool inFlight{false};
+    size_t nextTile{0};
+};
+
+class Broker
+{
+public:
+    explicit Broker(const Options &options)
+        : mOptions(options), mUpstream(options.upstreamHost.c_str(), options.upstreamPort),
+          mServer([this](const uint8_t *data, size_t size) { return handleFrame(data, size); })
+    {
+    }
+
+    int run()
+    {
+        int tcp = listenTcp(mOptions.listenPort);
+        if (tcp < 0)
+        {
+            std::fprintf(stderr, "tevbroker: failed to listen on port %u\n", mOptions.listenPort);
+            return 1;
+        }
+        mServer.addListener(tcp);
+
+        if (!mOptions.socketPath.empty())
+        {
+            int unixFd = listenUnix(mOptions.socketPath);
+            if (unixFd < 0)
+            {
+                std::fprintf(stderr, "tevbroker: failed to listen on %s\n", mOptions.socketPath.c_str());
+                return 1;
+            }
+            mServer.addListener(unixFd);
+        }
+
+        std::printf("tevbroker: listening on 127.0.0.1:%u%s%s, forwarding to %s:%u\n", mOptions.listenPort,
+                    mOptions.socketPath.empty() ? "" : " and unix:", mOptions.socketPath.c_str(),
+                    mOptions.upstreamHost.c_str(), mOptions.upstreamPort);
+        std::fflush(stdout);
+
+        auto interval = std::chrono::milliseconds(mOptions.intervalMs);
+        auto nextFlush = Clock::now() + interval;
+        while (!sStop)
+        {
+            // Producers are not read from while too much data waits for upstream.
+            mServer.setReading(static_cast<double>(mPendingBytes) < mOptions.bufferMB * 1e6);
+            auto wakeup = mThrottled ? std::min(nextFlush, mResumeTime) : nextFlush;
+            auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wakeup - Clock::now());
+            mServer.poll(std::max<int>(0, static_cast<int>(timeout.count())));
+            auto now = Clock::now();
+            if (now >= nextFlush || (mThrottled && now >= mResumeTime))
+            {
+                flush();
+                nextFlush = now + interval;
+            }
+        }
+
+        flush();
+        while (mThrottled)
+        {
+            std::this_thread::sleep_until(mResumeTime);
+            flush();
+        }
+        if (!mOptions.socketPath.empty())
+        {
+            ::unlink(mOptions.socketPath.c_str());
+        }
+
+        std::printf("tevbroker: received %zu packets (%zu updates, %zu coalesced), forwarded %zu messages (%.1f MB)\n",
+                    mStats.packets, mStats.updates, mStats.coalesced, mStats.messages, mStats.bytes / 1e6);
+        return 0;
+    }
+
+private:
+    /// Returns false if the producer sent an invalid packet and is disconnected.
+    bool handleFrame(const uint8_t *data, size_t size)
+    {
+        Packet packet;
+        std::string error;
+        if (!decodePacket(data, size, packet, error))
+        {
+            std::fprintf(stderr, "tevbroker: dropping producer after invalid packet: %s\n", error.c_str());
+            return false;
+        }
+
+        ++mStats.packets;
+        if (packet.type == protocol::UpdateImageV3)
+        {
+            enqueueUpdate(std::move(packet));
+        }
+        else
+        {
+            enqueueControl(std::move(packet));
+        }
+        return true;
+    }
+
+    void enqueueControl(Packet &&packet)
+    {
+        Entry entry;
+        entry.control = std::move(packet);
+        entry.bytes = entry.control.commands.size() * sizeof(tevclient::VgCommand);
+        mPendingBytes += entry.bytes;
+        mPending.push_back(std::move(entry));
+    }
+
+    void enqueueUpdate(Packet &&packet)
+    {
+        ++mStats.updates;
+
+        // Find an open group for this image and layout. Control packets for the same
+        // image (and groups with a different layout) act as barriers. Vector graphics
+        // only draw on top of the image, so they do not need to be ordered with pixels.
+        Entry *group = nullptr;
+        for (auto it = mPending.rbegin(); it != mPending.rend(); ++it)
+        {
+            if (it->isUpdate && it->imageName == packet.imageName)
+            {
+                if (it->channelNames == packet.channelNames && !it->inFlight)
+                {
+                    group = &*it;
+                }
+                break;
+            }
+            if (!it->isUpdate && it->control.type != protocol::VectorGraphics &&
+                it->control.imageName == packet.imageName)
+            {
+                break;
+            }
+        }
+
+        if (!group)
+        {
+            Entry entry;
+            entry.isUpdate = true;
+            entry.imageName = packet.imageName;
+            entry.channelNames = packet.channelNames;
+            mPending.push_back(std::move(entry));
+            group = &mPending.back();
+        }
+
+        Tile tile{packet.x, packet.y, packet.width, packet.height, std::move(packet.data)};
+
+        // Later tiles win, so drop everything the new tile fully covers.
+        size_t before = group->tiles.size();
+        auto covered = std::remove_if(group->tiles.begin(), group->tiles.end(),
+                                      [&tile](const Tile &t) { return tile.covers(t); });
+        for (auto it = covered; it != group->tiles.end(); ++it)
+        {
+            releaseBytes(*group, it->data.size() * sizeof(float));
+        }
+        group->tiles.erase(covered, group->tiles.end());
+        mStats.coalesced += before - group->tiles.size();
+
+        group->grabFocus |= packet.grabFocus;
+        group->bytes += tile.data.size() * sizeof(float);
+        mPendingBytes += tile.data.size() * sizeof(float);
+        group->tiles.push_back(std::move(tile));
+    }
+
+    void releaseBytes(Entry &entry, size_t bytes)
+    {
+        entry.bytes -= bytes;
+        mPendingBytes -= bytes;
+    }
+
+    /**
+     * Mark the tiles that overlap any other tile.
+     *
+     * Tiles are swept in order of (y, x). A tile can only overlap the tiles of rows starting
+     * within its height, and of each such row only those starting before its right edge and
+     * at most the row's widest tile before its left edge, which a binary search finds.
+     */
+    static std::vector<bool> findOverlaps(const std::vector<Tile> &tiles)
+    {
+        std::vector<size_t> order(tiles.size());
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::sort(order.begin(), order.end(), [&tiles](size_t a, size_t b) {
+            return std::tie(tiles[a].y, tiles[a].x) < std::tie(tiles[b].y, tiles[b].x);
+        });
+
+        // Tiles starting at the same y, as a range of order.
+        struct Row
+        {
+            uint32_t y;
+            size_t begin, end;
+            uint32_t maxWidth;
+        };
+        std::vector<Row> rows;
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            const Tile &tile = tiles[order[i]];
+            if (rows.empty() || rows.back().y != tile.y)
+            {
+                rows.push_back({tile.y, i, i, 0});
+            }
+            rows.back().end = i + 1;
+            rows.back().maxWidth = std::max(rows.back().maxWidth, tile.width);
+        }
+
+        std::vector<bool> overlapping(tiles.size(), false);
+        for (size_t r = 0; r < rows.size(); ++r)
+        {
+            for (size_t i = rows[r].begin; i < rows[r].end; ++i)
+            {
+                const Tile &tile = tiles[order[i]];
+                uint64_t right = static_cast<uint64_t>(tile.x) + tile.width;
+                uint64_t bottom = static_cast<uint64_t>(tile.y) + tile.height;
+                for (size_t other = r; other < rows.size() && rows[other].y < bottom; ++other)
+                {
+                    const Row &row = rows[other];
+                    size_t j = i + 1;
+                    if (other != r)
+                    {
+                        uint64_t minX = tile.x > row.maxWidth ? tile.x - row.maxWidth : 0;
+                        j = std::lower_bound(order.begin() + row.begin, order.begin() + row.end, minX,
+                                             [&tiles](size_t k, uint64_t x) { return tiles[k].x < x; }) -
+                            order.begin();
+                    }
+                    for (; j < row.end && tiles[order[j]].x < right; ++j)
+                    {
+                        if (tile.overlaps(tiles[order[j]]))
+                        {
+                            overlapping[order[i]] = overlapping[order[j]] = true;
+                        }
+                    }
+                }
+            }
+        }
+        return overlapping;
+    }
+
+    /**
+     * Merge adjacent tiles into larger rectangles where this does not change the result.
+     *
+     * Only tiles that overlap no other tile are merged, so the order they are sent in does not
+     * matter. Runs of tiles in the same row are merged first, then runs of the resulting strips
+     * in the same column, each found by sorting.
+     */
+    void mergeTiles(std::vector<Tile> &tiles, size_t channelCount)
+    {
+        std::vector<bool> overlapping = findOverlaps(tiles);
+        std::vector<size_t> candidates;
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            if (!overlapping[i])
+            {
+                candidates.push_back(i);
+            }
+        }
+
+        mergeRuns(tiles, candidates, channelCount, true);
+        mergeRuns(tiles, candidates, channelCount, false);
+
+        // Tiles merged into others were left empty.
+        tiles.erase(std::remove_if(tiles.begin(), tiles.end(), [](const Tile &tile) { return tile.width == 0; }),
+                    tiles.end());
+    }
+
+    /// Merge runs of adjacent candidate tiles into their first tile, leaving the others empty.
+    void mergeRuns(std::vector<Tile> &tiles, std::vector<size_t> &candidates, size_t channelCount, bool horizontal)
+    {
+        // Sort into bands of equal position and extent across the merge direction, ordered along it.
+        auto key = [&tiles, horizontal](size_t i) {
+            const Tile &t = tiles[i];
+            return horizontal ? std::make_tuple(t.y, t.height, t.x) : std::make_tuple(t.x, t.width, t.y);
+        };
+        std::sort(candidates.begin(), candidates.end(), [&key](size_t a, size_t b) { return key(a) < key(b); });
+
+        std::vector<size_t> remaining;
+        for (size_t begin = 0; begin < candidates.size();)
+        {
+            Tile &first = tiles[candidates[begin]];
+            size_t end = begin + 1;
+            size_t floatCount = first.data.size();
+            uint32_t extent = horizontal ? first.width : first.height;
+            for (; end < candidates.size(); ++end)
+            {
+                const Tile &next = tiles[candidates[end]];
+                bool adjacent = horizontal ? next.y == first.y && next.height == first.height &&
+                                                 first.x + extent == next.x
+                                           : next.x == first.x && next.width == first.width &&
+                                                 first.y + extent == next.y;
+                if (!adjacent || floatCount + next.data.size() > MaxMergedTileFloats)
+                {
+                    break;
+                }
+                floatCount += next.data.size();
+                extent += horizontal ? next.width : next.height;
+            }
+
+            if (end - begin > 1)
+            {
+                std::vector<float> data(floatCount);
+                float *dst = data.data();
+                if (horizontal)
+                {
+                    for (uint32_t row = 0; row < first.height; ++row)
+                    {
+                        for (size_t k = begin; k < end; ++k)
+                        {
+                            const Tile &tile = tiles[candidates[k]];
+                            size_t rowSize = tile.width * channelCount;
+                            dst = std::copy_n(tile.data.data() + row * rowSize, rowSize, dst);
+                        }
+                    }
+                    first.width = extent;
+                }
+                else
+                {
+                    for (size_t k = begin; k < end; ++k)
+                    {
+                        dst = std::copy(tiles[candidates[k]].data.begin(), tiles[candidates[k]].data.end(), dst);
+                    }
+                    first.height = extent;
+                }
+                first.data = std::move(data);
+
+                for (size_t k = begin + 1; k < end; ++k)
+                {
+                    Tile &merged = tiles[candidates[k]];
+                    merged.width = merged.height = 0;
+                    merged.data = {};
+                }
+                mStats.coalesced += end - begin - 1;
+            }
+            remaining.push_back(candidates[begin]);
+            begin = end;
+        }
+        candidates = std::move(remaining);
+    }
+
+    bool ensureUpstream()
+    {
+        if (mUpstream.isConnected())
+        {
+            return true;
+        }
+
+        auto now = Clock::now();
+        if (now < mNextConnectAttempt)
+        {
+            return false;
+        }
+        mNextConnectAttempt = now + std::chrono::seconds(1);
+
+        if (mUpstream.connect() != tevclient::Error::Ok)
+        {
+            std::fprintf(stderr, "tevbroker: upstream connection failed: %s\n", mUpstream.lastErrorString());
+            return false;
+        }
+        std::printf("tevbroker: connected to upstream\n");
+        return true;
+    }
+
+    /**
+     * Token bucket limiting the upstream rate. Returns false if the bucket is empty, in which
+     * case sending resumes at mResumeTime. Sending may overdraw the bucket by one message.
+     */
+    bool hasTokens()
+    {
+        if (mOptions.rateMBps <= 0.0)
+        {
+            return true;
+        }
+
+        double rate = mOptions.rateMBps * 1e6;
+        auto now = Clock::now();
+        double elapsed = std::chrono::duration<double>(now - mLastRefill).count();
+        mLastRefill = now;
+        mTokens = std::min(mTokens + elapsed * rate, rate * 0.1);
+        if (mTokens >= 0.0)
+        {
+            return true;
+        }
+        mResumeTime = now + std::chrono::ceil<Clock::duration>(std::chrono::duration<double>(-mTokens / rate));
+        return false;
+    }
+
+    void consumeTokens(size_t bytes)
+    {
+        if (mOptions.rateMBps > 0.0)
+        {
+            mTokens -= static_cast<double>(bytes);
+        }
+    }
+
+    /// Send an entry upstream. Returns false if the rate limit interrupted it, the rest is sent by a later call.
+    bool forward(Entry &entry)
+    {
+        tevclient::Error error = tevclient::Error::Ok;
+        if (entry.isUpdate)
+        {
+            if (!entry.inFlight)
+            {
+                mergeTiles(entry.tiles, entry.channelNames.size());
+                entry.inFlight = true;
+            }
+
+            uint32_t channelCount = static_cast<uint32_t>(entry.channelNames.size());
+            std::vector<const char *> names;
+            std::vector<uint64_t> offsets, strides(channelCount, channelCount);
+            for (uint32_t c = 0; c < channelCount; ++c)
+            {
+                names.push_back(entry.channelNames[c].c_str());
+                offsets.push_back(c);
+            }
+
+            for (; entry.nextTile < entry.tiles.size(); ++entry.nextTile)
+            {
+                if (!hasTokens())
+                {
+                    return false;
+                }
+                Tile &tile = entry.tiles[entry.nextTile];
+                size_t bytes = tile.data.size() * sizeof(float);
+                consumeTokens(bytes);
+                // Focus is requested once for the whole group, not again for every tile.
+                error = mUpstream.updateImage(entry.imageName.c_str(), tile.x, tile.y, tile.width, tile.height,
+                                              channelCount, names.data(), offsets.data(), strides.data(),
+                                              tile.data.data(), tile.data.size(),
+                                              entry.grabFocus && entry.nextTile == 0);
+                if (error != tevclient::Error::Ok)
+                {
+                    break;
+                }
+                ++mStats.messages;
+                mStats.bytes += bytes;
+                std::vector<float>().swap(tile.data);
+                releaseBytes(entry, bytes);
+            }
+        }
+        else
+        {
+            if (!hasTokens())
+            {
+                return false;
+            }
+            const Packet &packet = entry.control;
+            consumeTokens(packet.commands.size() * sizeof(tevclient::VgCommand) + packet.imageName.size());
+            switch (packet.type)
+            {
+            case protocol::OpenImageV2:
+                error = mUpstream.openImage(packet.imageName.c_str(), packet.channelSelector.c_str(), packet.grabFocus);
+                break;
+            case protocol::ReloadImage:
+                error = mUpstream.reloadImage(packet.imageName.c_str(), packet.grabFocus);
+                break;
+            case protocol::CloseImage:
+                error = mUpstream.closeImage(packet.imageName.c_str());
+                break;
+            case protocol::CreateImage: {
+                std::vector<const char *> names;
+                for (auto &name : packet.channelNames)
+                {
+                    names.push_back(name.c_str());
+                }
+                error = mUpstream.createImage(packet.imageName.c_str(), packet.width, packet.height,
+                                              static_cast<uint32_t>(names.size()), names.data(), packet.grabFocus);
+                break;
+            }
+            case protocol::VectorGraphics:
+                error = mUpstream.vectorGraphics(packet.imageName.c_str(), packet.commands.data(),
+                                                 packet.commands.size(), packet.append, packet.grabFocus);
+                break;
+            }
+            ++mStats.messages;
+        }
+
+        if (error != tevclient::Error::Ok)
+        {
+            std::fprintf(stderr, "tevbroker: upstream send failed: %s\n", mUpstream.lastErrorString());
+            // Packets are validated when they arrive, so only a broken connection is worth reconnecting for.
+            if (error == tevclient::Error::SocketError || error == tevclient::Error::NotConnected)
+            {
+                mUpstream.disconnect();
+            }
+        }
+        return true;
+    }
+
+    /// Send pending entries until they run out or the rate limit is reached, which sets mThrottled.
+    void flush()
+    {
+        mThrottled = false;
+        if (mPending.empty() || !ensureUpstream())
+        {
+            return;
+        }
+
+        while (!mPending.empty())
+        {
+            Entry &entry = mPending.front();
+            if (mOptions.verbose && !entry.inFlight)
+            {
+                if (entry.isUpdate)
+                {
+                    std::printf("tevbroker: %zu tile(s) for '%s'\n", entry.tiles.size(), entry.imageName.c_str());
+                }
+                else
+                {
+                    std::printf("tevbroker: %s '%s'\n", packetTypeName(entry.control.type),
+                                entry.control.imageName.c_str());
+                }
+            }
+            if (!forward(entry))
+            {
+                mThrottled = true;
+                return;
+            }
+            // Entries that failed to send are dropped, the next flush reconnects.
+            mPendingBytes -= entry.bytes;
+            mPending.pop_front();
+            if (!mUpstream.isConnected())
+            {
+                break;
+            }
+        }
+    }
+
+    Options mOptions;
+    tevclient::Client mUpstream;
+    FrameServer mServer;
+    std::deque<Entry> mPending;
+    size_t mPendingBytes{0};
+
+    Clock::time_point mNextConnectAttempt{};
+    Clock::time_point mLastRefill{};
+    double mTokens{0.0};
+    bool mThrottled{false};
+    Clock::time_point mResumeTime{};
+
+    struct
+    {
+        size_t packets{0};
+        size_t updates{0};
+        size_t coalesced{0};
+        size_t messages{0};
+        size_t bytes{0};
+    } mStats;
+};
+
+/// Stand-in for tev: prints every packet it receives.
+int runSink(uint16_t port)
+{
+    int tcp = listenTcp(port);
+    if (tcp < 0)
+    {
+        std::fprintf(stderr, "tevbroker: failed to listen on port %u\n", port);
+        return 1;
+    }
+
+    size_t packetCount = 0;
+    FrameServer server([&packetCount](const uint8_t *data, size_t size) {
+        Packet packet;
+        std::string error;
+        ++packetCount;
+        if (!decodePacket(data, size, packet, error))
+        {
+            std::printf("sink: invalid packet (%zu bytes): %s\n", size, error.c_str());
+        }
+        else if (packet.type == protocol::UpdateImageV3)
+        {
+            std::printf("sink: %s '%s' region %u,%u %ux%u, %zu channel(s), %zu bytes%s\n",
+                        packetTypeName(packet.type), packet.imageName.c_str(), packet.x, packet.y, packet.width,
+                        packet.height, packet.channelNames.size(), size, packet.grabFocus ? ", grab focus" : "");
+        }
+        else if (packet.type == protocol::VectorGraphics)
+        {
+            std::printf("sink: %s '%s' %zu command(s), append=%d\n", packetTypeName(packet.type),
+                        packet.imageName.c_str(), packet.commands.size(), packet.append ? 1 : 0);
+        }
+        else
+        {
+            std::printf("sink: %s '%s'\n", packetTypeName(packet.type), packet.imageName.c_str());
+        }
+        std::fflush(stdout);
+        return true;
+    });
+    server.addListener(tcp);
+
+    std::printf("sink: listening on 127.0.0.1:%u\n", port);
+    std::fflush(stdout);
+    while (!sStop)
+    {
+        server.poll(100);
+    }
+
+    std::printf("sink: received %zu packet(s)\n", packetCount);
+    return 0;
+}
+
+void printUsage()
+{
+    std::printf("Usage: tevbroker [options]\n"
+                "  --upstream <host:port>  tev instance to forward to (default 127.0.0.1:14158)\n"
+                "  --port <port>           loopback TCP port for producers (default 14159)\n"
+                "  --socket <path>         Unix socket for producers, empty to disable (default /tmp/tevbroker.sock)\n"
+                "  --rate <MB/s>           limit the upstream rate (default unlimited)\n"
+                "  --buffer <MB>           stop reading from producers while this much waits (default 256)\n"
+                "  --interval <ms>         coalescing interval (default 16)\n"
+                "  --sink <port>           run as a stand-in tev that prints received packets\n"
+                "  --verbose               print forwarded messages\n");
+}
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--upstream" && hasValue)
+        {
+            std::string value = argv[++i];
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos)
+            {
+                return false;
+            }
+            options.upstreamHost = value.substr(0, colon);
+            options.upstreamPort = static_cast<uint16_t>(std::atoi(value.c_str() + colon + 1));
+        }
+        else if (arg == "--port" && hasValue)
+        {
+            options.listenPort = static_cast<uint16_t>(std::atoi(argv[++i]));
+        }
+        else if (arg == "--socket" && hasValue)
+        {
+            options.socketPath = argv[++i];
+        }
+        else if (arg == "--rate" && hasValue)
+        {
+            options.rateMBps = std::atof(argv[++i]);
+        }
+        else if (arg == "--buffer" && hasValue)
+        {
+            options.bufferMB = std::atof(argv[++i]);
+        }
+        else if (arg == "--interval" && hasValue)
+        {
+            options.intervalMs = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--sink" && hasValue)
+        {
+            options.sinkPort = std::atoi(argv[++i]);
+        }
+        else if (arg == "--verbose")
+        {
+            options.verbose = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        return 1;
+    }
+
+    std::signal(SIGINT, [](int) { sStop = true; });
+    std::signal(SIGTERM, [](int) { sStop = true; });
+
+    if (options.sinkPort >= 0)
+    {
+        return runSink(static_cast<uint16_t>(options.sinkPort));
+    }
+
+    if (!tevclient::initialize())
+    {
+        return 1;
+    }
+    Broker broker(options);
+    int result = broker.run();
+    tevclient::shutdown();
+    return result;
+}
@@ -203,8 +203,398 @@ enum class Error
     NotConnected,
     SocketError,
     ArgumentError,
+    Cancelled,
+    OutOfMemory,
+};
+
+/// Handle to a prepared update layout, see Client::prepareUpdate().
+using PreparedUpdate = uint32_t;
+
+/// Identifies an image update, see Client::lastUploadId().
+using UploadId = uint64_t;
+
+/// State of an image update.
+enum class UploadState
+{
+    Queued,
+    InProgress,
+    Completed,
+    Cancelled,
+    Failed,
+};
+
+/// Progress of an image update.
+struct UploadProgress
+{
+    UploadId id{0};
+    UploadState state{UploadState::Queued};
+    uint64_t bytesSent{0};
+    uint64_t bytesTotal{0};
+    uint32_t rowsSent{0};
+    uint32_t rowsTotal{0};
+};
+
+/**
+ * @brief Callback reporting the progress of an image update.
+ *
+ * Called after every chunk and once more when the update finished.
+ * Returning false cancels the update at the next chunk boundary.
+ * In asynchronous mode, this is called from the writer thread.
+ */
+using UploadCallback = bool (*)(const UploadProgress &progress, void *userData);
+
+/// Order in which updates of different images are sent in asynchronous mode.
+enum class SchedulingPolicy
+{
+    /// Updates are sent in the order they were issued.
+    Fifo,
+    /// Images take turns, each sending one chunk per turn.
+    RoundRobin,
+    /// Images share the bandwidth in proportion to their weights.
+    WeightedFair,
+};
+
+/// Amount of data that has not reached tev yet, see Client::getBacklog().
+struct Backlog
+{
+    /// Bytes written to the socket that the kernel has not sent yet.
+    /// Only available on Linux (SIOCOUTQ) and macOS (SO_NWRITE), 0 elsewhere.
+    size_t socketBytes{0};
+    /// Bytes of encoded frames queued inside the client (an open batch or the asynchronous queues).
+    size_t queuedBytes{0};
+    /// Estimated rate at which the backlog drains in bytes per second, 0 until measured on the current connection.
+    double drainRate{0.0};
+};
+
+/**
+ * @brief Source of the memory used by a Client.
+ *
+ * Must outlive the clients using it. In asynchronous mode, it is also called from the writer thread.
+ */
+class Allocator
+{
+public:
+    virtual ~Allocator() = default;
+
+    /**
+     * Allocate size bytes with the given alignment. Returns nullptr if out of memory, which client
+     * calls report as Error::OutOfMemory. VgBuffer and DebugDraw, whose drawing functions return
+     * nothing, throw std::bad_alloc instead.
+     */
+    virtual void *allocate(size_t size, size_t alignment) = 0;
+
+    /// Release memory returned by allocate(), called with the same size and alignment.
+    virtual void deallocate(void *ptr, size_t size, size_t alignment) = 0;
+};
+
+/**
+ * @brief Allocator handing out memory from a caller-provided buffer.
+ *
+ * Freed memory is reused, with adjacent free ranges merged. Returns nullptr once the buffer
+ * has no free range large enough. This allocator is thread-safe.
+ */
+class ArenaAllocator : public Allocator
+{
+public:
+    /**
+     * @brief Constructor.
+     *
+     * @param buffer Memory to allocate from, must outlive the allocator.
+     * @param size Size of the buffer in bytes.
+     */
+    ArenaAllocator(void *buffer, size_t size);
+
+    ~ArenaAllocator() override;
+
+    ArenaAllocator(const ArenaAllocator &) = delete;
+    ArenaAllocator &operator=(const ArenaAllocator &) = delete;
+
+    void *allocate(size_t size, size_t alignment) override;
+    void deallocate(void *ptr, size_t size, size_t alignment) override;
+
+    /// Return the number of bytes currently allocated (rounded up to 16 bytes per allocation).
+    size_t used() const;
+
+private:
+    struct FreeBlock;
+
+    /// Free ranges, sorted by address.
+    FreeBlock *mFreeList{nullptr};
+    size_t mUsed{0};
+    /// Storage for the lock guarding the free list, which is only known to the implementation.
+    alignas(std::max_align_t) mutable unsigned char mLockStorage[128];
 };
 
+/**
+ * @brief Level of detail settings for the batch functions of VgBuffer.
+ *
+ * Keeps the number of commands bounded by the image resolution rather than by
+ * the size of the input. All settings apply in image space, after the transform.
+ */
+struct VgLod
+{
+    /// Size of the image in pixels, geometry outside of it is culled. 0 disables culling and merging.
+    float width{0.f};
+    float height{0.f};
+    /**
+     * Merge primitives smaller than a pixel: within a path, only the first one in each pixel is
+     * kept, and line strip points in the same pixel as the previous point are dropped.
+     */
+    bool mergeSubPixel{true};
+    /// Batch geometry is dropped once the buffer holds this many commands, 0 for no limit.
+    size_t commandBudget{0};
+    /**
+     * Simplify line strips so that every removed point lies within this distance (in pixels) of
+     * the result, 0 disables simplification. Does not require the image size.
+     */
+    float simplifyTolerance{0.f};
+};
+
+/// Settings for VgBuffer::arrows().
+struct VgArrowStyle
+{
+    /// Distance between samples in pixels.
+    uint32_t spacing{16};
+    /// Length of an arrow per unit of vector magnitude.
+    float scale{1.f};
+    /// Length of the arrow head relative to the arrow.
+    float headSize{0.3f};
+    /// Vectors with a magnitude up to this are not drawn.
+    float minMagnitude{0.f};
+    /// Magnitude mapped to the last color.
+    float maxMagnitude{1.f};
+    /**
+     * Colors by magnitude, [minMagnitude, maxMagnitude] is split evenly into colorCount buckets.
+     * If nullptr, the arrows are drawn with the current stroke color.
+     */
+    const VgCommand::Color *colors{nullptr};
+    size_t colorCount{0};
+};
+
+/**
+ * @brief Buffer of vector graphics commands in wire format.
+ *
+ * Commands are encoded as they are added, so a buffer can be sent with
+ * Client::vectorGraphics() without encoding it again, and be sent repeatedly.
+ * The batch functions take structure-of-arrays input and add one command per
+ * element, without going through temporary VgCommand objects. They only add the
+ * geometry, paths are begun, filled and stroked with regular commands, e.g.
+ *
+ *     buffer.add(VgCommand::beginPath());
+ *     buffer.circles(xs, ys, 1.f, count);
+ *     buffer.add(VgCommand::fill());
+ *
+ * Coordinates are mapped through the current transform as they are added, which
+ * is modified with translate(), scale(), rotate() and transform(), and saved and
+ * restored with pushTransform() and popTransform(). Radii are scaled along with
+ * the coordinates; circles under a non-uniform scale become ellipses. Under a
+ * rotation or shear, rectangles become closed polygons and ellipses and rounded
+ * rectangles cover the axis-aligned bounds of the transformed shape.
+ */
+class VgBuffer
+{
+public:
+    VgBuffer();
+
+    /**
+     * @brief Constructor using a custom allocator.
+     *
+     * @param allocator Allocator, must outlive the buffer.
+     */
+    explicit VgBuffer(Allocator &allocator);
+
+    ~VgBuffer();
+
+    VgBuffer(const VgBuffer &) = delete;
+    VgBuffer(VgBuffer &&) = delete;
+    VgBuffer &operator=(const VgBuffer &) = delete;
+    VgBuffer &operator=(VgBuffer &&) = delete;
+
+    /// Add a command.
+    void add(const VgCommand &command);
+
+    /// Add an array of commands.
+    void add(const VgCommand *commands, size_t count);
+
+    /**
+     * @brief Add a polyline: a MoveTo to the first point and a LineTo to each following point.
+     *
+     * @param xs X coordinates.
+     * @param ys Y coordinates.
+     * @param count Number of points.
+     */
+    void lineStrip(const float *xs, const float *ys, size_t count);
+
+    /**
+     * @brief Add multiple polylines, simplifying them in parallel if enabled (see VgLod::simplifyTolerance).
+     *
+     * @param xs X coordinates of all points, polylines follow each other.
+     * @param ys Y coordinates of all points.
+     * @param counts Number of points of each polyline.
+     * @param stripCount Number of polylines.
+     */
+    void lineStrips(const float *xs, const float *ys, const size_t *counts, size_t stripCount);
+
+    /**
+     * @brief Add circles.
+     *
+     * @param cx X coordinates of the centers.
+     * @param cy Y coordinates of the centers.
+     * @param radii Radii.
+     * @param count Number of circles.
+     */
+    void circles(const float *cx, const float *cy, const float *radii, size_t count);
+
+    /// Add circles with the same radius.
+    void circles(const float *cx, const float *cy, float radius, size_t count);
+
+    /**
+     * @brief Add rectangles.
+     *
+     * @param x X coordinates of the top left corners.
+     * @param y Y coordinates of the top left corners.
+     * @param width Widths.
+     * @param height Heights.
+     * @param count Number of rectangles.
+     */
+    void rects(const float *x, const float *y, const float *width, const float *height, size_t count);
+
+    /**
+     * @brief Add arrows visualizing a 2D vector field.
+     *
+     * The field is sampled at the centers of a grid of style.spacing pixels, and an
+     * arrow along the vector is centered on each sample. Unlike the other batch
+     * functions, this adds complete paths: one stroked path per color bucket, each
+     * preceded by its StrokeColor.
+     *
+     * @param field Field data as array of floats, in the layout accepted by Client::updateImage().
+     * @param width Width of the field in pixels.
+     * @param height Height of the field in pixels.
+     * @param channelOffsets Offsets of the two channels (optional, defaults to interleaved).
+     * @param channelStrides Strides of the two channels (optional, defaults to interleaved).
+     * @param style Arrow settings.
+     */
+    void arrows(const float *field, uint32_t width, uint32_t height, const uint64_t *channelOffsets,
+                const uint64_t *channelStrides, const VgArrowStyle &style);
+
+    /**
+     * @brief Add isolines of a scalar image, computed with marching squares.
+     *
+     * The cells between neighboring pixel centers are processed in parallel, and the segments
+     * are joined into polylines, closed if the isoline is. Like arrows(), this adds complete
+     * paths: one stroked path per level, preceded by its StrokeColor if colors is given. The
+     * polylines are added like lineStrips(), so simplification and culling apply.
+     *
+     * @param image Image data as array of floats, in the layout accepted by Client::updateImage().
+     * @param width Width of the image in pixels.
+     * @param height Height of the image in pixels.
+     * @param channelOffset Offset of the channel to contour.
+     * @param channelStride Stride of the channel to contour.
+     * @param levels Values to draw isolines at.
+     * @param levelCount Number of levels.
+     * @param colors Stroke color of each level (optional, if nullptr the current stroke color is used).
+     */
+    void isolines(const float *image, uint32_t width, uint32_t height, uint64_t channelOffset, uint64_t channelStride,
+                  const float *levels, size_t levelCount, const VgCommand::Color *colors = nullptr);
+
+    /**
+     * @brief Add the edges of a triangle mesh.
+     *
+     * The vertices are projected to pixel coordinates, edges shared by several triangles are
+     * drawn once, and edges are clipped to the near plane and to the image. The remaining edges
+     * are joined into as few polylines as possible and added as one stroked path with the current
+     * stroke color. The polylines are added like lineStrips(), so the transform, simplification
+     * and culling apply after clipping.
+     *
+     * @param positions Vertex positions, 3 floats per vertex.
+     * @param vertexCount Number of vertices.
+     * @param indices Vertex indices, 3 per triangle. Edges with an index out of range are skipped.
+     * @param triangleCount Number of triangles.
+     * @param projection Row-major 4x4 matrix mapping positions to homogeneous pixel coordinates
+     *                   (optional, if nullptr x and y of the positions are pixel coordinates).
+     * @param width Width of the image to clip to.
+     * @param height Height of the image to clip to.
+     */
+    void wireframe(const float *positions, size_t vertexCount, const uint32_t *indices, size_t triangleCount,
+                   const float *projection, uint32_t width, uint32_t height);
+
+    /// Save the current transform.
+    void pushTransform();
+
+    /// Restore the last saved transform, does nothing if none was saved.
+    void popTransform();
+
+    /// Reset the current transform to the identity.
+    void resetTransform();
+
+    /// Translate subsequent commands.
+    void translate(float x, float y);
+
+    /// Scale subsequent commands.
+    void scale(float x, float y);
+
+    /// Rotate subsequent commands by angle (in radians).
+    void rotate(float angle);
+
+    /**
+     * @brief Multiply the current transform by an affine transform, applied before the current transform.
+     *
+     * A point (x, y) is mapped to (a * x + c * y + e, b * x + d * y + f).
+     */
+    void transform(float a, float b, float c, float d, float e, float f);
+
+    /**
+     * @brief Set the level of detail settings for the batch functions.
+     *
+     * Commands added with add() are never dropped, so paths are still filled and stroked.
+     *
+     * @param lod Settings, a default constructed VgLod disables level of detail.
+     */
+    void setLod(const VgLod &lod);
+
+    /// Return the number of primitives (or line strip points) dropped by the level of detail settings.
+    size_t droppedCount() const;
+
+    /// Remove all commands and reset the transform, keeping the allocated memory.
+    void clear();
+
+    /// Return the number of commands.
+    size_t commandCount() const;
+
+    /// Return the encoded commands.
+    const uint8_t *data() const;
+
+    /// Return the size of the encoded commands in bytes.
+    size_t size() const;
+
+private:
+    class Impl;
+    Impl *mImpl;
+};
+
+/**
+ * @brief Optimize a sequence of vector graphics commands in place.
+ *
+ * Removes redundant FillColor and StrokeColor commands, and merges consecutive
+ * paths drawn by a single Fill or Stroke of the same opaque color into a single
+ * path, reducing both the message size and the number of draw calls in tev.
+ * Translucent paths, paths that are both filled and stroked, and paths containing
+ * PathWinding commands are never merged, as overlaps would render differently.
+ *
+ * With reorder, paths are also merged with earlier paths of the same style, moving
+ * them past paths with different style as long as their bounds do not overlap.
+ * The bounds of strokes assume the default stroke width.
+ *
+ * @param commands Commands, rewritten in place.
+ * @param count Number of commands.
+ * @param reorder Allow reordering paths whose bounds do not overlap.
+ * @return New number of commands, never larger than count.
+ */
+size_t optimizeVgCommands(VgCommand *commands, size_t count, bool reorder = false);
+
+/// Optimize a sequence of vector graphics commands in place, using a custom allocator for temporary memory.
+size_t optimizeVgCommands(VgCommand *commands, size_t count, bool reorder, Allocator &allocator);
+
 /**
  * @brief Initialize the tev client library.
  *
@@ -228,7 +618,10 @@ void shutdown();
  * @brief Class for remotely controlling the tev image viewer.
  *
  * Communication is unidirectional (client -> tev server).
- * The API is not thread-safe and all calls are blocking.
+ * The API is not thread-safe, except for image updates in
+ * thread-safe mode (see setThreadSafe()), and all calls are
+ * blocking, except while a batch is open (see beginBatch())
+ * or in asynchronous mode (see setAsync()).
  *
  * Note that a connection is not automatically established.
  * Before sending any commands, the connection needs to be
@@ -242,12 +635,34 @@ public:
      *
      * Note that the connection is not established automatically.
      * You need to call connect() to open the connection.
+     * On POSIX systems, a hostname of the form "unix:/path/to/socket"
+     * connects to a Unix domain socket instead (e.g. a local tevbroker).
      *
      * @param hostname Hostname
      * @param port Port
      */
     Client(const char *hostname = "127.0.0.1", uint16_t port = 14158);
 
+    /**
+     * @brief Constructor using a custom allocator.
+     *
+     * All memory owned by the client, including its own state, is requested from the allocator.
+     * Buffers are reused between calls and error messages are formatted into a fixed size buffer,
+     * so in synchronous mode without an upload callback, sending a message allocates only until
+     * the buffers reached the size of the largest message. Asynchronous mode and chunked uploads
+     * allocate their queues from the allocator, the writer thread itself never allocates.
+     * Resolving the hostname in connect() and starting the writer thread in setAsync() are left
+     * to the system and may use the global heap.
+     *
+     * Calls fail with Error::OutOfMemory if the allocator runs out. Only if the client's own state
+     * cannot be allocated, the constructor throws std::bad_alloc.
+     *
+     * @param hostname Hostname
+     * @param port Port
+     * @param allocator Allocator, must outlive the client.
+     */
+    Client(const char *hostname, uint16_t port, Allocator &allocator);
+
     ~Client();
 
     Client(const Client &) = delete;
@@ -347,6 +762,69 @@ public:
                       uint32_t channelCount, const char **channelNames, uint64_t *channelOffsets,
                       uint64_t *channelStrides, const float *imageData, size_t imageDataCount, bool grabFocus = true);
 
+    /**
+     * @brief Update an existing image at a resolution the connection can sustain.
+     *
+     * This is meant for live previews over slow links. Takes the same arguments as updateImage().
+     * Based on the measured bandwidth (see getBandwidth()) and the preview frame rate
+     * (see setPreviewFrameRate()), the region is reduced with a box filter by a power of two
+     * factor and sent in its place at the reduced size, one region message per row of blocks.
+     * In asynchronous mode, the reduced region is queued like an updateImage() call instead.
+     * The factor steps back to full resolution when the connection allows it.
+     *
+     * @param downsampleFactor If not nullptr, set to the downsample factor used for this frame.
+     * @return Error::Ok if successful.
+     */
+    Error updateImagePreview(const char *imageName, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                             uint32_t channelCount, const char **channelNames, uint64_t *channelOffsets,
+                             uint64_t *channelStrides, const float *imageData, size_t imageDataCount,
+                             bool grabFocus = true, uint32_t *downsampleFactor = nullptr);
+
+    /**
+     * @brief Prepare repeated updates of an image with the same channel layout.
+     *
+     * Validates the layout once and pre-encodes the parts of the update message that do
+     * not change between updates. Use sendPrepared() to send regions with this layout.
+     * Channel names, offsets and strides have the same defaults as in updateImage().
+     *
+     * @param imageName Name of the image.
+     * @param channelCount Number of channels.
+     * @param channelNames Channel names (optional if number of channels <= 4).
+     * @param channelOffsets Channel offsets (optional if number of channels <= 4).
+     * @param channelStrides Channel strides (optional if number of channels <= 4).
+     * @param handle Set to the handle of the prepared layout.
+     * @param grabFocus Select the image in tev.
+     * @return Error::Ok if successful.
+     */
+    Error prepareUpdate(const char *imageName, uint32_t channelCount, const char **channelNames,
+                        const uint64_t *channelOffsets, const uint64_t *channelStrides, PreparedUpdate &handle,
+                        bool grabFocus = true);
+
+    /**
+     * @brief Update a region of an image using a prepared layout.
+     *
+     * Equivalent to updateImage() with the layout passed to prepareUpdate(),
+     * but only the region is encoded per call.
+     *
+     * @param handle Handle returned by prepareUpdate().
+     * @param x X position of update region in pixels.
+     * @param y Y position of update region in pixels.
+     * @param width Width of update region in pixels.
+     * @param height Height of update region in pixels.
+     * @param imageData Image data as array of floats.
+     * @param imageDataCount Number of elements (floats) in image data.
+     * @return Error::Ok if successful.
+     */
+    Error sendPrepared(PreparedUpdate handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                       const float *imageData, size_t imageDataCount);
+
+    /**
+     * @brief Release a prepared layout.
+     *
+     * @param handle Handle returned by prepareUpdate().
+     */
+    void releasePrepared(PreparedUpdate handle);
+
     /**
      * @brief Create a new image.
      *
@@ -368,6 +846,8 @@ public:
     /**
      * @brief Draw vector graphics on top of an image.
      *
+     * Large command lists are split into multiple messages, see setMaxVectorGraphicsSize().
+     *
      * @param imageName Name of the image.
      * @param commands Array of commands.
      * @param commandCount Number of elements in array of commands.
@@ -379,6 +859,300 @@ public:
     Error vectorGraphics(const char *imageName, const VgCommand *commands, size_t commandCount, bool append = true,
                          bool grabFocus = true);
 
+    /**
+     * @brief Draw vector graphics from a buffer on top of an image.
+     *
+     * The commands are sent as they are stored in the buffer.
+     *
+     * @param imageName Name of the image.
+     * @param buffer Buffer of commands.
+     * @param append Append to existing vector graphics.
+     * @param grabFocus Select the image in tev.
+     * @return Error::Ok if successful.
+     */
+    Error vectorGraphics(const char *imageName, const VgBuffer &buffer, bool append = true, bool grabFocus = true);
+
+    /**
+     * @brief Draw the same vector graphics on top of multiple images.
+     *
+     * The commands are encoded once, and the messages to the images only differ in
+     * the image name. Without batching or asynchronous mode, all messages are sent
+     * with a single gathered write sharing the encoded commands.
+     *
+     * @param imageNames Names of the images.
+     * @param imageCount Number of images.
+     * @param commands Array of commands.
+     * @param commandCount Number of elements in array of commands.
+     * @param append Append to existing vector graphics.
+     * @param grabFocus Select the images in tev (the last one ends up selected).
+     * @return Error::Ok if successful.
+     */
+    Error vectorGraphics(const char *const *imageNames, size_t imageCount, const VgCommand *commands,
+                         size_t commandCount, bool append = true, bool grabFocus = true);
+
+    /**
+     * @brief Draw vector graphics from a buffer on top of multiple images.
+     *
+     * @param imageNames Names of the images.
+     * @param imageCount Number of images.
+     * @param buffer Buffer of commands.
+     * @param append Append to existing vector graphics.
+     * @param grabFocus Select the images in tev (the last one ends up selected).
+     * @return Error::Ok if successful.
+     */
+    Error vectorGraphics(const char *const *imageNames, size_t imageCount, const VgBuffer &buffer,
+                         bool append = true, bool grabFocus = true);
+
+    /**
+     * @brief Set the vector graphics of an image, sending only what changed.
+     *
+     * The client retains the command count, size and hash of the commands last
+     * sent to each image with this function. Nothing is sent if the commands are
+     * unchanged. If they extend the previous commands, only the new commands are
+     * sent and appended. Otherwise all commands are sent, replacing the existing
+     * vector graphics. The retained state of an image is cleared when it is opened,
+     * reloaded, created or closed, or a send to it fails, and all of it when the
+     * connection is closed. Changes made with vectorGraphics() are not tracked, see
+     * forgetVectorGraphics().
+     *
+     * @param imageName Name of the image.
+     * @param commands Array of commands.
+     * @param commandCount Number of elements in array of commands.
+     * @param grabFocus Select the image in tev (only if something is sent).
+     * @return Error::Ok if successful.
+     */
+    Error updateVectorGraphics(const char *imageName, const VgCommand *commands, size_t commandCount,
+                               bool grabFocus = true);
+
+    /**
+     * @brief Set the vector graphics of an image from a buffer, sending only what changed.
+     *
+     * @param imageName Name of the image.
+     * @param buffer Buffer of commands.
+     * @param grabFocus Select the image in tev (only if something is sent).
+     * @return Error::Ok if successful.
+     */
+    Error updateVectorGraphics(const char *imageName, const VgBuffer &buffer, bool grabFocus = true);
+
+    /**
+     * @brief Forget the vector graphics retained for an image by updateVectorGraphics().
+     *
+     * The next update of the image replaces its vector graphics.
+     *
+     * @param imageName Name of the image.
+     */
+    void forgetVectorGraphics(const char *imageName);
+
+    /**
+     * @brief Start batching messages.
+     *
+     * While a batch is open, encoded messages accumulate in a contiguous buffer and
+     * are sent with a single gathered write when flush() or endBatch() is called,
+     * or when the buffer exceeds the batch threshold. Large image payloads are not
+     * copied into the buffer but written together with it.
+     * Batches can be nested, only the outermost endBatch() flushes.
+     */
+    void beginBatch();
+
+    /**
+     * @brief End the current batch.
+     *
+     * @return Error::Ok if successful.
+     */
+    Error endBatch();
+
+    /**
+     * @brief Send all batched messages.
+     *
+     * Batching stays enabled until endBatch() is called.
+     * In asynchronous mode, this waits until all queued messages are sent.
+     *
+     * @return Error::Ok if successful.
+     */
+    Error flush();
+
+    /**
+     * @brief Set the size at which a batch is flushed automatically.
+     *
+     * @param bytes Threshold in bytes (default 256 KB).
+     */
+    void setBatchThreshold(size_t bytes);
+
+    /**
+     * @brief Enable or disable asynchronous sending.
+     *
+     * In asynchronous mode, messages are queued and sent by a background writer thread
+     * and all calls return immediately. Control messages and vector graphics use a high
+     * priority lane. Image updates are cut at row boundaries into region messages of
+     * bounded size (see setMaxChunkSize()), and queued high priority messages are sent
+     * in between those chunks, so they are not stuck behind large uploads.
+     * Closing or re-creating an image drops its pending updates.
+     *
+     * The image data passed to updateImage() is not copied and must stay valid until
+     * flush() returns. Errors on the writer thread are reported by the next call.
+     * Disabling asynchronous mode waits for all queued messages to be sent.
+     *
+     * @param async Enable asynchronous mode.
+     * @return Error::Ok if successful.
+     */
+    Error setAsync(bool async);
+
+    /// Return true if asynchronous mode is enabled.
+    bool isAsync() const;
+
+    /**
+     * @brief Enable or disable thread-safe image updates.
+     *
+     * In thread-safe mode, updateImage() and sendPrepared() can be called from any number
+     * of threads at the same time. Each call copies the image data on the calling thread and
+     * queues it like an asynchronous update, which is enabled along with this mode: it is
+     * sent in chunks, scheduled fairly between images after other messages, and can be
+     * queried, cancelled and reported to the upload callback. Unlike asynchronous updates,
+     * the image data can be reused as soon as the call returns. While more than 256 MB of
+     * copies are queued, further calls wait for the writer thread to catch up.
+     *
+     * Other functions must not be called while such updates are in progress, and
+     * lastError() reports the last error of any thread. Disabling thread-safe mode also
+     * disables asynchronous mode, unless it was enabled before.
+     *
+     * @param threadSafe Enable thread-safe mode.
+     * @return Error::Ok if successful.
+     */
+    Error setThreadSafe(bool threadSafe);
+
+    /// Return true if thread-safe mode is enabled.
+    bool isThreadSafe() const;
+
+    /**
+     * @brief Set the maximum size of a single region message for chunked updates.
+     *
+     * Applies in asynchronous mode and while an upload callback is set.
+     * Chunks always contain at least one row.
+     *
+     * @param bytes Maximum chunk size in bytes (default 1 MB).
+     */
+    void setMaxChunkSize(size_t bytes);
+
+    /**
+     * @brief Set the maximum size of the commands in a single vector graphics message.
+     *
+     * Larger command lists are sent as a sequence of messages, the first one with
+     * the append flag passed to vectorGraphics() and the following ones appending
+     * to it. Messages always contain at least one command.
+     *
+     * @param bytes Maximum size of the encoded commands in bytes (default 1 MB).
+     */
+    void setMaxVectorGraphicsSize(size_t bytes);
+
+    /**
+     * @brief Set how pending updates of different images share the connection in asynchronous mode.
+     *
+     * Updates of the same image are always sent in order.
+     *
+     * @param policy Scheduling policy (default SchedulingPolicy::WeightedFair).
+     */
+    void setSchedulingPolicy(SchedulingPolicy policy);
+
+    /**
+     * @brief Set the weight of an image for SchedulingPolicy::WeightedFair.
+     *
+     * An image with weight 2 receives twice the bandwidth of an image with weight 1
+     * while both have pending updates.
+     *
+     * @param imageName Name of the image.
+     * @param weight Weight (default 1).
+     */
+    void setImageWeight(const char *imageName, float weight);
+
+    /**
+     * @brief Return the estimated bandwidth of the connection.
+     *
+     * The estimate is derived from the time spent writing to the socket.
+     *
+     * @return Bandwidth in bytes per second (0 until measured).
+     */
+    double getBandwidth() const;
+
+    /**
+     * @brief Set the frame rate that updateImagePreview() tries to sustain.
+     *
+     * @param frameRate Frames per second (default 30).
+     */
+    void setPreviewFrameRate(float frameRate);
+
+    /**
+     * @brief Set the largest downsample factor used by updateImagePreview().
+     *
+     * @param factor Maximum factor (default 16, clamped to [1, 65536]).
+     */
+    void setMaxPreviewDownsample(uint32_t factor);
+
+    /**
+     * @brief Return the id of the most recent updateImage() or sendPrepared() call.
+     *
+     * Every call to these functions is assigned an id, even if it failed validation.
+     * In thread-safe mode, returns the id of the most recent call on the calling thread.
+     */
+    UploadId lastUploadId() const;
+
+    /**
+     * @brief Query the progress of an image update.
+     *
+     * The final state of recent updates is kept, so it can be queried after completion.
+     * Updates that were sent as a single message (synchronous mode without an upload
+     * callback) are not tracked.
+     *
+     * @param id Id of the update.
+     * @param progress Progress of the update.
+     * @return Error::Ok if successful, Error::ArgumentError if the update is unknown.
+     */
+    Error getUploadProgress(UploadId id, UploadProgress &progress);
+
+    /**
+     * @brief Cancel an image update.
+     *
+     * The update stops at the next chunk boundary. Every chunk that was sent is a complete
+     * region message, so the connection stays valid and the image keeps the rows that
+     * were sent. Cancelling an update that already finished has no effect.
+     *
+     * @param id Id of the update.
+     * @return Error::Ok if successful.
+     */
+    Error cancelUpload(UploadId id);
+
+    /**
+     * @brief Cancel all pending updates of an image in asynchronous mode.
+     *
+     * Useful to discard the remainder of a frame before sending the next one.
+     *
+     * @param imageName Name of the image.
+     */
+    void cancelUploads(const char *imageName);
+
+    /**
+     * @brief Set a callback that reports the progress of image updates.
+     *
+     * While a callback is set, updateImage() sends the region in chunks (see setMaxChunkSize())
+     * in synchronous mode too, and returns Error::Cancelled if the callback cancelled it.
+     *
+     * @param callback Callback, or nullptr to remove it.
+     * @param userData User data passed to the callback.
+     */
+    void setUploadCallback(UploadCallback callback, void *userData = nullptr);
+
+    /**
+     * @brief Query the send backlog.
+     *
+     * Producers can use this to apply backpressure, e.g. skip or decimate an update
+     * before packing it when the backlog would take too long to drain.
+     * The drain rate is estimated from successive calls, so it is only available
+     * after this has been called at least twice.
+     *
+     * @param backlog Backlog statistics.
+     * @return Error::Ok if successful.
+     */
+    Error getBacklog(Backlog &backlog);
+
     /// Return the last error.
     Error lastError() const;
 
@@ -390,4 +1164,78 @@ private:
     Impl *mImpl;
 };
 
+/**
+ * @brief Immediate mode debug drawing, collected over a frame and sent once.
+ *
+ * Vector graphics can be drawn from any thread at any point of a frame. Each
+ * thread records into its own command lists, without locking once it has drawn
+ * for the first time. flush() ends the frame: the commands of all threads are
+ * merged per image, optimized with optimizeVgCommands() and replace the vector
+ * graphics of the image with Client::updateVectorGraphics(), so an unchanged
+ * frame sends nothing. Images drawn in the previous frame but not in this one
+ * are cleared. The command lists are cleared rather than freed, so drawing stops
+ * allocating after the first frames.
+ *
+ * While the client is not connected, flush() disables drawing and the drawing
+ * functions return immediately. Use isEnabled() to skip computing the geometry.
+ *
+ * Commands from different threads are concatenated in an unspecified order, so
+ * add() must be given complete paths that set the colors they use.
+ * flush() must not be called from several threads at the same time.
+ */
+class DebugDraw
+{
+public:
+    DebugDraw();
+
+    /**
+     * @brief Constructor using a custom allocator.
+     *
+     * @param allocator Allocator, must outlive the object and be thread-safe if drawing from several threads.
+     */
+    explicit DebugDraw(Allocator &allocator);
+
+    ~DebugDraw();
+
+    DebugDraw(const DebugDraw &) = delete;
+    DebugDraw(DebugDraw &&) = delete;
+    DebugDraw &operator=(const DebugDraw &) = delete;
+    DebugDraw &operator=(DebugDraw &&) = delete;
+
+    /// Return true if drawing is recorded, false while the client of the last flush() is not connected.
+    bool isEnabled() const;
+
+    /**
+     * @brief Add commands to an image.
+     *
+     * @param imageName Name of the image.
+     * @param commands Array of commands.
+     * @param commandCount Number of elements in array of commands.
+     */
+    void add(const char *imageName, const VgCommand *commands, size_t commandCount);
+
+    /// Draw a line.
+    void line(const char *imageName, float x0, float y0, float x1, float y1, const VgCommand::Color &color);
+
+    /// Draw a circle, filled or outlined.
+    void circle(const char *imageName, float x, float y, float radius, const VgCommand::Color &color,
+                bool fill = false);
+
+    /// Draw a rectangle, filled or outlined.
+    void rect(const char *imageName, float x, float y, float width, float height, const VgCommand::Color &color,
+              bool fill = false);
+
+    /**
+     * @brief End the frame and send what was drawn.
+     *
+     * @param client Client to send to.
+     * @return Error::Ok if successful, otherwise the first error.
+     */
+    Error flush(Client &client);
+
+private:
+    class Impl;
+    Impl *mImpl;
+};
+
 } // namespace tevclient
@@ -0,0 +1,151 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#pragma once
+
+#include "tevclient.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <new>
+#include <scoped_allocator>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Containers used by the client, with all memory coming from a tevclient::Allocator.
+//
+// Standard containers are used with StlAllocator, which forwards to the allocator the client
+// was created with. Containers must be constructed with the client's allocator, a default
+// constructed StlAllocator falls back to the global heap.
+
+namespace tevclient
+{
+
+/// Allocator using the global heap.
+class DefaultAllocator : public Allocator
+{
+public:
+    void *allocate(size_t size, size_t /* alignment */) override
+    {
+        return ::operator new(size, std::nothrow);
+    }
+
+    void deallocate(void *ptr, size_t /* size */, size_t /* alignment */) override
+    {
+        ::operator delete(ptr);
+    }
+};
+
+inline Allocator &defaultAllocator()
+{
+    static DefaultAllocator allocator;
+    return allocator;
+}
+
+/**
+ * Allocate memory for a container or object. Running out of memory throws std::bad_alloc, as
+ * standard containers require, which the public functions of the client turn into
+ * Error::OutOfMemory.
+ */
+inline void *allocateOrThrow(Allocator &allocator, size_t size, size_t alignment)
+{
+    void *ptr = allocator.allocate(size, alignment);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+/// Adapts a tevclient::Allocator for use with standard containers.
+template <typename T> class StlAllocator
+{
+public:
+    using value_type = T;
+
+    StlAllocator() : mAllocator(&defaultAllocator())
+    {
+    }
+
+    StlAllocator(Allocator &allocator) : mAllocator(&allocator)
+    {
+    }
+
+    template <typename U> StlAllocator(const StlAllocator<U> &other) : mAllocator(&other.allocator())
+    {
+    }
+
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(allocateOrThrow(*mAllocator, count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, size_t count)
+    {
+        mAllocator->deallocate(ptr, count * sizeof(T), alignof(T));
+    }
+
+    Allocator &allocator() const
+    {
+        return *mAllocator;
+    }
+
+    template <typename U> bool operator==(const StlAllocator<U> &other) const
+    {
+        return mAllocator == &other.allocator();
+    }
+
+    template <typename U> bool operator!=(const StlAllocator<U> &other) const
+    {
+        return mAllocator != &other.allocator();
+    }
+
+    // Containers keep their allocator when they are copied, moved or swapped.
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+private:
+    Allocator *mAllocator;
+};
+
+template <typename T> using Vector = std::vector<T, StlAllocator<T>>;
+template <typename T> using Deque = std::deque<T, StlAllocator<T>>;
+template <typename K, typename V> using Map = std::map<K, V, std::less<K>, StlAllocator<std::pair<const K, V>>>;
+using String = std::basic_string<char, std::char_traits<char>, StlAllocator<char>>;
+/// Strings in the vector are constructed with the vector's allocator.
+using StringVector = std::vector<String, std::scoped_allocator_adaptor<StlAllocator<String>>>;
+
+/// Destroys objects created with makeUnique().
+template <typename T> class AllocatorDeleter
+{
+public:
+    AllocatorDeleter() : mAllocator(&defaultAllocator())
+    {
+    }
+
+    AllocatorDeleter(Allocator &allocator) : mAllocator(&allocator)
+    {
+    }
+
+    void operator()(T *ptr) const
+    {
+        ptr->~T();
+        mAllocator->deallocate(ptr, sizeof(T), alignof(T));
+    }
+
+private:
+    Allocator *mAllocator;
+};
+
+template <typename T> using UniquePtr = std::unique_ptr<T, AllocatorDeleter<T>>;
+
+template <typename T, typename... Args> UniquePtr<T> makeUnique(Allocator &allocator, Args &&...args)
+{
+    void *memory = allocateOrThrow(allocator, sizeof(T), alignof(T));
+    return UniquePtr<T>(new (memory) T(std::forward<Args>(args)...), AllocatorDeleter<T>(allocator));
+}
+
+} // namespace tevclient
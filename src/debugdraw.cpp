@@ -0,0 +1,289 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "tevclient.h"
+#include "allocator.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace tevclient
+{
+
+/// Value of ThreadStream::activeFrame while the thread is not drawing.
+static constexpr uint64_t NoFrame = UINT64_MAX;
+
+/// Identifies DebugDraw objects in the thread local cache, as addresses can be reused.
+static std::atomic<uint64_t> sNextDebugDrawId{1};
+
+/// Commands drawn to an image, the name is kept while the commands are cleared every frame.
+struct ImageCommands
+{
+    ImageCommands(const char *name, Allocator &allocator) : name(name, allocator), commands(allocator) {}
+
+    String name;
+    Vector<VgCommand> commands;
+};
+
+/// List of images with their commands, looked up by name.
+class ImageList
+{
+public:
+    explicit ImageList(Allocator &allocator) : mImages(allocator) {}
+
+    ImageCommands &get(const char *name, Allocator &allocator)
+    {
+        // Debug drawing tends to hit the same image repeatedly.
+        if (mLast < mImages.size() && mImages[mLast].name == name)
+        {
+            return mImages[mLast];
+        }
+        for (mLast = 0; mLast < mImages.size(); ++mLast)
+        {
+            if (mImages[mLast].name == name)
+            {
+                return mImages[mLast];
+            }
+        }
+        mImages.emplace_back(name, allocator);
+        return mImages.back();
+    }
+
+    size_t size() const
+    {
+        return mImages.size();
+    }
+
+    ImageCommands &operator[](size_t index)
+    {
+        return mImages[index];
+    }
+
+private:
+    Vector<ImageCommands> mImages;
+    size_t mLast{0};
+};
+
+/**
+ * Commands drawn by one thread, double buffered by frame.
+ *
+ * The thread publishes the frame it is drawing to in activeFrame. flush() advances the frame and
+ * waits for every thread still drawing to the previous one, after which it owns the images of the
+ * previous frame until the next flush(), while the threads draw to the other images.
+ */
+struct ThreadStream
+{
+    ThreadStream(std::thread::id thread, Allocator &allocator)
+        : thread(thread), frames{ImageList(allocator), ImageList(allocator)}
+    {
+    }
+
+    std::thread::id thread;
+    std::atomic<uint64_t> activeFrame{NoFrame};
+    ImageList frames[2];
+};
+
+struct ThreadCache
+{
+    uint64_t owner;
+    ThreadStream *stream;
+};
+
+static thread_local ThreadCache tThreadCache{0, nullptr};
+
+class DebugDraw::Impl
+{
+public:
+    Impl(Allocator &allocator)
+        : mAllocator(allocator), mId(sNextDebugDrawId++), mStreams(allocator), mImages(allocator),
+          mCommands(allocator)
+    {
+    }
+
+    Allocator &allocator()
+    {
+        return mAllocator;
+    }
+
+    bool isEnabled() const
+    {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    void add(const char *imageName, const VgCommand *commands, size_t commandCount)
+    {
+        if (!isEnabled() || commandCount == 0)
+        {
+            return;
+        }
+
+        ThreadStream &stream = threadStream();
+        // Publish the frame before checking that it is still current, flush() advances the frame
+        // before checking the published ones, so one of the two sees the other.
+        uint64_t frame = mFrame.load();
+        for (;;)
+        {
+            stream.activeFrame.store(frame);
+            uint64_t current = mFrame.load();
+            if (current == frame)
+            {
+                break;
+            }
+            frame = current;
+        }
+        Vector<VgCommand> &list = stream.frames[frame & 1].get(imageName, mAllocator).commands;
+        list.insert(list.end(), commands, commands + commandCount);
+        stream.activeFrame.store(NoFrame, std::memory_order_release);
+    }
+
+    Error flush(Client &client)
+    {
+        uint64_t frame = mFrame.fetch_add(1);
+        for (size_t i = 0; i < mImages.size(); ++i)
+        {
+            mImages[i].commands.clear();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mStreamsMutex);
+            for (const UniquePtr<ThreadStream> &stream : mStreams)
+            {
+                while (stream->activeFrame.load(std::memory_order_acquire) == frame)
+                {
+                    std::this_thread::yield();
+                }
+                ImageList &images = stream->frames[frame & 1];
+                for (size_t i = 0; i < images.size(); ++i)
+                {
+                    Vector<VgCommand> &commands = images[i].commands;
+                    if (!commands.empty())
+                    {
+                        Vector<VgCommand> &merged = mImages.get(images[i].name.c_str(), mAllocator).commands;
+                        merged.insert(merged.end(), commands.begin(), commands.end());
+                        commands.clear();
+                    }
+                }
+            }
+        }
+
+        // Images that were not drawn have no commands, which clears what was sent before. Once
+        // cleared, updateVectorGraphics() sends nothing for them.
+        Error result = Error::Ok;
+        for (size_t i = 0; i < mImages.size(); ++i)
+        {
+            ImageCommands &image = mImages[i];
+            mCommands.assign(image.commands.begin(), image.commands.end());
+            size_t count = optimizeVgCommands(mCommands.data(), mCommands.size(), false, mAllocator);
+            Error error = client.updateVectorGraphics(image.name.c_str(), mCommands.data(), count, false);
+            if (result == Error::Ok)
+            {
+                result = error;
+            }
+        }
+
+        mEnabled.store(client.isConnected(), std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    /// Return the stream of the calling thread, created when it first draws.
+    ThreadStream &threadStream()
+    {
+        ThreadCache &cache = tThreadCache;
+        if (cache.owner == mId)
+        {
+            return *cache.stream;
+        }
+
+        std::thread::id thread = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(mStreamsMutex);
+        ThreadStream *stream = nullptr;
+        for (const UniquePtr<ThreadStream> &existing : mStreams)
+        {
+            if (existing->thread == thread)
+            {
+                stream = existing.get();
+                break;
+            }
+        }
+        if (!stream)
+        {
+            mStreams.push_back(makeUnique<ThreadStream>(mAllocator, thread, mAllocator));
+            stream = mStreams.back().get();
+        }
+        cache.owner = mId;
+        cache.stream = stream;
+        return *stream;
+    }
+
+    Allocator &mAllocator;
+    uint64_t mId;
+    std::atomic<bool> mEnabled{true};
+    std::atomic<uint64_t> mFrame{0};
+
+    std::mutex mStreamsMutex;
+    Vector<UniquePtr<ThreadStream>> mStreams;
+
+    /// Images drawn since the object was created, with the merged commands of the current frame.
+    ImageList mImages;
+    Vector<VgCommand> mCommands;
+};
+
+DebugDraw::DebugDraw() : DebugDraw(defaultAllocator())
+{
+}
+
+DebugDraw::DebugDraw(Allocator &allocator)
+{
+    void *memory = allocateOrThrow(allocator, sizeof(DebugDraw::Impl), alignof(DebugDraw::Impl));
+    mImpl = new (memory) DebugDraw::Impl(allocator);
+}
+
+DebugDraw::~DebugDraw()
+{
+    Allocator &allocator = mImpl->allocator();
+    mImpl->~Impl();
+    allocator.deallocate(mImpl, sizeof(DebugDraw::Impl), alignof(DebugDraw::Impl));
+}
+
+bool DebugDraw::isEnabled() const
+{
+    return mImpl->isEnabled();
+}
+
+void DebugDraw::add(const char *imageName, const VgCommand *commands, size_t commandCount)
+{
+    mImpl->add(imageName, commands, commandCount);
+}
+
+void DebugDraw::line(const char *imageName, float x0, float y0, float x1, float y1, const VgCommand::Color &color)
+{
+    VgCommand commands[5] = {VgCommand::strokeColor(color), VgCommand::beginPath(), VgCommand::moveTo({x0, y0}),
+                             VgCommand::lineTo({x1, y1}), VgCommand::stroke()};
+    mImpl->add(imageName, commands, 5);
+}
+
+void DebugDraw::circle(const char *imageName, float x, float y, float radius, const VgCommand::Color &color, bool fill)
+{
+    VgCommand commands[4] = {fill ? VgCommand::fillColor(color) : VgCommand::strokeColor(color), VgCommand::beginPath(),
+                             VgCommand::circle({x, y}, radius), fill ? VgCommand::fill() : VgCommand::stroke()};
+    mImpl->add(imageName, commands, 4);
+}
+
+void DebugDraw::rect(const char *imageName, float x, float y, float width, float height, const VgCommand::Color &color,
+                     bool fill)
+{
+    VgCommand commands[4] = {fill ? VgCommand::fillColor(color) : VgCommand::strokeColor(color), VgCommand::beginPath(),
+                             VgCommand::rect({x, y}, {width, height}), fill ? VgCommand::fill() : VgCommand::stroke()};
+    mImpl->add(imageName, commands, 4);
+}
+
+Error DebugDraw::flush(Client &client)
+{
+    return mImpl->flush(client);
+}
+
+} // namespace tevclient
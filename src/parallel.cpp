@@ -0,0 +1,266 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace tevclient
+{
+
+/// Range of tasks [begin, end) in one word, so that its owner and thieves take tasks with a single CAS.
+static uint64_t packRange(uint64_t begin, uint64_t end)
+{
+    return begin << 32 | end;
+}
+
+static uint64_t rangeBegin(uint64_t range)
+{
+    return range >> 32;
+}
+
+static uint64_t rangeEnd(uint64_t range)
+{
+    return range & UINT32_MAX;
+}
+
+/**
+ * Tasks of one parallelFor() call.
+ *
+ * Every participant owns a range of tasks and takes them from the front. Participants whose
+ * range is empty steal the back half of another range. All tasks start in the range of the
+ * calling thread. Ranges only ever shrink or are refilled by their owner, so once a
+ * participant finds all of them empty, the job has no work left.
+ */
+struct ParallelJob
+{
+    ParallelJob(void (*fn)(void *, size_t), void *context, size_t taskCount)
+        : fn(fn), context(context), remaining(taskCount)
+    {
+        ranges[0].store(packRange(0, taskCount));
+        for (size_t i = 1; i < MaxParallelTasks; ++i)
+        {
+            ranges[i].store(0);
+        }
+    }
+
+    bool hasWork() const
+    {
+        if (nextParticipant.load() >= MaxParallelTasks)
+        {
+            return false;
+        }
+        for (const std::atomic<uint64_t> &range : ranges)
+        {
+            uint64_t value = range.load();
+            if (rangeBegin(value) < rangeEnd(value))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Take the next task of a participant's own range.
+    bool pop(size_t participant, size_t &task)
+    {
+        std::atomic<uint64_t> &range = ranges[participant];
+        uint64_t value = range.load();
+        while (rangeBegin(value) < rangeEnd(value))
+        {
+            if (range.compare_exchange_weak(value, packRange(rangeBegin(value) + 1, rangeEnd(value))))
+            {
+                task = static_cast<size_t>(rangeBegin(value));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Steal half of another participant's range, returns its first task and keeps the rest.
+    bool steal(size_t participant, size_t &task)
+    {
+        for (size_t i = 1; i < MaxParallelTasks; ++i)
+        {
+            std::atomic<uint64_t> &victim = ranges[(participant + i) % MaxParallelTasks];
+            uint64_t value = victim.load();
+            while (rangeBegin(value) < rangeEnd(value))
+            {
+                uint64_t begin = rangeBegin(value), end = rangeEnd(value);
+                uint64_t split = end - (end - begin + 1) / 2;
+                if (victim.compare_exchange_weak(value, packRange(begin, split)))
+                {
+                    task = static_cast<size_t>(split);
+                    ranges[participant].store(packRange(split + 1, end));
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run(size_t participant)
+    {
+        size_t task;
+        while (pop(participant, task) || steal(participant, task))
+        {
+            fn(context, task);
+            if (remaining.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+    }
+
+    void (*fn)(void *, size_t);
+    void *context;
+    std::atomic<uint64_t> ranges[MaxParallelTasks];
+    std::atomic<size_t> nextParticipant{1};
+    std::atomic<size_t> remaining;
+    /// Number of pool threads working on the job, which must not be destroyed before it drops to 0.
+    std::atomic<size_t> users{0};
+    ParallelJob *next{nullptr};
+
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+/// Threads that help with the jobs of all parallelFor() calls in progress.
+class ThreadPool
+{
+public:
+    ThreadPool()
+    {
+        size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        mThreadCount = std::min(threads, MaxParallelTasks);
+        for (size_t i = 0; i + 1 < mThreadCount; ++i)
+        {
+            mWorkers[i] = std::thread(&ThreadPool::workerLoop, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCv.notify_all();
+        for (size_t i = 0; i + 1 < mThreadCount; ++i)
+        {
+            mWorkers[i].join();
+        }
+    }
+
+    size_t threadCount() const
+    {
+        return mThreadCount;
+    }
+
+    void run(size_t taskCount, void (*fn)(void *, size_t), void *context)
+    {
+        ParallelJob job(fn, context, taskCount);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            job.next = mJobs;
+            mJobs = &job;
+        }
+        mCv.notify_all();
+
+        job.run(0);
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.done.wait(lock, [&job] { return job.remaining.load() == 0; });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ParallelJob **link = &mJobs;
+            while (*link != &job)
+            {
+                link = &(*link)->next;
+            }
+            *link = job.next;
+        }
+        while (job.users.load() != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    ParallelJob *findJob() const
+    {
+        for (ParallelJob *job = mJobs; job; job = job->next)
+        {
+            if (job->hasWork())
+            {
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            ParallelJob *job = nullptr;
+            mCv.wait(lock, [&] { return mStop || (job = findJob()) != nullptr; });
+            if (mStop)
+            {
+                return;
+            }
+            ++job->users;
+            size_t participant = job->nextParticipant++;
+            lock.unlock();
+            if (participant < MaxParallelTasks)
+            {
+                job->run(participant);
+            }
+            --job->users;
+            lock.lock();
+        }
+    }
+
+    size_t mThreadCount;
+    std::thread mWorkers[MaxParallelTasks];
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    ParallelJob *mJobs{nullptr};
+    bool mStop{false};
+};
+
+static ThreadPool &threadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+size_t parallelThreadCount()
+{
+    return threadPool().threadCount();
+}
+
+void parallelForTasks(size_t taskCount, void (*fn)(void *, size_t), void *context)
+{
+    ThreadPool &pool = threadPool();
+    if (pool.threadCount() == 1)
+    {
+        for (size_t task = 0; task < taskCount; ++task)
+        {
+            fn(context, task);
+        }
+        return;
+    }
+    pool.run(taskCount, fn, context);
+}
+
+} // namespace tevclient
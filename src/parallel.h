@@ -0,0 +1,59 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace tevclient
+{
+
+/// Upper bound for the number of threads used by parallelFor().
+static constexpr size_t MaxParallelTasks = 16;
+
+/// Number of threads that run the tasks of parallelFor(), including the calling thread.
+size_t parallelThreadCount();
+
+/**
+ * Number of tasks to split work of the given size into, so that each task gets at least
+ * minPerTask items. Returns 1 if the work is not worth spreading across threads.
+ */
+inline size_t parallelTaskCount(size_t count, size_t minPerTask)
+{
+    return std::max<size_t>(std::min(parallelThreadCount(), count / std::max<size_t>(minPerTask, 1)), 1);
+}
+
+/// Run fn(context, task) for every task in [0, taskCount), see parallelFor().
+void parallelForTasks(size_t taskCount, void (*fn)(void *, size_t), void *context);
+
+/**
+ * Run fn(task) for every task in [0, taskCount) and wait for all of them.
+ *
+ * The calling thread and the threads of a shared pool steal tasks from each other, so
+ * tasks can be many (below 2^32) and of uneven size. Can be called from several threads
+ * at the same time and from within a task.
+ */
+template <typename F> void parallelFor(size_t taskCount, const F &fn)
+{
+    if (taskCount <= 1)
+    {
+        if (taskCount == 1)
+        {
+            fn(size_t(0));
+        }
+        return;
+    }
+    parallelForTasks(
+        taskCount, [](void *context, size_t task) { (*static_cast<const F *>(context))(task); },
+        const_cast<void *>(static_cast<const void *>(&fn)));
+}
+
+/// Range [begin, end) of task out of taskCount when splitting count items evenly.
+inline void taskRange(size_t task, size_t taskCount, size_t count, size_t &begin, size_t &end)
+{
+    begin = count * task / taskCount;
+    end = count * (task + 1) / taskCount;
+}
+
+} // namespace tevclient
@@ -0,0 +1,528 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#pragma once
+
+#include "tevclient.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Declarative description of the tev wire protocol.
+//
+// Every packet type has a plain struct holding its values and a schema listing its fields
+// in wire order. From the schema, packetSize() computes the exact encoded size,
+// encodePacket() writes into a preallocated buffer and decodePacket() reads it back.
+// As encoder and decoder are generated from the same field list they cannot diverge,
+// and the static assertions at the end of this file pin down the fixed part of each layout.
+//
+// Messages on the wire are prefixed by their total length (uint32_t, including the prefix).
+// Image data of update packets follows the encoded fields and is not part of the schema.
+
+namespace tevclient
+{
+namespace protocol
+{
+
+enum EPacketType : char
+{
+    OpenImage = 0,
+    ReloadImage = 1,
+    CloseImage = 2,
+    UpdateImage = 3,
+    CreateImage = 4,
+    UpdateImageV2 = 5, // Adds multi-channel support
+    UpdateImageV3 = 6, // Adds custom striding/offset support
+    OpenImageV2 = 7,   // Explicit separation of image name and channel selector
+    VectorGraphics = 8,
+};
+
+/// Number of floats following a vector graphics command of the given type, or -1 if the type is invalid.
+inline int vgCommandPayloadCount(VgCommand::EType type)
+{
+    static const int counts[] = {0, 0, 4, 0, 4, 0, 0, 0, 1, 0, 2, 2, 5, 6, 6, 3, 4, 4, 4, 5, 8};
+    int index = static_cast<int>(type);
+    return index >= 0 && index < static_cast<int>(sizeof(counts) / sizeof(counts[0])) ? counts[index] : -1;
+}
+
+/// Storage for decoded arrays. Strings are not copied, they point into the decoded buffer.
+class DecodeArena
+{
+public:
+    template <typename T> T *allocate(size_t count)
+    {
+        static_assert(alignof(T) <= alignof(uint64_t), "Unsupported alignment");
+        size_t words = (count * sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        mBlocks.emplace_back(new uint64_t[std::max<size_t>(words, 1)]);
+        return reinterpret_cast<T *>(mBlocks.back().get());
+    }
+
+private:
+    std::vector<std::unique_ptr<uint64_t[]>> mBlocks;
+};
+
+// Codecs define how a single value is represented on the wire.
+// decode() returns nullptr if the input is truncated or invalid.
+
+struct BoolCodec
+{
+    using Value = bool;
+    static constexpr size_t MinSize = 1;
+
+    static size_t size(bool)
+    {
+        return 1;
+    }
+
+    // Same encoding as the original tevclient implementation: true is sent as 0.
+    static uint8_t *encode(uint8_t *dst, bool value)
+    {
+        *dst = value ? 0 : 1;
+        return dst + 1;
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, bool &value, DecodeArena &)
+    {
+        if (src >= end)
+            return nullptr;
+        value = *src == 0;
+        return src + 1;
+    }
+};
+
+template <typename T> struct ScalarCodec
+{
+    static_assert(std::is_arithmetic<T>::value, "Scalar must be arithmetic");
+
+    using Value = T;
+    static constexpr size_t MinSize = sizeof(T);
+
+    static size_t size(T)
+    {
+        return sizeof(T);
+    }
+
+    static uint8_t *encode(uint8_t *dst, T value)
+    {
+        std::memcpy(dst, &value, sizeof(T));
+        return dst + sizeof(T);
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, T &value, DecodeArena &)
+    {
+        if (end - src < static_cast<ptrdiff_t>(sizeof(T)))
+            return nullptr;
+        std::memcpy(&value, src, sizeof(T));
+        return src + sizeof(T);
+    }
+};
+
+/// Null-terminated string.
+struct StringCodec
+{
+    using Value = const char *;
+    static constexpr size_t MinSize = 1;
+
+    static size_t size(const char *value)
+    {
+        return std::strlen(value) + 1;
+    }
+
+    static uint8_t *encode(uint8_t *dst, const char *value)
+    {
+        size_t len = std::strlen(value) + 1;
+        std::memcpy(dst, value, len);
+        return dst + len;
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, const char *&value, DecodeArena &)
+    {
+        const void *terminator = src < end ? std::memchr(src, '\0', end - src) : nullptr;
+        if (!terminator)
+            return nullptr;
+        value = reinterpret_cast<const char *>(src);
+        return static_cast<const uint8_t *>(terminator) + 1;
+    }
+};
+
+/// Vector graphics command: type byte followed by its float arguments.
+struct VgCommandCodec
+{
+    using Value = VgCommand;
+    static constexpr size_t MinSize = 1;
+
+    static size_t size(const VgCommand &value)
+    {
+        return 1 + value.dataCount * sizeof(float);
+    }
+
+    static uint8_t *encode(uint8_t *dst, const VgCommand &value)
+    {
+        *dst = static_cast<uint8_t>(value.type);
+        std::memcpy(dst + 1, value.data, value.dataCount * sizeof(float));
+        return dst + 1 + value.dataCount * sizeof(float);
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, VgCommand &value, DecodeArena &)
+    {
+        if (src >= end)
+            return nullptr;
+        value = VgCommand(static_cast<VgCommand::EType>(static_cast<int8_t>(*src)));
+        int count = vgCommandPayloadCount(value.type);
+        if (count < 0 || end - src - 1 < static_cast<ptrdiff_t>(count * sizeof(float)))
+            return nullptr;
+        value.dataCount = static_cast<uint8_t>(count);
+        std::memcpy(value.data, src + 1, count * sizeof(float));
+        return src + 1 + count * sizeof(float);
+    }
+};
+
+/// Compile-time check that a codec encodes and decodes the same value type.
+template <typename Codec> struct IsCodec
+{
+    using Value = typename Codec::Value;
+    static constexpr bool value =
+        std::is_same<decltype(Codec::size(std::declval<const Value &>())), size_t>::value &&
+        std::is_same<decltype(Codec::encode(std::declval<uint8_t *>(), std::declval<const Value &>())),
+                     uint8_t *>::value &&
+        std::is_same<decltype(Codec::decode(std::declval<const uint8_t *>(), std::declval<const uint8_t *>(),
+                                            std::declval<Value &>(), std::declval<DecodeArena &>())),
+                     const uint8_t *>::value;
+};
+
+/// A single value stored in a packet member.
+template <typename Packet, typename Codec, typename Codec::Value Packet::*Member> struct Field
+{
+    static_assert(IsCodec<Codec>::value, "Codec must encode and decode the same value type");
+
+    static constexpr size_t MinSize = Codec::MinSize;
+
+    static size_t size(const Packet &packet)
+    {
+        return Codec::size(packet.*Member);
+    }
+
+    static uint8_t *encode(uint8_t *dst, const Packet &packet)
+    {
+        return Codec::encode(dst, packet.*Member);
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, Packet &packet, DecodeArena &arena)
+    {
+        return Codec::decode(src, end, packet.*Member, arena);
+    }
+};
+
+/// An array whose length is given by a preceding count member. The count itself is not encoded here.
+template <typename Packet, typename Codec, const typename Codec::Value *Packet::*Member, uint32_t Packet::*Count>
+struct ArrayField
+{
+    static_assert(IsCodec<Codec>::value, "Codec must encode and decode the same value type");
+
+    static constexpr size_t MinSize = 0;
+
+    static size_t size(const Packet &packet)
+    {
+        size_t result = 0;
+        for (uint32_t i = 0; i < packet.*Count; ++i)
+            result += Codec::size((packet.*Member)[i]);
+        return result;
+    }
+
+    static uint8_t *encode(uint8_t *dst, const Packet &packet)
+    {
+        for (uint32_t i = 0; i < packet.*Count; ++i)
+            dst = Codec::encode(dst, (packet.*Member)[i]);
+        return dst;
+    }
+
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, Packet &packet, DecodeArena &arena)
+    {
+        uint32_t count = packet.*Count;
+        // Reject counts that cannot possibly fit before allocating for them.
+        if (static_cast<uint64_t>(count) * Codec::MinSize > static_cast<uint64_t>(end - src))
+            return nullptr;
+        typename Codec::Value *values = arena.template allocate<typename Codec::Value>(count);
+        for (uint32_t i = 0; i < count && src; ++i)
+            src = Codec::decode(src, end, values[i], arena);
+        packet.*Member = values;
+        return src;
+    }
+};
+
+template <typename... Fields> struct FieldList;
+
+template <> struct FieldList<>
+{
+    static constexpr size_t MinSize = 0;
+
+    template <typename Packet> static size_t size(const Packet &)
+    {
+        return 0;
+    }
+
+    template <typename Packet> static uint8_t *encode(uint8_t *dst, const Packet &)
+    {
+        return dst;
+    }
+
+    template <typename Packet>
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *, Packet &, DecodeArena &)
+    {
+        return src;
+    }
+};
+
+template <typename First, typename... Rest> struct FieldList<First, Rest...>
+{
+    static constexpr size_t MinSize = First::MinSize + FieldList<Rest...>::MinSize;
+
+    template <typename Packet> static size_t size(const Packet &packet)
+    {
+        return First::size(packet) + FieldList<Rest...>::size(packet);
+    }
+
+    template <typename Packet> static uint8_t *encode(uint8_t *dst, const Packet &packet)
+    {
+        return FieldList<Rest...>::encode(First::encode(dst, packet), packet);
+    }
+
+    template <typename Packet>
+    static const uint8_t *decode(const uint8_t *src, const uint8_t *end, Packet &packet, DecodeArena &arena)
+    {
+        src = First::decode(src, end, packet, arena);
+        return src ? FieldList<Rest...>::decode(src, end, packet, arena) : nullptr;
+    }
+};
+
+// Packets.
+
+/// Legacy, superseded by OpenImageV2.
+struct OpenImagePacket
+{
+    bool grabFocus;
+    const char *imageString;
+};
+
+struct ReloadImagePacket
+{
+    bool grabFocus;
+    const char *imageName;
+};
+
+struct CloseImagePacket
+{
+    const char *imageName;
+};
+
+/// Legacy, superseded by UpdateImageV3. Followed by width * height floats.
+struct UpdateImagePacket
+{
+    bool grabFocus;
+    const char *imageName;
+    const char *channel;
+    uint32_t x, y, width, height;
+};
+
+struct CreateImagePacket
+{
+    bool grabFocus;
+    const char *imageName;
+    uint32_t width, height;
+    uint32_t channelCount;
+    const char *const *channelNames;
+};
+
+/// Legacy, superseded by UpdateImageV3. Followed by channelCount * width * height floats.
+struct UpdateImageV2Packet
+{
+    bool grabFocus;
+    const char *imageName;
+    uint32_t channelCount;
+    const char *const *channelNames;
+    uint32_t x, y, width, height;
+};
+
+/// Followed by the strided image data.
+struct UpdateImageV3Packet
+{
+    bool grabFocus;
+    const char *imageName;
+    uint32_t channelCount;
+    const char *const *channelNames;
+    uint32_t x, y, width, height;
+    const uint64_t *channelOffsets;
+    const uint64_t *channelStrides;
+};
+
+struct OpenImageV2Packet
+{
+    bool grabFocus;
+    const char *imagePath;
+    const char *channelSelector;
+};
+
+struct VectorGraphicsPacket
+{
+    bool grabFocus;
+    const char *imageName;
+    bool append;
+    uint32_t commandCount;
+    const VgCommand *commands;
+};
+
+template <typename Packet> struct Schema;
+
+#define TEVCLIENT_FIELD(codec, member) Field<P, codec, &P::member>
+#define TEVCLIENT_ARRAY(codec, member, count) ArrayField<P, codec, &P::member, &P::count>
+
+using U32 = ScalarCodec<uint32_t>;
+using U64 = ScalarCodec<uint64_t>;
+
+template <> struct Schema<OpenImagePacket>
+{
+    using P = OpenImagePacket;
+    static constexpr EPacketType Type = OpenImage;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageString)>;
+};
+
+template <> struct Schema<ReloadImagePacket>
+{
+    using P = ReloadImagePacket;
+    static constexpr EPacketType Type = ReloadImage;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName)>;
+};
+
+template <> struct Schema<CloseImagePacket>
+{
+    using P = CloseImagePacket;
+    static constexpr EPacketType Type = CloseImage;
+    using Fields = FieldList<TEVCLIENT_FIELD(StringCodec, imageName)>;
+};
+
+template <> struct Schema<UpdateImagePacket>
+{
+    using P = UpdateImagePacket;
+    static constexpr EPacketType Type = UpdateImage;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName),
+                             TEVCLIENT_FIELD(StringCodec, channel), TEVCLIENT_FIELD(U32, x), TEVCLIENT_FIELD(U32, y),
+                             TEVCLIENT_FIELD(U32, width), TEVCLIENT_FIELD(U32, height)>;
+};
+
+template <> struct Schema<CreateImagePacket>
+{
+    using P = CreateImagePacket;
+    static constexpr EPacketType Type = CreateImage;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName),
+                             TEVCLIENT_FIELD(U32, width), TEVCLIENT_FIELD(U32, height),
+                             TEVCLIENT_FIELD(U32, channelCount),
+                             TEVCLIENT_ARRAY(StringCodec, channelNames, channelCount)>;
+};
+
+template <> struct Schema<UpdateImageV2Packet>
+{
+    using P = UpdateImageV2Packet;
+    static constexpr EPacketType Type = UpdateImageV2;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName),
+                             TEVCLIENT_FIELD(U32, channelCount),
+                             TEVCLIENT_ARRAY(StringCodec, channelNames, channelCount), TEVCLIENT_FIELD(U32, x),
+                             TEVCLIENT_FIELD(U32, y), TEVCLIENT_FIELD(U32, width), TEVCLIENT_FIELD(U32, height)>;
+};
+
+template <> struct Schema<UpdateImageV3Packet>
+{
+    using P = UpdateImageV3Packet;
+    static constexpr EPacketType Type = UpdateImageV3;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName),
+                             TEVCLIENT_FIELD(U32, channelCount),
+                             TEVCLIENT_ARRAY(StringCodec, channelNames, channelCount), TEVCLIENT_FIELD(U32, x),
+                             TEVCLIENT_FIELD(U32, y), TEVCLIENT_FIELD(U32, width), TEVCLIENT_FIELD(U32, height),
+                             TEVCLIENT_ARRAY(U64, channelOffsets, channelCount),
+                             TEVCLIENT_ARRAY(U64, channelStrides, channelCount)>;
+};
+
+template <> struct Schema<OpenImageV2Packet>
+{
+    using P = OpenImageV2Packet;
+    static constexpr EPacketType Type = OpenImageV2;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imagePath),
+                             TEVCLIENT_FIELD(StringCodec, channelSelector)>;
+};
+
+template <> struct Schema<VectorGraphicsPacket>
+{
+    using P = VectorGraphicsPacket;
+    static constexpr EPacketType Type = VectorGraphics;
+    using Fields = FieldList<TEVCLIENT_FIELD(BoolCodec, grabFocus), TEVCLIENT_FIELD(StringCodec, imageName),
+                             TEVCLIENT_FIELD(BoolCodec, append), TEVCLIENT_FIELD(U32, commandCount),
+                             TEVCLIENT_ARRAY(VgCommandCodec, commands, commandCount)>;
+};
+
+#undef TEVCLIENT_FIELD
+#undef TEVCLIENT_ARRAY
+
+/// Exact encoded size of a packet (type byte and fields, without length prefix and image data).
+template <typename Packet> size_t packetSize(const Packet &packet)
+{
+    return 1 + Schema<Packet>::Fields::size(packet);
+}
+
+/// Encode a packet into a buffer of at least packetSize() bytes. Returns the end of the encoded data.
+template <typename Packet> uint8_t *encodePacket(uint8_t *dst, const Packet &packet)
+{
+    *dst = static_cast<uint8_t>(Schema<Packet>::Type);
+    return Schema<Packet>::Fields::encode(dst + 1, packet);
+}
+
+/**
+ * Decode a packet (without length prefix). Strings point into the input, arrays are
+ * allocated from the arena. Returns the end of the decoded fields, i.e. the start of
+ * the image data for update packets, or nullptr if the input is not a valid packet
+ * of this type.
+ */
+template <typename Packet>
+const uint8_t *decodePacket(const uint8_t *src, size_t size, Packet &packet, DecodeArena &arena)
+{
+    if (size < 1 + Schema<Packet>::Fields::MinSize || src[0] != static_cast<uint8_t>(Schema<Packet>::Type))
+        return nullptr;
+    return Schema<Packet>::Fields::decode(src + 1, src + size, packet, arena);
+}
+
+/// Encoded size of a range of vector graphics commands.
+inline size_t vgCommandsSize(const VgCommand *commands, size_t count)
+{
+    size_t floatCount = 0;
+    for (size_t i = 0; i < count; ++i)
+        floatCount += commands[i].dataCount;
+    return count + floatCount * sizeof(float);
+}
+
+/// Encode a range of vector graphics commands. Returns the end of the encoded data.
+inline uint8_t *encodeVgCommands(uint8_t *dst, const VgCommand *commands, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst = VgCommandCodec::encode(dst, commands[i]);
+    return dst;
+}
+
+/// Byte offset of the region (x, y, width, height) within an encoded UpdateImageV3 packet.
+inline size_t regionOffset(const UpdateImageV3Packet &packet)
+{
+    return packetSize(packet) - 4 * sizeof(uint32_t) - 2 * sizeof(uint64_t) * packet.channelCount;
+}
+
+// Fixed parts of the layouts: type byte plus all fields that do not depend on names or counts.
+static_assert(Schema<CloseImagePacket>::Fields::MinSize == 1, "CloseImage layout changed");
+static_assert(Schema<ReloadImagePacket>::Fields::MinSize == 1 + 1, "ReloadImage layout changed");
+static_assert(Schema<OpenImageV2Packet>::Fields::MinSize == 1 + 1 + 1, "OpenImageV2 layout changed");
+static_assert(Schema<CreateImagePacket>::Fields::MinSize == 1 + 1 + 3 * 4, "CreateImage layout changed");
+static_assert(Schema<UpdateImageV3Packet>::Fields::MinSize == 1 + 1 + 4 + 4 * 4, "UpdateImageV3 layout changed");
+static_assert(Schema<VectorGraphicsPacket>::Fields::MinSize == 1 + 1 + 1 + 4, "VectorGraphics layout changed");
+
+} // namespace protocol
+} // namespace tevclient
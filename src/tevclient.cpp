@@ -2,12 +2,20 @@
 // It is published under the BSD 3-Clause License within the LICENSE file.
 
 #include "tevclient.h"
+#include "allocator.h"
+#include "parallel.h"
+#include "protocol.h"
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <limits>
 #include <mutex>
-#include <string>
-#include <vector>
+#include <new>
+#include <thread>
 
 #ifdef _WIN32
 #define NOMINMAX
@@ -23,8 +31,14 @@ using socklen_t = int;
 #include <netinet/in.h>
 #include <signal.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 using socket_t = int;
 #define SOCKET_ERROR (-1)
 #define INVALID_SOCKET (-1)
@@ -40,24 +54,61 @@ using socket_t = int;
 namespace tevclient
 {
 
-inline std::string errorString(int error)
+/// Error messages are formatted into fixed size buffers, so reporting an error does not allocate.
+static constexpr size_t MaxErrorLength = 256;
+
+/// Total capacity of the sent message buffers kept for reuse in asynchronous mode.
+static constexpr size_t MaxPooledFrameBytes = 64 * 1024 * 1024;
+
+/// Maximum number of sent message buffers kept for reuse in asynchronous mode.
+static constexpr size_t MaxPooledFrames = 256;
+
+/// Maximum number of queued frames the writer thread sends with one gathered write.
+static constexpr size_t MaxWriterFrames = 64;
+
+/// Number of finished uploads whose final state is kept for getUploadProgress().
+static constexpr size_t MaxFinishedUploads = 64;
+
+/// Image data copied by thread-safe updates that may be queued before further updates wait.
+static constexpr size_t MaxCopiedUpdateBytes = 256 * 1024 * 1024;
+
+/// Identifies clients in the thread local lastUploadId() cache, as addresses can be reused.
+static std::atomic<uint64_t> sNextClientId{1};
+
+/// Last update started by the calling thread in thread-safe mode.
+struct ThreadUpload
+{
+    uint64_t client;
+    UploadId id;
+};
+
+static thread_local ThreadUpload tLastUpload{0, 0};
+
+/// Bytes per task when copying large message payloads in parallel.
+static constexpr size_t CopyBytesPerTask = 1024 * 1024;
+
+/// Minimum number of source pixels per task when downsampling previews in parallel.
+static constexpr size_t PreviewPixelsPerTask = 64 * 1024;
+
+/// Upper bound for setMaxPreviewDownsample(), far beyond any useful factor.
+static constexpr uint32_t MaxPreviewDownsample = 1u << 16;
+
+/// Format "<what>: <system error message> (<error>)" into buffer.
+inline void formatSocketError(char *buffer, size_t size, const char *what, int error)
 {
+    char message[MaxErrorLength];
 #ifdef _WIN32
-    char *str = NULL;
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL,
-                  error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&str, 0, NULL);
-
-    std::string result{str};
-    LocalFree(str);
+    DWORD len = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, error,
+                               MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), message, sizeof(message), NULL);
+    message[len] = '\0';
 #else
-    std::string result{strerror(error)};
+    std::snprintf(message, sizeof(message), "%s", strerror(error));
+    size_t len = strlen(message);
 #endif
-    auto pos = result.find_last_not_of("/r/n");
-    if (pos != std::string::npos)
-        result = result.substr(0, pos - 1);
+    while (len > 0 && (message[len - 1] == '\r' || message[len - 1] == '\n'))
+        message[--len] = '\0';
 
-    result += " (" + std::to_string(error) + ")";
-    return result;
+    std::snprintf(buffer, size, "%s: %s (%d)", what, message, error);
 }
 
 enum SocketError : int
@@ -91,81 +142,274 @@ inline int lastSocketError()
 #endif
 }
 
-enum EPacketType : char
+/// A piece of a gathered write.
+struct IoSlice
 {
-    OpenImage = 0,
-    ReloadImage = 1,
-    CloseImage = 2,
-    UpdateImage = 3,
-    CreateImage = 4,
-    UpdateImageV2 = 5, // Adds multi-channel support
-    UpdateImageV3 = 6, // Adds custom striding/offset support
-    OpenImageV2 = 7,   // Explicit separation of image name and channel selector
-    VectorGraphics = 8,
+    const void *data;
+    size_t size;
 };
 
-class OStream
+/// Image region update with a resolved channel layout.
+struct RegionUpdate
+{
+    explicit RegionUpdate(Allocator &allocator)
+        : imageName(allocator), channelNames(StlAllocator<String>(allocator)), channelOffsets(allocator),
+          channelStrides(allocator)
+    {
+    }
+
+    String imageName;
+    bool grabFocus{false};
+    uint32_t x{0}, y{0}, width{0}, height{0};
+    StringVector channelNames;
+    Vector<uint64_t> channelOffsets;
+    Vector<uint64_t> channelStrides;
+    const float *imageData{nullptr};
+};
+
+/// Update layout pre-encoded by Client::prepareUpdate().
+struct PreparedLayout
+{
+    explicit PreparedLayout(Allocator &allocator)
+        : imageName(allocator), channelNames(StlAllocator<String>(allocator)), channelOffsets(allocator),
+          channelStrides(allocator), header(allocator)
+    {
+    }
+
+    String imageName;
+    bool grabFocus{false};
+    StringVector channelNames;
+    Vector<uint64_t> channelOffsets;
+    Vector<uint64_t> channelStrides;
+    /// Encoded UpdateImageV3 packet, the region at regionOffset is patched per update.
+    Vector<uint8_t> header;
+    size_t regionOffset{0};
+};
+
+/**
+ * Streaming 64-bit hash of a byte sequence. The result only depends on the bytes, not on how
+ * they are split between calls to update(), and value() can be taken at any point.
+ */
+class StreamHash
 {
 public:
-    template <typename T> OStream &operator<<(const std::vector<T> &var)
+    void update(const void *data, size_t size)
     {
-        for (auto &&elem : var)
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        mLength += size;
+        if (mPendingSize > 0)
+        {
+            size_t count = std::min(size, sizeof(mPending) - mPendingSize);
+            std::memcpy(mPending + mPendingSize, bytes, count);
+            mPendingSize += count;
+            bytes += count;
+            size -= count;
+            if (mPendingSize < sizeof(mPending))
+            {
+                return;
+            }
+            mState = mix(mState, mPending);
+            mPendingSize = 0;
+        }
+        for (; size >= sizeof(mPending); bytes += sizeof(mPending), size -= sizeof(mPending))
         {
-            *this << elem;
+            mState = mix(mState, bytes);
         }
-        return *this;
+        std::memcpy(mPending, bytes, size);
+        mPendingSize = size;
     }
 
-    OStream &operator<<(const std::string &str)
+    uint64_t value() const
     {
-        for (auto c : str)
+        uint64_t state = mState;
+        if (mPendingSize > 0)
         {
-            *this << c;
+            uint8_t last[sizeof(mPending)] = {};
+            std::memcpy(last, mPending, mPendingSize);
+            state = mix(state, last);
         }
-        *this << '\0';
-        return *this;
+        // Final avalanche (from MurmurHash3).
+        state ^= mLength;
+        state ^= state >> 33;
+        state *= 0xff51afd7ed558ccdull;
+        state ^= state >> 33;
+        state *= 0xc4ceb9fe1a85ec53ull;
+        state ^= state >> 33;
+        return state;
     }
 
-    OStream &operator<<(const char *str)
+private:
+    static uint64_t mix(uint64_t state, const uint8_t *bytes)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        state ^= word * 0x87c37b91114253d5ull;
+        state = (state << 31) | (state >> 33);
+        return state * 0x4cf5ad432745937full + 0x52dce729ull;
+    }
+
+    uint64_t mState{0};
+    uint64_t mLength{0};
+    uint8_t mPending[8];
+    size_t mPendingSize{0};
+};
+
+/// Vector graphics last sent to an image with Client::updateVectorGraphics().
+struct RetainedOverlay
+{
+    explicit RetainedOverlay(Allocator &allocator) : imageName(allocator)
     {
-        for (const char *c = str; *c != '\0'; ++c)
-        {
-            *this << *c;
-        }
-        *this << '\0';
-        return *this;
     }
 
-    OStream &operator<<(bool var)
+    String imageName;
+    size_t commandCount{0};
+    /// Size of the encoded commands in bytes.
+    size_t size{0};
+    /// Hash of the encoded commands.
+    uint64_t hash{0};
+};
+
+/// Number of floats spanned by pixelCount pixels of a strided channel layout.
+static size_t stridedImageDataCount(uint32_t channelCount, const uint64_t *channelOffsets,
+                                    const uint64_t *channelStrides, size_t pixelCount)
+{
+    size_t count = 0;
+    for (uint32_t i = 0; i < channelCount; ++i)
     {
-        *this << char(var ? 0 : 1);
-        return *this;
+        count = std::max(count, (size_t)(channelOffsets[i] + (pixelCount - 1) * channelStrides[i] + 1));
     }
+    return count;
+}
 
-    template <typename T> OStream &operator<<(T var)
+/// Channel layout of an update, see Client::Impl::resolveChannelLayout().
+struct ChannelLayout
+{
+    explicit ChannelLayout(uint32_t channelCount)
+        : defaultStrides{channelCount, channelCount, channelCount, channelCount}
     {
-        size_t pos = mData.size();
-        mData.resize(mData.size() + sizeof(T));
-        *(T *)&mData[pos] = var;
-        return *this;
     }
 
-    const void *data() const
+    ChannelLayout(const ChannelLayout &) = delete;
+    ChannelLayout &operator=(const ChannelLayout &) = delete;
+
+    const char **names{nullptr};
+    const uint64_t *offsets{nullptr};
+    const uint64_t *strides{nullptr};
+
+    /// Layout of up to 4 interleaved channels, used for omitted names, offsets and strides.
+    const char *defaultNames[4] = {"R", "G", "B", "A"};
+    uint64_t defaultOffsets[4] = {0, 1, 2, 3};
+    uint64_t defaultStrides[4];
+};
+
+/// Copy the payload of a message into its frame, large payloads in parallel.
+static void copyPayload(uint8_t *dst, const void *src, size_t size)
+{
+    size_t taskCount = size / CopyBytesPerTask;
+    if (taskCount < 2)
     {
-        return mData.data();
+        std::memcpy(dst, src, size);
+        return;
     }
-    size_t size() const
+    parallelFor(taskCount, [&](size_t task) {
+        size_t begin, end;
+        taskRange(task, taskCount, size, begin, end);
+        std::memcpy(dst + begin, static_cast<const uint8_t *>(src) + begin, end - begin);
+    });
+}
+
+/// Range of the image data (in floats) covered by one channel of a chunk.
+struct Interval
+{
+    uint64_t begin, end;
+    uint32_t channel;
+};
+
+/// Buffers reused between calls of encodeRegionRows().
+struct EncodeScratch
+{
+    explicit EncodeScratch(Allocator &allocator)
+        : intervals(allocator), offsets(allocator), channelNames(allocator), header(allocator), slices(allocator)
     {
-        return mData.size();
     }
 
-private:
-    std::vector<uint8_t> mData;
+    Vector<Interval> intervals;
+    Vector<uint64_t> offsets;
+    Vector<const char *> channelNames;
+    /// Encoded UpdateImageV3 packet of the chunk.
+    Vector<uint8_t> header;
+    /// Frame length, header and payload of the chunk.
+    Vector<IoSlice> slices;
 };
 
+/**
+ * Encode rows [row, row + rowCount) of a region update as a self-contained UpdateImageV3 message.
+ * The header is written to scratch.header and the payload is appended to scratch.slices, pointing into
+ * the image data.
+ * Channels whose data overlaps are sent as one contiguous segment, so interleaved layouts stay
+ * zero-copy, while planar layouts only send the rows of each plane that are part of the chunk.
+ * Returns the payload size in bytes.
+ */
+static size_t encodeRegionRows(const RegionUpdate &update, uint32_t row, uint32_t rowCount, bool grabFocus,
+                               EncodeScratch &scratch)
+{
+    uint32_t channelCount = static_cast<uint32_t>(update.channelNames.size());
+    uint64_t firstPixel = static_cast<uint64_t>(row) * update.width;
+    uint64_t pixelCount = static_cast<uint64_t>(rowCount) * update.width;
+
+    Vector<Interval> &intervals = scratch.intervals;
+    intervals.resize(channelCount);
+    for (uint32_t i = 0; i < channelCount; ++i)
+    {
+        intervals[i].begin = update.channelOffsets[i] + firstPixel * update.channelStrides[i];
+        intervals[i].end = intervals[i].begin + (pixelCount > 0 ? (pixelCount - 1) * update.channelStrides[i] + 1 : 0);
+        intervals[i].channel = i;
+    }
+    std::sort(intervals.begin(), intervals.end(),
+              [](const Interval &a, const Interval &b) { return a.begin < b.begin; });
+
+    Vector<uint64_t> &offsets = scratch.offsets;
+    offsets.resize(channelCount);
+    uint64_t payloadCount = 0;
+    for (size_t i = 0; i < intervals.size();)
+    {
+        uint64_t segmentBegin = intervals[i].begin;
+        uint64_t segmentEnd = intervals[i].end;
+        size_t j = i + 1;
+        while (j < intervals.size() && intervals[j].begin <= segmentEnd)
+        {
+            segmentEnd = std::max(segmentEnd, intervals[j].end);
+            ++j;
+        }
+        for (size_t k = i; k < j; ++k)
+        {
+            offsets[intervals[k].channel] = payloadCount + (intervals[k].begin - segmentBegin);
+        }
+        size_t segmentSize = static_cast<size_t>(segmentEnd - segmentBegin) * sizeof(float);
+        scratch.slices.push_back({update.imageData + segmentBegin, segmentSize});
+        payloadCount += segmentEnd - segmentBegin;
+        i = j;
+    }
+
+    Vector<const char *> &channelNames = scratch.channelNames;
+    channelNames.resize(channelCount);
+    for (uint32_t i = 0; i < channelCount; ++i)
+    {
+        channelNames[i] = update.channelNames[i].c_str();
+    }
+
+    protocol::UpdateImageV3Packet packet{grabFocus, update.imageName.c_str(), channelCount,
+                                         channelNames.data(), update.x, update.y + row, update.width,
+                                         rowCount, offsets.data(), update.channelStrides.data()};
+    scratch.header.resize(protocol::packetSize(packet));
+    protocol::encodePacket(scratch.header.data(), packet);
+
+    return static_cast<size_t>(payloadCount) * sizeof(float);
+}
+
 static std::atomic<uint32_t> sInstanceCount{0};
-static std::string sInitError;
 #ifdef _WIN32
+static char sInitError[MaxErrorLength];
 static std::mutex sInstanceMutex;
 #endif
 
@@ -179,9 +423,9 @@ static bool internalInitialize(const char **error = nullptr)
         int wsaStartupResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
         if (wsaStartupResult != NO_ERROR)
         {
-            sInitError = errorString(wsaStartupResult);
+            formatSocketError(sInitError, sizeof(sInitError), "WSAStartup() failed", wsaStartupResult);
             if (error)
-                *error = sInitError.c_str();
+                *error = sInitError;
             return false;
         }
 #else
@@ -206,24 +450,31 @@ static void internalShutdown()
 class Client::Impl
 {
 public:
-    Impl(const char *hostname, uint16_t port) : mHostname{hostname}, mPort{port}
+    Impl(const char *hostname, uint16_t port, Allocator &allocator)
+        : mAllocator(allocator), mHostname(hostname, allocator), mPort{port}
     {
         const char *error;
         if (!internalInitialize(&error))
         {
-            setLastError(Error::SocketError, std::string("Failed to initialize: ") + error);
+            setLastError(Error::SocketError, "Failed to initialize: %s", error);
         }
     }
 
     ~Impl()
     {
+        setAsync(false);
         disconnect();
         internalShutdown();
     }
 
-    const std::string &getHostname() const
+    Allocator &allocator() const
+    {
+        return mAllocator;
+    }
+
+    const char *getHostname() const
     {
-        return mHostname;
+        return mHostname.c_str();
     }
 
     uint16_t getPort() const
@@ -243,13 +494,26 @@ public:
             return Error::Ok;
         }
 
+        // A new connection may be to a new tev instance.
+        mOverlays.clear();
+        resetDrainSample();
+
+#ifndef _WIN32
+        if (mHostname.compare(0, 5, "unix:") == 0)
+        {
+            return connectUnix(mHostname.c_str() + 5);
+        }
+#endif
+
         struct addrinfo hints = {}, *addrinfo;
         hints.ai_family = PF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
-        int err = getaddrinfo(mHostname.c_str(), std::to_string(mPort).c_str(), &hints, &addrinfo);
+        char port[8];
+        std::snprintf(port, sizeof(port), "%u", static_cast<unsigned>(mPort));
+        int err = getaddrinfo(mHostname.c_str(), port, &hints, &addrinfo);
         if (err != 0)
         {
-            return setLastError(Error::SocketError, "getaddrinfo() failed: " + std::string(gai_strerror(err)));
+            return setLastError(Error::SocketError, "getaddrinfo() failed: %s", gai_strerror(err));
         }
 
         setLastError(Error::Ok);
@@ -260,13 +524,13 @@ public:
             mSocketFd = ::socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
             if (mSocketFd == INVALID_SOCKET)
             {
-                setLastError(Error::SocketError, "socket() failed: " + errorString(lastSocketError()));
+                setSocketError("socket() failed");
                 continue;
             }
 
             if (::connect(mSocketFd, ptr->ai_addr, (int)ptr->ai_addrlen) == SOCKET_ERROR)
             {
-                setLastError(Error::SocketError, "connect() failed: " + errorString(lastSocketError()));
+                setSocketError("connect() failed");
                 closeSocket(mSocketFd);
                 mSocketFd = INVALID_SOCKET;
                 continue;
@@ -280,279 +544,2313 @@ public:
         return mLastError;
     }
 
+#ifndef _WIN32
+    Error connectUnix(const char *path)
+    {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            return setLastError(Error::ArgumentError, "Unix socket path is too long.");
+        }
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        mSocketFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (mSocketFd == INVALID_SOCKET)
+        {
+            return setSocketError("socket() failed");
+        }
+
+        if (::connect(mSocketFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR)
+        {
+            setSocketError("connect() failed");
+            closeSocket(mSocketFd);
+            mSocketFd = INVALID_SOCKET;
+            return mLastError;
+        }
+
+        return setLastError(Error::Ok);
+    }
+#endif
+
     Error disconnect()
     {
         if (isConnected())
         {
-            if (closeSocket(mSocketFd) == SOCKET_ERROR)
+            // Frames of an open batch are sent before closing, but a failure does not keep the socket open.
+            flush();
+            mOverlays.clear();
+            resetDrainSample();
+            int result = closeSocket(mSocketFd);
+            mSocketFd = INVALID_SOCKET;
+            if (result == SOCKET_ERROR)
             {
-                return setLastError(Error::SocketError, "Error closing socket: " + errorString(lastSocketError()));
+                return setSocketError("Error closing socket");
             }
         }
 
         return Error::Ok;
     }
 
-    Error send(const void *data, size_t len)
+    /// Write all slices with as few syscalls as possible. The slices are consumed.
+    Error sendSlices(IoSlice *slices, size_t count)
     {
         if (!isConnected())
         {
             return setLastError(Error::NotConnected, "Not connected");
         }
 
-        size_t bytesSent =
-            ::send(mSocketFd, reinterpret_cast<const char *>(data), static_cast<int>(len), 0 /* flags */);
-        if (bytesSent != len)
+        Error error = writeSlices(slices, count, mLastErrorString);
+        if (error != Error::Ok)
         {
-
-            return setLastError(Error::SocketError, "socket send() failed: " + errorString(lastSocketError()));
+            mLastError = error;
         }
-
-        return Error::Ok;
+        return error;
     }
 
-    Error sendMessage(const OStream &header, const void *extraData = nullptr, size_t extraLen = 0)
+    /**
+     * Same as sendSlices() but only reports errors through errorString (which is left untouched
+     * on success), so it can be used by the writer thread.
+     */
+    Error writeSlices(IoSlice *slices, size_t count, char (&errorString)[MaxErrorLength])
     {
-        uint32_t totalLen = static_cast<uint32_t>(4 + header.size() + extraLen);
-        RETURN_IF_FAILED(send(&totalLen, 4));
-        RETURN_IF_FAILED(send(header.data(), header.size()));
-        if (extraData)
+        auto start = std::chrono::steady_clock::now();
+        uint64_t bytesWritten = mBytesWritten;
+
+        static constexpr size_t MaxSlices = 64;
+        while (count > 0)
         {
-            RETURN_IF_FAILED(send(extraData, extraLen));
+            size_t n = std::min(count, MaxSlices);
+#ifdef _WIN32
+            WSABUF buffers[MaxSlices];
+            for (size_t i = 0; i < n; ++i)
+            {
+                buffers[i].buf = const_cast<char *>(static_cast<const char *>(slices[i].data));
+                buffers[i].len = static_cast<ULONG>(std::min<size_t>(slices[i].size, 1u << 30));
+            }
+            DWORD sent = 0;
+            if (WSASend(mSocketFd, buffers, static_cast<DWORD>(n), &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+            {
+                formatSocketError(errorString, sizeof(errorString), "socket send() failed", lastSocketError());
+                return Error::SocketError;
+            }
+            size_t bytesSent = sent;
+#else
+            struct iovec iov[MaxSlices];
+            for (size_t i = 0; i < n; ++i)
+            {
+                iov[i].iov_base = const_cast<void *>(slices[i].data);
+                iov[i].iov_len = slices[i].size;
+            }
+            ssize_t sent = ::writev(mSocketFd, iov, static_cast<int>(n));
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                formatSocketError(errorString, sizeof(errorString), "socket send() failed", lastSocketError());
+                return Error::SocketError;
+            }
+            size_t bytesSent = static_cast<size_t>(sent);
+#endif
+            mBytesWritten += bytesSent;
+
+            // Advance past everything that was written, the remainder goes out with the next call.
+            while (count > 0 && bytesSent >= slices->size)
+            {
+                bytesSent -= slices->size;
+                ++slices;
+                --count;
+            }
+            if (count > 0)
+            {
+                slices->data = static_cast<const uint8_t *>(slices->data) + bytesSent;
+                slices->size -= bytesSent;
+            }
         }
+
+        recordWrite(mBytesWritten - bytesWritten,
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
         return Error::Ok;
     }
 
-    Error setLastError(Error error, std::string errorString = "")
+    /// Update the bandwidth estimate with the time a write spent blocking.
+    void recordWrite(uint64_t bytes, double seconds)
     {
-        mLastError = error;
-        mLastErrorString = std::move(errorString);
-        return error;
-    }
+        // Writes that fit into the socket buffer return immediately, so accumulate enough for a meaningful sample.
+        mWriteBytes += bytes;
+        mWriteSeconds += seconds;
+        if (mWriteBytes < 256 * 1024 && mWriteSeconds < 0.01)
+        {
+            return;
+        }
 
-    Error lastError() const
-    {
-        return mLastError;
+        double sample = static_cast<double>(mWriteBytes) / std::max(mWriteSeconds, 1e-6);
+        double bandwidth = mBandwidth.load();
+        mBandwidth.store(bandwidth == 0.0 ? sample : bandwidth + 0.25 * (sample - bandwidth));
+        mWriteBytes = 0;
+        mWriteSeconds = 0.0;
     }
 
-    const std::string &lastErrorString() const
+    double getBandwidth() const
     {
-        return mLastErrorString;
+        return mBandwidth.load();
     }
 
-private:
-    std::string mHostname;
-    uint16_t mPort;
-    socket_t mSocketFd{INVALID_SOCKET};
-
-    Error mLastError{Error::Ok};
-    std::string mLastErrorString;
-};
-
-bool initialize(const char **error)
-{
-    return internalInitialize(error);
-}
-
-void shutdown()
-{
-    internalShutdown();
-}
-
-Client::Client(const char *hostname, uint16_t port)
-{
-    mImpl = new Client::Impl(hostname, port);
-}
-
-Client::~Client()
-{
-    delete mImpl;
-}
-
-const char *Client::getHostname() const
-{
-    return mImpl->getHostname().c_str();
-}
-
-uint16_t Client::getPort() const
-{
-    return mImpl->getPort();
-}
-
-Error Client::connect()
-{
-    return mImpl->connect();
-}
-
-Error Client::disconnect()
-{
-    return mImpl->disconnect();
-}
-
-bool Client::isConnected() const
-{
-    return mImpl->isConnected();
-}
-
-Error Client::openImage(const char *imagePath, const char *channelSelector, bool grabFocus)
-{
-    OStream msg;
-    msg << EPacketType::OpenImageV2;
-    msg << grabFocus;
-    msg << imagePath;
-    msg << channelSelector;
-    return mImpl->sendMessage(msg);
-}
-
-Error Client::reloadImage(const char *imageName, bool grabFocus)
-{
-    OStream msg;
-    msg << EPacketType::ReloadImage;
-    msg << grabFocus;
-    msg << imageName;
-    return mImpl->sendMessage(msg);
-}
-
-Error Client::closeImage(const char *imageName)
-{
-    OStream msg;
-    msg << EPacketType::CloseImage;
-    msg << imageName;
-    return mImpl->sendMessage(msg);
-}
-
-Error Client::createImage(const char *imageName, uint32_t width, uint32_t height, uint32_t channelCount,
-                          const char **channelNames, bool grabFocus)
-{
-    if (width == 0 || height == 0)
+    void setPreviewFrameRate(float frameRate)
     {
-        return mImpl->setLastError(Error::ArgumentError, "Image width and height must be greater than 0.");
+        mPreviewFrameRate = std::max(frameRate, 0.f);
     }
-    if (channelCount == 0)
+
+    void setMaxPreviewDownsample(uint32_t factor)
     {
-        return mImpl->setLastError(Error::ArgumentError, "Image must have at least one channel.");
+        mMaxPreviewDownsample = std::min(std::max<uint32_t>(factor, 1), MaxPreviewDownsample);
     }
-    if (channelCount > 4 && !channelNames)
+
+    /// Check the channel layout of an update and fill in the default layout for omitted arguments.
+    Error resolveChannelLayout(uint32_t channelCount, const char **channelNames, const uint64_t *channelOffsets,
+                               const uint64_t *channelStrides, ChannelLayout &layout)
     {
-        return mImpl->setLastError(Error::ArgumentError,
-                                   "Channel names cannot be inferred for images with more than 4 channels.");
-    }
+        if (channelCount == 0)
+        {
+            return setLastError(Error::ArgumentError, "Image must have at least one channel.");
+        }
+        if (channelCount > 4 && (!channelNames || !channelOffsets || !channelStrides))
+        {
+            return setLastError(
+                Error::ArgumentError,
+                "Channel names/offsets/strides cannot be inferred for images with more than 4 channels.");
+        }
 
-    const char *defaultNames[] = {"R", "G", "B", "A"};
+        layout.names = channelNames ? channelNames : layout.defaultNames;
+        layout.offsets = channelOffsets ? channelOffsets : layout.defaultOffsets;
+        layout.strides = channelStrides ? channelStrides : layout.defaultStrides;
+        return Error::Ok;
+    }
 
-    if (!channelNames)
+    /// Check that the image data of an update covers its region.
+    Error checkImageDataCount(uint32_t channelCount, const uint64_t *channelOffsets, const uint64_t *channelStrides,
+                              uint32_t width, uint32_t height, size_t imageDataCount)
     {
-        channelNames = defaultNames;
+        size_t pixelCount = static_cast<size_t>(width) * height;
+        size_t expectedCount = stridedImageDataCount(channelCount, channelOffsets, channelStrides, pixelCount);
+        if (imageDataCount != expectedCount)
+        {
+            return setLastError(
+                Error::ArgumentError,
+                "Image data size does not match specified dimensions, offset, and stride. (Expected: %zu)",
+                expectedCount);
+        }
+        return Error::Ok;
     }
 
-    OStream msg;
-    msg << EPacketType::CreateImage;
-    msg << grabFocus;
-    msg << imageName;
-    msg << width << height;
-    msg << channelCount;
-    for (uint32_t i = 0; i < channelCount; ++i)
+    /**
+     * Pick the downsample factor for the next preview frame of an image so that it can be sent
+     * within one frame interval. Factors step down (towards full resolution) only when the smaller
+     * factor fits with some headroom, to avoid oscillating between two factors.
+     */
+    uint32_t selectPreviewDownsample(const char *imageName, uint32_t width, uint32_t height, uint32_t channelCount,
+                                     size_t fullBytes, size_t rowBytes)
     {
-        msg << channelNames[i];
+        uint32_t &current = previewDownsample(imageName);
+        double bandwidth = mBandwidth.load();
+        if (bandwidth == 0.0 || mPreviewFrameRate == 0.f)
+        {
+            // Send full resolution until there is a measurement.
+            current = 1;
+            return current;
+        }
+
+        double budget = bandwidth / mPreviewFrameRate;
+        uint32_t selected = 1;
+        for (uint32_t factor = 1; factor <= mMaxPreviewDownsample; factor *= 2)
+        {
+            selected = factor;
+            double blocksX = static_cast<double>((static_cast<uint64_t>(width) + factor - 1) / factor);
+            double blocksY = static_cast<double>((static_cast<uint64_t>(height) + factor - 1) / factor);
+            double bytes = factor == 1 ? static_cast<double>(fullBytes)
+                                       : blocksY * (rowBytes + blocksX * channelCount * 4.0);
+            double headroom = current != 0 && factor < current ? 0.8 : 1.0;
+            if (bytes <= budget * headroom || factor > std::numeric_limits<uint32_t>::max() / 2)
+            {
+                break;
+            }
+        }
+        current = selected;
+        return current;
     }
-    return mImpl->sendMessage(msg);
-}
 
-Error Client::updateImage(const char *imageName, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
-                          uint32_t channelCount, const char **channelNames, uint64_t *channelOffsets,
-                          uint64_t *channelStrides, const float *imageData, size_t imageDataCount, bool grabFocus)
-{
-    if (channelCount == 0)
+    /// Current downsample factor of an image (0 if no preview was sent yet).
+    uint32_t &previewDownsample(const char *imageName)
     {
-        return mImpl->setLastError(Error::ArgumentError, "Image must have at least one channel.");
+        for (auto &preview : mPreviewDownsample)
+        {
+            if (preview.first == imageName)
+            {
+                return preview.second;
+            }
+        }
+        mPreviewDownsample.emplace_back(String(imageName, mAllocator), 0);
+        return mPreviewDownsample.back().second;
     }
-    if (channelCount > 4 && (!channelNames || !channelOffsets || !channelStrides))
+
+    /// Buffers reused between preview frames.
+    struct PreviewScratch
     {
-        return mImpl->setLastError(
-            Error::ArgumentError,
-            "Channel names/offsets/strides cannot be inferred for images with more than 4 channels.");
-    }
+        explicit PreviewScratch(Allocator &allocator)
+            : rowOffsets(allocator), rowStrides(allocator), rowHeader(allocator), sums(allocator)
+        {
+        }
 
-    const char *defaultNames[] = {"R", "G", "B", "A"};
-    uint64_t defaultOffsets[] = {0, 1, 2, 3};
-    uint64_t defaultStrides[] = {channelCount, channelCount, channelCount, channelCount};
+        Vector<uint64_t> rowOffsets;
+        Vector<uint64_t> rowStrides;
+        Vector<uint8_t> rowHeader;
+        Vector<float> sums;
+    };
 
-    if (!channelNames)
-    {
-        channelNames = defaultNames;
-    }
-    if (!channelOffsets)
+    PreviewScratch &previewScratch()
     {
-        channelOffsets = defaultOffsets;
+        return mPreviewScratch;
     }
-    if (!channelStrides)
+
+    /// Return an empty buffer for encoding frames, reusing the memory of previously sent frames.
+    Vector<uint8_t> takeFrameBuffer()
     {
-        channelStrides = defaultStrides;
+        Vector<uint8_t> frames(std::move(mFrameBuffer));
+        frames.clear();
+        return frames;
     }
 
-    OStream msg;
-    msg << EPacketType::UpdateImageV3;
-    msg << grabFocus;
-    msg << imageName;
-    msg << channelCount;
-    for (uint32_t i = 0; i < channelCount; ++i)
+    /// Send an already encoded sequence of frames in synchronous mode.
+    Error sendFrames(Vector<uint8_t> frames)
     {
-        msg << channelNames[i];
+        Error error = send(frames.data(), frames.size());
+        mFrameBuffer = std::move(frames);
+        return error;
     }
-    msg << x << y << width << height;
-    for (uint32_t i = 0; i < channelCount; ++i)
+
+    Error send(const void *data, size_t len)
     {
-        msg << channelOffsets[i];
+        IoSlice slice{data, len};
+        return sendSlices(&slice, 1);
     }
-    for (uint32_t i = 0; i < channelCount; ++i)
+
+    /// Number of bytes written to the socket that the kernel has not sent yet (0 if unsupported).
+    size_t socketBacklog() const
     {
-        msg << channelStrides[i];
+#if defined(__linux__)
+        int pending = 0;
+        if (ioctl(mSocketFd, SIOCOUTQ, &pending) == 0)
+            return static_cast<size_t>(pending);
+#elif defined(__APPLE__)
+        int pending = 0;
+        socklen_t len = sizeof(pending);
+        if (getsockopt(mSocketFd, SOL_SOCKET, SO_NWRITE, &pending, &len) == 0)
+            return static_cast<size_t>(pending);
+#endif
+        return 0;
     }
 
-    size_t pixelCount = width * height;
-
-    size_t stridedImageDataCount = 0;
-    for (uint32_t i = 0; i < channelCount; ++i)
+    Error getBacklog(Backlog &backlog)
     {
-        stridedImageDataCount =
-            std::max(stridedImageDataCount, (size_t)(channelOffsets[i] + (pixelCount - 1) * channelStrides[i] + 1));
+        if (!isConnected())
+        {
+            return setLastError(Error::NotConnected, "Not connected");
+        }
+
+        backlog.socketBytes = socketBacklog();
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            backlog.queuedBytes = mBatch.size() + mQueuedBytes;
+        }
+
+        // The kernel drained everything that was written since the last sample, minus the growth of its queue.
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - mDrainSampleTime).count();
+        bool firstSample = mDrainSampleTime == std::chrono::steady_clock::time_point{};
+        // Without new writes the kernel only drains what is left, which says little about the link speed.
+        bool wroteData = mBytesWritten != mDrainSampleWritten;
+        if (!firstSample && wroteData && elapsed >= 0.001)
+        {
+            double drained = static_cast<double>(mBytesWritten - mDrainSampleWritten) +
+                             static_cast<double>(mDrainSampleBacklog) - static_cast<double>(backlog.socketBytes);
+            double rate = std::max(drained, 0.0) / elapsed;
+            // Exponential moving average, weighted by the length of the sample interval.
+            double alpha = std::min(elapsed / 0.25, 1.0);
+            mDrainRate = mDrainRate == 0.0 ? rate : mDrainRate + alpha * (rate - mDrainRate);
+        }
+        if (firstSample || elapsed >= 0.001)
+        {
+            mDrainSampleTime = now;
+            mDrainSampleWritten = mBytesWritten;
+            mDrainSampleBacklog = backlog.socketBytes;
+        }
+        backlog.drainRate = mDrainRate;
+
+        return Error::Ok;
+    }
+
+    /// Forget the drain rate, as a new connection may go over a different link.
+    void resetDrainSample()
+    {
+        mDrainSampleTime = std::chrono::steady_clock::time_point{};
+        mDrainSampleWritten = mBytesWritten;
+        mDrainSampleBacklog = 0;
+        mDrainRate = 0.0;
+    }
+
+    /// Encode a packet and send it, followed by extra data (e.g. image data).
+    template <typename Packet>
+    Error sendPacket(const Packet &packet, const void *extraData = nullptr, size_t extraLen = 0)
+    {
+        mScratch.resize(protocol::packetSize(packet));
+        protocol::encodePacket(mScratch.data(), packet);
+        return sendMessage(mScratch.data(), mScratch.size(), extraData, extraLen);
+    }
+
+    /**
+     * Send vector graphics as a sequence of messages whose commands take at most mMaxVgMessageSize
+     * bytes, so that huge scenes are never encoded into a single buffer. The first message has the
+     * given append flag, the following ones append to it. Every message is sent to all images.
+     */
+    Error sendVectorGraphics(const char *const *imageNames, size_t imageCount, const VgCommand *commands,
+                             size_t commandCount, bool append, bool grabFocus)
+    {
+        size_t begin = 0;
+        do
+        {
+            size_t end = begin, size = 0;
+            for (; end < commandCount && end - begin < UINT32_MAX; ++end)
+            {
+                size_t commandSize = protocol::VgCommandCodec::size(commands[end]);
+                if (end > begin && size + commandSize > mMaxVgMessageSize)
+                {
+                    break;
+                }
+                size += commandSize;
+            }
+            RETURN_IF_FAILED(sendVectorGraphicsMessage(imageNames, imageCount, commands + begin, end - begin, append,
+                                                       grabFocus));
+            append = true;
+            grabFocus = false;
+            begin = end;
+        } while (begin < commandCount);
+        return Error::Ok;
+    }
+
+    /**
+     * Send a vector graphics message. Large command arrays are encoded on multiple threads: every thread
+     * sizes its range of commands, a prefix sum over these sizes gives each range its offset
+     * in the output, and the ranges are then encoded in place.
+     */
+    Error sendVectorGraphicsMessage(const char *const *imageNames, size_t imageCount, const VgCommand *commands,
+                                    size_t commandCount, bool append, bool grabFocus)
+    {
+        static constexpr size_t MinCommandsPerTask = 32 * 1024;
+
+        size_t taskCount = parallelTaskCount(commandCount, MinCommandsPerTask);
+        if (taskCount == 1 && imageCount == 1)
+        {
+            protocol::VectorGraphicsPacket packet{grabFocus, imageNames[0], append,
+                                                  static_cast<uint32_t>(commandCount), commands};
+            return sendPacket(packet);
+        }
+
+        size_t offsets[MaxParallelTasks + 1] = {};
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, commandCount, begin, end);
+            offsets[task + 1] = protocol::vgCommandsSize(commands + begin, end - begin);
+        });
+        for (size_t task = 0; task < taskCount; ++task)
+        {
+            offsets[task + 1] += offsets[task];
+        }
+
+        mVgScratch.resize(offsets[taskCount]);
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, commandCount, begin, end);
+            protocol::encodeVgCommands(mVgScratch.data() + offsets[task], commands + begin, end - begin);
+        });
+
+        return sendEncodedVectorGraphicsMessage(imageNames, imageCount, commandCount, mVgScratch.data(),
+                                                mVgScratch.size(), append, grabFocus);
+    }
+
+    /// Send vector graphics commands that are already encoded, split like sendVectorGraphics().
+    Error sendEncodedVectorGraphics(const char *const *imageNames, size_t imageCount, size_t commandCount,
+                                    const void *commands, size_t commandsSize, bool append, bool grabFocus)
+    {
+        const uint8_t *begin = static_cast<const uint8_t *>(commands);
+        const uint8_t *end = begin + commandsSize;
+        do
+        {
+            const uint8_t *messageEnd = end;
+            size_t count = commandCount;
+            if (static_cast<size_t>(end - begin) > mMaxVgMessageSize || commandCount > UINT32_MAX)
+            {
+                // Find the last command boundary within the size limit.
+                messageEnd = begin;
+                for (count = 0; messageEnd < end && count < UINT32_MAX; ++count)
+                {
+                    int payloadCount = protocol::vgCommandPayloadCount(static_cast<VgCommand::EType>(*messageEnd));
+                    if (payloadCount < 0)
+                    {
+                        return setLastError(Error::ArgumentError, "Invalid vector graphics command.");
+                    }
+                    size_t commandSize = 1 + payloadCount * sizeof(float);
+                    if (count > 0 && static_cast<size_t>(messageEnd - begin) + commandSize > mMaxVgMessageSize)
+                    {
+                        break;
+                    }
+                    messageEnd += commandSize;
+                }
+            }
+            RETURN_IF_FAILED(sendEncodedVectorGraphicsMessage(imageNames, imageCount, count, begin, messageEnd - begin,
+                                                              append, grabFocus));
+            append = true;
+            grabFocus = false;
+            commandCount -= count;
+            begin = messageEnd;
+        } while (begin < end);
+        return Error::Ok;
+    }
+
+    /**
+     * Send one message per image, with the same encoded commands as payload. When writing directly
+     * to the socket, all messages go out in one gathered write that references the payload once per
+     * image.
+     */
+    Error sendEncodedVectorGraphicsMessage(const char *const *imageNames, size_t imageCount, size_t commandCount,
+                                           const void *commands, size_t commandsSize, bool append, bool grabFocus)
+    {
+        // Encode the fields without the commands, each preceded by the frame length. The command
+        // count is the last field, so it is patched in afterwards.
+        size_t headersSize = 0;
+        for (size_t i = 0; i < imageCount; ++i)
+        {
+            protocol::VectorGraphicsPacket packet{grabFocus, imageNames[i], append, 0, nullptr};
+            headersSize += 4 + protocol::packetSize(packet);
+        }
+        mScratch.resize(headersSize);
+        mSlices.clear();
+        uint8_t *dst = mScratch.data();
+        uint32_t count = static_cast<uint32_t>(commandCount);
+        for (size_t i = 0; i < imageCount; ++i)
+        {
+            protocol::VectorGraphicsPacket packet{grabFocus, imageNames[i], append, 0, nullptr};
+            size_t headerSize = protocol::packetSize(packet);
+            uint32_t totalLen = static_cast<uint32_t>(4 + headerSize + commandsSize);
+            std::memcpy(dst, &totalLen, 4);
+            protocol::encodePacket(dst + 4, packet);
+            std::memcpy(dst + 4 + headerSize - sizeof(count), &count, sizeof(count));
+            mSlices.push_back({dst, 4 + headerSize});
+            mSlices.push_back({commands, commandsSize});
+            dst += 4 + headerSize;
+        }
+
+        if (mAsync || mBatchDepth > 0)
+        {
+            for (size_t i = 0; i < imageCount; ++i)
+            {
+                const IoSlice &header = mSlices[2 * i];
+                RETURN_IF_FAILED(sendMessage(static_cast<const uint8_t *>(header.data) + 4, header.size - 4, commands,
+                                             commandsSize));
+            }
+            return Error::Ok;
+        }
+        return sendSlices(mSlices.data(), mSlices.size());
+    }
+
+    RetainedOverlay *findOverlay(const char *imageName)
+    {
+        for (auto &overlay : mOverlays)
+        {
+            if (overlay.imageName == imageName)
+            {
+                return &overlay;
+            }
+        }
+        return nullptr;
+    }
+
+    void forgetOverlay(const char *imageName)
+    {
+        auto it = std::find_if(mOverlays.begin(), mOverlays.end(),
+                               [&](const RetainedOverlay &overlay) { return overlay.imageName == imageName; });
+        if (it != mOverlays.end())
+        {
+            mOverlays.erase(it);
+        }
+    }
+
+    /// Remember what was sent to an image by updateVectorGraphics(), or forget it if sending failed.
+    Error retainOverlay(const char *imageName, RetainedOverlay *overlay, Error error, size_t commandCount, size_t size,
+                        uint64_t hash)
+    {
+        if (error != Error::Ok)
+        {
+            // What tev received is not known.
+            forgetOverlay(imageName);
+            return error;
+        }
+
+        if (!overlay)
+        {
+            mOverlays.emplace_back(mAllocator);
+            overlay = &mOverlays.back();
+            overlay->imageName = imageName;
+        }
+        overlay->commandCount = commandCount;
+        overlay->size = size;
+        overlay->hash = hash;
+        return Error::Ok;
+    }
+
+    Error updateVectorGraphics(const char *imageName, const VgCommand *commands, size_t commandCount, bool grabFocus)
+    {
+        // Hash the encoding of the commands, checking on the way whether the previous ones are a prefix.
+        RetainedOverlay *overlay = findOverlay(imageName);
+        size_t prefixCount = overlay && overlay->commandCount <= commandCount ? overlay->commandCount : SIZE_MAX;
+        bool extendsPrefix = false;
+        StreamHash hash;
+        size_t size = 0;
+        for (size_t i = 0; i <= commandCount; ++i)
+        {
+            if (i == prefixCount)
+            {
+                extendsPrefix = size == overlay->size && hash.value() == overlay->hash;
+            }
+            if (i < commandCount)
+            {
+                const VgCommand &command = commands[i];
+                hash.update(&command.type, 1);
+                hash.update(command.data, command.dataCount * sizeof(float));
+                size += 1 + command.dataCount * sizeof(float);
+            }
+        }
+        if (extendsPrefix && prefixCount == commandCount)
+        {
+            return Error::Ok;
+        }
+
+        size_t begin = extendsPrefix ? prefixCount : 0;
+        Error error = sendVectorGraphics(&imageName, 1, commands + begin, commandCount - begin, extendsPrefix,
+                                         grabFocus);
+        return retainOverlay(imageName, overlay, error, commandCount, size, hash.value());
+    }
+
+    Error updateVectorGraphics(const char *imageName, const VgBuffer &buffer, bool grabFocus)
+    {
+        // The buffer holds the encoded commands, the previous ones are a prefix if the hash of as many
+        // bytes at the start of the buffer matches.
+        RetainedOverlay *overlay = findOverlay(imageName);
+        bool extendsPrefix = false;
+        StreamHash hash;
+        if (overlay && overlay->size <= buffer.size() && overlay->commandCount <= buffer.commandCount())
+        {
+            hash.update(buffer.data(), overlay->size);
+            extendsPrefix = hash.value() == overlay->hash;
+        }
+        if (extendsPrefix && overlay->size == buffer.size() && overlay->commandCount == buffer.commandCount())
+        {
+            return Error::Ok;
+        }
+
+        Error error;
+        if (extendsPrefix)
+        {
+            hash.update(buffer.data() + overlay->size, buffer.size() - overlay->size);
+            error = sendEncodedVectorGraphics(&imageName, 1, buffer.commandCount() - overlay->commandCount,
+                                              buffer.data() + overlay->size, buffer.size() - overlay->size, true,
+                                              grabFocus);
+        }
+        else
+        {
+            hash = StreamHash();
+            hash.update(buffer.data(), buffer.size());
+            error = sendEncodedVectorGraphics(&imageName, 1, buffer.commandCount(), buffer.data(), buffer.size(),
+                                              false, grabFocus);
+        }
+        return retainOverlay(imageName, overlay, error, buffer.commandCount(), buffer.size(), hash.value());
+    }
+
+    Error sendMessage(const void *header, size_t headerLen, const void *extraData = nullptr, size_t extraLen = 0)
+    {
+        uint32_t totalLen = static_cast<uint32_t>(4 + headerLen + extraLen);
+
+        if (mAsync)
+        {
+            Vector<uint8_t> frame = takeFrame(4 + headerLen + extraLen);
+            std::memcpy(frame.data(), &totalLen, 4);
+            std::memcpy(frame.data() + 4, header, headerLen);
+            if (extraData)
+            {
+                copyPayload(frame.data() + 4 + headerLen, extraData, extraLen);
+            }
+            return enqueueFrame(std::move(frame));
+        }
+
+        if (mBatchDepth > 0)
+        {
+            if (!isConnected())
+            {
+                return setLastError(Error::NotConnected, "Not connected");
+            }
+
+            appendToBatch(&totalLen, 4);
+            appendToBatch(header, headerLen);
+            if (extraData)
+            {
+                if (mBatch.size() + extraLen > mBatchThreshold)
+                {
+                    // Large payloads are not copied, they go out together with the pending frames.
+                    IoSlice slices[] = {{mBatch.data(), mBatch.size()}, {extraData, extraLen}};
+                    Error error = sendSlices(slices, 2);
+                    mBatch.clear();
+                    return error;
+                }
+                appendToBatch(extraData, extraLen);
+            }
+            return mBatch.size() >= mBatchThreshold ? flush() : Error::Ok;
+        }
+
+        IoSlice slices[] = {{&totalLen, 4}, {header, headerLen}, {extraData, extraLen}};
+        return sendSlices(slices, extraData ? 3 : 2);
+    }
+
+    void appendToBatch(const void *data, size_t len)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        mBatch.insert(mBatch.end(), bytes, bytes + len);
+    }
+
+    void beginBatch()
+    {
+        ++mBatchDepth;
+    }
+
+    Error endBatch()
+    {
+        if (mBatchDepth > 0 && --mBatchDepth > 0)
+        {
+            return Error::Ok;
+        }
+        return flush();
+    }
+
+    Error flush()
+    {
+        if (mAsync)
+        {
+            std::unique_lock<std::mutex> lock(mQueueMutex);
+            mIdleCv.wait(lock, [this] { return isIdle(); });
+            lock.unlock();
+            return takeAsyncError();
+        }
+
+        if (mBatch.empty())
+        {
+            return Error::Ok;
+        }
+
+        Error error = send(mBatch.data(), mBatch.size());
+        mBatch.clear();
+        return error;
+    }
+
+    void setBatchThreshold(size_t bytes)
+    {
+        mBatchThreshold = bytes;
+    }
+
+    Error setAsync(bool async)
+    {
+        if (async == mAsync)
+        {
+            return Error::Ok;
+        }
+
+        if (async)
+        {
+            Error error = flush();
+            mWriterFrames.reserve(MaxWriterFrames);
+            mWriterSlices.reserve(MaxWriterFrames);
+            mFramePool.reserve(MaxPooledFrames);
+            mStopWriter = false;
+            mAsync = true;
+            mWriter = std::thread(&Impl::writerLoop, this);
+            return error;
+        }
+
+        Error error = flush();
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mStopWriter = true;
+        }
+        mQueueCv.notify_all();
+        mWriter.join();
+        mAsync = false;
+        mThreadSafe = false;
+        mFramePool.clear();
+        mPooledFrameBytes = 0;
+        return error;
+    }
+
+    bool isAsync() const
+    {
+        return mAsync;
+    }
+
+    Error setThreadSafe(bool threadSafe)
+    {
+        if (threadSafe == mThreadSafe)
+        {
+            return Error::Ok;
+        }
+
+        if (threadSafe)
+        {
+            mThreadSafeStartedWriter = !mAsync;
+            RETURN_IF_FAILED(setAsync(true));
+            mThreadSafe = true;
+            return Error::Ok;
+        }
+
+        mThreadSafe = false;
+        return mThreadSafeStartedWriter ? setAsync(false) : Error::Ok;
+    }
+
+    bool isThreadSafe() const
+    {
+        return mThreadSafe;
+    }
+
+    /// Return a buffer of the given size for a message, reusing the smallest sent one that is large enough.
+    Vector<uint8_t> takeFrame(size_t size)
+    {
+        Vector<uint8_t> frame(mAllocator);
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            size_t best = mFramePool.size();
+            for (size_t i = 0; i < mFramePool.size(); ++i)
+            {
+                size_t capacity = mFramePool[i].capacity();
+                if (capacity >= size && (best == mFramePool.size() || capacity < mFramePool[best].capacity()))
+                {
+                    best = i;
+                }
+            }
+            if (best < mFramePool.size())
+            {
+                frame = std::move(mFramePool[best]);
+                mFramePool[best] = std::move(mFramePool.back());
+                mFramePool.pop_back();
+                mPooledFrameBytes -= frame.capacity();
+            }
+        }
+        frame.resize(size);
+        return frame;
+    }
+
+    /**
+     * Keep sent message buffers for reuse, up to MaxPooledFrames and MaxPooledFrameBytes. Called by
+     * the writer thread with the queue lock held, the pool was reserved by setAsync().
+     */
+    void recycleFrames(Vector<Vector<uint8_t>> &frames)
+    {
+        for (Vector<uint8_t> &frame : frames)
+        {
+            if (mFramePool.size() == mFramePool.capacity() ||
+                mPooledFrameBytes + frame.capacity() > MaxPooledFrameBytes)
+            {
+                break;
+            }
+            mPooledFrameBytes += frame.capacity();
+            mFramePool.push_back(std::move(frame));
+        }
+        frames.clear();
+    }
+
+    void setMaxChunkSize(size_t bytes)
+    {
+        mMaxChunkSize = std::max<size_t>(bytes, 1);
+    }
+
+    void setMaxVectorGraphicsSize(size_t bytes)
+    {
+        // Messages carry their length as uint32_t.
+        mMaxVgMessageSize = std::min<size_t>(std::max<size_t>(bytes, 1), UINT32_MAX / 2);
+    }
+
+    void setSchedulingPolicy(SchedulingPolicy policy)
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        mSchedulingPolicy = policy;
+    }
+
+    void setImageWeight(const char *imageName, float weight)
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        mImageSchedules[String(imageName, mAllocator)].weight = std::max(weight, 1e-3f);
+    }
+
+    /// Queue a complete frame on the high priority lane.
+    Error enqueueFrame(Vector<uint8_t> frame)
+    {
+        RETURN_IF_FAILED(takeAsyncError());
+        if (!isConnected())
+        {
+            return setLastError(Error::NotConnected, "Not connected");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mQueuedBytes += frame.size();
+            mHighLane.push_back(std::move(frame));
+        }
+        mQueueCv.notify_one();
+        return Error::Ok;
+    }
+
+    /**
+     * Queue a region update on the bulk lane. The image data is referenced, not copied, unless
+     * copyCount is given: thread-safe updates copy that many floats of image data into the job.
+     */
+    Error enqueueUpdate(RegionUpdate update, UploadId id, size_t copyCount = 0)
+    {
+        RETURN_IF_FAILED(takeAsyncError());
+        if (!isConnected())
+        {
+            return setLastError(Error::NotConnected, "Not connected");
+        }
+
+        UniquePtr<BulkJob> job = makeUnique<BulkJob>(mAllocator, mAllocator);
+        size_t rowBytes = static_cast<size_t>(update.width) * update.channelNames.size() * sizeof(float);
+        rowBytes = std::max<size_t>(rowBytes, 1);
+        job->rowsPerChunk = static_cast<uint32_t>(std::max<size_t>(mMaxChunkSize / rowBytes, 1));
+        job->id = id;
+        job->bytesTotal = rowBytes * update.height;
+        job->bytesRemaining = job->bytesTotal;
+        job->update = std::move(update);
+        if (copyCount > 0)
+        {
+            copyImageData(*job, copyCount);
+        }
+        // Every chunk has a header of the same size and at most one slice per channel, plus the
+        // frame length and header slices.
+        encodeRegionRows(job->update, 0, 0, false, job->scratch);
+        job->scratch.slices.clear();
+        job->scratch.slices.reserve(job->update.channelNames.size() + 2);
+
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mQueuedBytes += job->bytesRemaining;
+            // The scheduler looks images up while the writer thread holds the lock.
+            mImageSchedules[job->update.imageName];
+            mBulkJobs.push_back(std::move(job));
+        }
+        mQueueCv.notify_one();
+        return Error::Ok;
+    }
+
+    /// Drop pending updates of an image, e.g. because it is closed or re-created.
+    void cancelUploads(const char *imageName)
+    {
+        if (!mAsync)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        for (auto &job : mBulkJobs)
+        {
+            if (job->update.imageName == imageName)
+            {
+                job->cancelled = true;
+            }
+        }
+    }
+
+    Error cancelUpload(UploadId id)
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        for (auto &job : mBulkJobs)
+        {
+            if (job->id == id)
+            {
+                job->cancelled = true;
+                return Error::Ok;
+            }
+        }
+        if (id == mSyncUpload.id && mSyncUpload.state == UploadState::InProgress)
+        {
+            mSyncUploadCancelled = true;
+            return Error::Ok;
+        }
+        // Uploads that already finished can no longer be cancelled, which is not an error.
+        return id != 0 && id < mNextUploadId ? Error::Ok : setLastError(Error::ArgumentError, "Unknown upload.");
+    }
+
+    Error getUploadProgress(UploadId id, UploadProgress &progress)
+    {
+        // Ids start at 1, 0 is the id of the idle synchronous upload state.
+        if (id == 0)
+        {
+            return setLastError(Error::ArgumentError, "Unknown upload.");
+        }
+
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        for (auto &job : mBulkJobs)
+        {
+            if (job->id == id)
+            {
+                progress = jobProgress(*job);
+                return Error::Ok;
+            }
+        }
+        if (id == mSyncUpload.id)
+        {
+            progress = mSyncUpload;
+            return Error::Ok;
+        }
+        for (size_t i = 0; i < std::min(mFinishedUploadCount, MaxFinishedUploads); ++i)
+        {
+            if (mFinishedUploads[i].id == id)
+            {
+                progress = mFinishedUploads[i];
+                return Error::Ok;
+            }
+        }
+        return setLastError(Error::ArgumentError, "Unknown upload.");
+    }
+
+    void setUploadCallback(UploadCallback callback, void *userData)
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        mUploadCallback = callback;
+        mUploadCallbackUserData = userData;
+    }
+
+    UploadId lastUploadId() const
+    {
+        if (mThreadSafe)
+        {
+            return tLastUpload.client == mId ? tLastUpload.id : 0;
+        }
+        return mNextUploadId - 1;
+    }
+
+    UploadId nextUploadId()
+    {
+        UploadId id = mNextUploadId++;
+        tLastUpload = {mId, id};
+        return id;
+    }
+
+    PreparedUpdate addPrepared(UniquePtr<PreparedLayout> layout)
+    {
+        PreparedUpdate handle = mNextPrepared++;
+        mPrepared[handle] = std::move(layout);
+        return handle;
+    }
+
+    PreparedLayout *findPrepared(PreparedUpdate handle)
+    {
+        auto it = mPrepared.find(handle);
+        return it != mPrepared.end() ? it->second.get() : nullptr;
+    }
+
+    void releasePrepared(PreparedUpdate handle)
+    {
+        mPrepared.erase(handle);
+    }
+
+    /**
+     * Send a region update synchronously in chunks of whole rows, reporting progress
+     * through the upload callback after each chunk. The callback can cancel the upload,
+     * every chunk that was sent is a complete region message.
+     */
+    Error sendUploadChunks(const RegionUpdate &update, UploadId id)
+    {
+        RETURN_IF_FAILED(flush());
+
+        size_t rowBytes = static_cast<size_t>(update.width) * update.channelNames.size() * sizeof(float);
+        rowBytes = std::max<size_t>(rowBytes, 1);
+        uint32_t rowsPerChunk = static_cast<uint32_t>(std::max<size_t>(mMaxChunkSize / rowBytes, 1));
+
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mSyncUpload = UploadProgress{};
+            mSyncUpload.id = id;
+            mSyncUpload.state = UploadState::InProgress;
+            mSyncUpload.bytesTotal = rowBytes * update.height;
+            mSyncUpload.rowsTotal = update.height;
+            mSyncUploadCancelled = false;
+        }
+
+        Vector<IoSlice> &slices = mUploadScratch.slices;
+        Error error = Error::Ok;
+        uint32_t row = 0;
+        do
+        {
+            uint32_t rowCount = std::min(rowsPerChunk, update.height - row);
+            uint32_t frameLen = 0;
+            slices.clear();
+            slices.push_back({&frameLen, 4});
+            slices.push_back({nullptr, 0});
+            size_t payloadSize =
+                encodeRegionRows(update, row, rowCount, row == 0 && update.grabFocus, mUploadScratch);
+            frameLen = static_cast<uint32_t>(4 + mUploadScratch.header.size() + payloadSize);
+            slices[1] = {mUploadScratch.header.data(), mUploadScratch.header.size()};
+            error = sendSlices(slices.data(), slices.size());
+            row += rowCount;
+
+            UploadProgress progress;
+            {
+                std::lock_guard<std::mutex> lock(mQueueMutex);
+                mSyncUpload.rowsSent = row;
+                mSyncUpload.bytesSent = rowBytes * row;
+                if (error != Error::Ok)
+                {
+                    mSyncUpload.state = UploadState::Failed;
+                }
+                else if (row >= update.height)
+                {
+                    mSyncUpload.state = UploadState::Completed;
+                }
+                progress = mSyncUpload;
+            }
+
+            bool proceed = !mUploadCallback || mUploadCallback(progress, mUploadCallbackUserData);
+            if (error == Error::Ok && row < update.height && (!proceed || mSyncUploadCancelled))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mQueueMutex);
+                    mSyncUpload.state = UploadState::Cancelled;
+                    progress = mSyncUpload;
+                }
+                if (mUploadCallback)
+                {
+                    mUploadCallback(progress, mUploadCallbackUserData);
+                }
+                error = setLastError(Error::Cancelled, "Upload was cancelled.");
+            }
+        } while (error == Error::Ok && row < update.height);
+
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        recordFinished(mSyncUpload);
+        mSyncUpload = UploadProgress{};
+        return error;
+    }
+
+    bool hasUploadCallback() const
+    {
+        return mUploadCallback != nullptr;
+    }
+
+    /// Report an error that occurred on the writer thread.
+    Error takeAsyncError()
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        if (mAsyncError == Error::Ok)
+        {
+            return Error::Ok;
+        }
+        Error error = mAsyncError;
+        mAsyncError = Error::Ok;
+        return setLastError(error, "%s", mAsyncErrorString);
+    }
+
+    /// Set the last error, with a printf-style message.
+    Error setLastError(Error error, const char *format = "", ...)
+    {
+        // Updates may fail on several threads at once in thread-safe mode.
+        std::lock_guard<std::mutex> lock(mErrorMutex);
+        mLastError = error;
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(mLastErrorString, sizeof(mLastErrorString), format, args);
+        va_end(args);
+        return error;
+    }
+
+    /// Report that the allocator ran out of memory, for public functions that caught std::bad_alloc.
+    Error outOfMemory()
+    {
+        return setLastError(Error::OutOfMemory, "Out of memory.");
+    }
+
+    /// Set the last error to a socket error, described by the system error message.
+    Error setSocketError(const char *what)
+    {
+        mLastError = Error::SocketError;
+        formatSocketError(mLastErrorString, sizeof(mLastErrorString), what, lastSocketError());
+        return mLastError;
+    }
+
+    Error lastError() const
+    {
+        return mLastError;
+    }
+
+    const char *lastErrorString() const
+    {
+        return mLastErrorString;
+    }
+
+private:
+    /// Pending region update on the bulk lane, sent in chunks of whole rows.
+    struct BulkJob
+    {
+        explicit BulkJob(Allocator &allocator) : update(allocator), scratch(allocator), copiedData(allocator)
+        {
+        }
+
+        RegionUpdate update;
+        /// Sized when the job is queued, so that the writer thread encodes chunks without allocating.
+        EncodeScratch scratch;
+        /// Image data of thread-safe updates, counted in mCopiedBytes until the job is removed.
+        Vector<float> copiedData;
+        size_t copiedBytes{0};
+        UploadId id{0};
+        uint32_t nextRow{0};
+        uint32_t rowsPerChunk{1};
+        size_t bytesTotal{0};
+        size_t bytesRemaining{0};
+        bool cancelled{false};
+    };
+
+    static UploadProgress jobProgress(const BulkJob &job)
+    {
+        UploadProgress progress;
+        progress.id = job.id;
+        progress.state = job.nextRow == 0 ? UploadState::Queued : UploadState::InProgress;
+        progress.bytesSent = job.bytesTotal - job.bytesRemaining;
+        progress.bytesTotal = job.bytesTotal;
+        progress.rowsSent = job.nextRow;
+        progress.rowsTotal = job.update.height;
+        return progress;
+    }
+
+    /// Keep the final state of recent uploads for getUploadProgress().
+    void recordFinished(const UploadProgress &progress)
+    {
+        mFinishedUploads[mFinishedUploadCount++ % MaxFinishedUploads] = progress;
+    }
+
+    /// Record the final state of an upload and notify the callback. Must be called with the queue mutex held.
+    void finishJob(const BulkJob &job, UploadState state, std::unique_lock<std::mutex> &lock)
+    {
+        UploadProgress progress = jobProgress(job);
+        progress.state = state;
+        recordFinished(progress);
+        if (mUploadCallback)
+        {
+            UploadCallback callback = mUploadCallback;
+            void *userData = mUploadCallbackUserData;
+            lock.unlock();
+            callback(progress, userData);
+            lock.lock();
+        }
+    }
+
+    bool isIdle() const
+    {
+        return mHighLane.empty() && mBulkJobs.empty() && !mWriterBusy;
+    }
+
+    /// Scheduling state of an image with pending updates.
+    struct ImageSchedule
+    {
+        float weight{1.f};
+        double virtualTime{0.0};
+    };
+
+    void removeCancelledJobs(std::unique_lock<std::mutex> &lock)
+    {
+        for (size_t i = 0; i < mBulkJobs.size();)
+        {
+            if (mBulkJobs[i]->cancelled)
+            {
+                UniquePtr<BulkJob> job = std::move(mBulkJobs[i]);
+                mBulkJobs.erase(mBulkJobs.begin() + i);
+                mQueuedBytes -= job->bytesRemaining;
+                releaseCopiedData(*job);
+                finishJob(*job, UploadState::Cancelled, lock);
+                // The callback may have changed the queue.
+                i = 0;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+
+    void removeJob(BulkJob *job)
+    {
+        for (auto it = mBulkJobs.begin(); it != mBulkJobs.end(); ++it)
+        {
+            if (it->get() == job)
+            {
+                releaseCopiedData(*job);
+                mBulkJobs.erase(it);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Copy the image data of a thread-safe update into its job. Waits while the copies of queued
+     * updates exceed MaxCopiedUpdateBytes, so that producers cannot outrun the connection.
+     */
+    void copyImageData(BulkJob &job, size_t count)
+    {
+        size_t bytes = count * sizeof(float);
+        {
+            std::unique_lock<std::mutex> lock(mQueueMutex);
+            mCopiedSpaceCv.wait(lock,
+                                [&] { return mCopiedBytes == 0 || mCopiedBytes + bytes <= MaxCopiedUpdateBytes; });
+            mCopiedBytes += bytes;
+        }
+        job.copiedBytes = bytes;
+        try
+        {
+            job.copiedData.resize(count);
+        }
+        catch (const std::bad_alloc &)
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            releaseCopiedData(job);
+            throw;
+        }
+        copyPayload(reinterpret_cast<uint8_t *>(job.copiedData.data()), job.update.imageData, bytes);
+        job.update.imageData = job.copiedData.data();
+    }
+
+    /// Let waiting thread-safe updates proceed once a job no longer needs its copy. Called with the queue lock held.
+    void releaseCopiedData(BulkJob &job)
+    {
+        if (job.copiedBytes > 0)
+        {
+            mCopiedBytes -= job.copiedBytes;
+            job.copiedBytes = 0;
+            mCopiedSpaceCv.notify_all();
+        }
+    }
+
+    /**
+     * Pick the job to send the next chunk of. Updates of the same image are always sent
+     * in order, only the oldest pending update of each image is a candidate. Across images,
+     * the one with the smallest virtual time is served, which is advanced by the bytes
+     * (weighted fair) or chunks (round robin) it was served, divided by its weight.
+     */
+    BulkJob *selectJob()
+    {
+        if (mSchedulingPolicy == SchedulingPolicy::Fifo)
+        {
+            return mBulkJobs.front().get();
+        }
+
+        BulkJob *best = nullptr;
+        double bestTime = 0.0;
+        for (size_t i = 0; i < mBulkJobs.size(); ++i)
+        {
+            BulkJob *job = mBulkJobs[i].get();
+            bool isHead = true;
+            for (size_t j = 0; j < i && isHead; ++j)
+            {
+                isHead = mBulkJobs[j]->update.imageName != job->update.imageName;
+            }
+            if (!isHead)
+            {
+                continue;
+            }
+
+            // Images that were idle start at the current virtual time instead of catching up.
+            ImageSchedule &schedule = mImageSchedules[job->update.imageName];
+            schedule.virtualTime = std::max(schedule.virtualTime, mVirtualTime);
+            if (!best || schedule.virtualTime < bestTime)
+            {
+                best = job;
+                bestTime = schedule.virtualTime;
+            }
+        }
+
+        mVirtualTime = bestTime;
+        return best;
+    }
+
+    void chargeImage(const String &imageName, size_t bytes)
+    {
+        if (mSchedulingPolicy == SchedulingPolicy::Fifo)
+        {
+            return;
+        }
+
+        ImageSchedule &schedule = mImageSchedules[imageName];
+        double cost = mSchedulingPolicy == SchedulingPolicy::RoundRobin ? 1.0 : static_cast<double>(bytes);
+        schedule.virtualTime += cost / schedule.weight;
+
+        // Forget idle images with default weights, so the map does not grow with every image name.
+        if (mBulkJobs.size() == 1)
+        {
+            for (auto it = mImageSchedules.begin(); it != mImageSchedules.end();)
+            {
+                it = it->second.weight == 1.f && it->first != imageName ? mImageSchedules.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    /**
+     * Send queued frames and chunks until stopped. Runs without allocating: its buffers are
+     * reserved by setAsync() and the chunks are encoded into the scratch buffers of their jobs.
+     */
+    void writerLoop()
+    {
+        Vector<Vector<uint8_t>> &frames = mWriterFrames;
+
+        std::unique_lock<std::mutex> lock(mQueueMutex);
+        for (;;)
+        {
+            mQueueCv.wait(lock, [this] { return mStopWriter || !mHighLane.empty() || !mBulkJobs.empty(); });
+
+            mWriterBusy = true;
+            removeCancelledJobs(lock);
+            mWriterBusy = false;
+            if (mHighLane.empty() && mBulkJobs.empty())
+            {
+                mIdleCv.notify_all();
+                if (mStopWriter)
+                    break;
+                continue;
+            }
+
+            // High priority frames always go first, up to MaxWriterFrames with a single gathered write.
+            // Otherwise send the next chunk of the update picked by the scheduler.
+            frames.clear();
+            BulkJob *job = nullptr;
+            uint32_t rowCount = 0;
+            size_t bytes = 0;
+            if (!mHighLane.empty())
+            {
+                while (!mHighLane.empty() && frames.size() < MaxWriterFrames)
+                {
+                    frames.push_back(std::move(mHighLane.front()));
+                    mHighLane.pop_front();
+                }
+            }
+            else
+            {
+                job = selectJob();
+                rowCount = std::min(job->rowsPerChunk, job->update.height - job->nextRow);
+            }
+            Vector<IoSlice> &slices = job ? job->scratch.slices : mWriterSlices;
+            slices.clear();
+            mWriterBusy = true;
+            lock.unlock();
+
+            uint32_t frameLen = 0;
+            if (job)
+            {
+                slices.push_back({&frameLen, 4});
+                slices.push_back({nullptr, 0});
+                EncodeScratch &scratch = job->scratch;
+                size_t payloadSize = encodeRegionRows(job->update, job->nextRow, rowCount,
+                                                      job->nextRow == 0 && job->update.grabFocus, scratch);
+                frameLen = static_cast<uint32_t>(4 + scratch.header.size() + payloadSize);
+                slices[1] = {scratch.header.data(), scratch.header.size()};
+                uint32_t rowsLeft = job->update.height - job->nextRow;
+                bytes = rowCount >= rowsLeft ? job->bytesRemaining : job->bytesRemaining / rowsLeft * rowCount;
+            }
+            else
+            {
+                for (auto &frame : frames)
+                {
+                    slices.push_back({frame.data(), frame.size()});
+                    bytes += frame.size();
+                }
+            }
+
+            char errorString[MaxErrorLength];
+            Error error = writeSlices(slices.data(), slices.size(), errorString);
+
+            lock.lock();
+            mQueuedBytes -= bytes;
+            recycleFrames(frames);
+            if (job)
+            {
+                job->nextRow += rowCount;
+                job->bytesRemaining -= bytes;
+                chargeImage(job->update.imageName, bytes);
+                if (error != Error::Ok)
+                {
+                    finishJob(*job, UploadState::Failed, lock);
+                }
+                else if (job->nextRow >= job->update.height)
+                {
+                    mQueuedBytes -= job->bytesRemaining;
+                    finishJob(*job, UploadState::Completed, lock);
+                    removeJob(job);
+                }
+                else if (mUploadCallback)
+                {
+                    UploadProgress progress = jobProgress(*job);
+                    UploadCallback callback = mUploadCallback;
+                    void *userData = mUploadCallbackUserData;
+                    lock.unlock();
+                    bool proceed = callback(progress, userData);
+                    lock.lock();
+                    job->cancelled |= !proceed;
+                }
+            }
+
+            if (error != Error::Ok)
+            {
+                // Everything that was queued is lost, report the error with the next call.
+                mAsyncError = error;
+                std::memcpy(mAsyncErrorString, errorString, sizeof(errorString));
+                mHighLane.clear();
+                for (auto &pending : mBulkJobs)
+                {
+                    if (pending.get() != job)
+                    {
+                        UploadProgress progress = jobProgress(*pending);
+                        progress.state = UploadState::Failed;
+                        recordFinished(progress);
+                    }
+                    releaseCopiedData(*pending);
+                }
+                mBulkJobs.clear();
+                mQueuedBytes = 0;
+            }
+
+            mWriterBusy = false;
+            if (isIdle())
+            {
+                mIdleCv.notify_all();
+            }
+        }
+    }
+
+    Allocator &mAllocator;
+    String mHostname;
+    uint16_t mPort;
+    socket_t mSocketFd{INVALID_SOCKET};
+
+    std::atomic<uint64_t> mBytesWritten{0};
+    uint64_t mDrainSampleWritten{0};
+    size_t mDrainSampleBacklog{0};
+    std::chrono::steady_clock::time_point mDrainSampleTime{};
+    double mDrainRate{0.0};
+
+    uint64_t mWriteBytes{0};
+    double mWriteSeconds{0.0};
+    std::atomic<double> mBandwidth{0.0};
+
+    float mPreviewFrameRate{30.f};
+    uint32_t mMaxPreviewDownsample{16};
+    Vector<std::pair<String, uint32_t>> mPreviewDownsample{mAllocator};
+    PreviewScratch mPreviewScratch{mAllocator};
+    Vector<uint8_t> mFrameBuffer{mAllocator};
+
+    Vector<uint8_t> mBatch{mAllocator};
+    size_t mBatchThreshold{256 * 1024};
+    uint32_t mBatchDepth{0};
+
+    Vector<uint8_t> mScratch{mAllocator};
+    Vector<uint8_t> mVgScratch{mAllocator};
+    Vector<IoSlice> mSlices{mAllocator};
+    size_t mMaxVgMessageSize{1024 * 1024};
+    EncodeScratch mUploadScratch{mAllocator};
+
+    Map<PreparedUpdate, UniquePtr<PreparedLayout>> mPrepared{mAllocator};
+    PreparedUpdate mNextPrepared{1};
+
+    Vector<RetainedOverlay> mOverlays{mAllocator};
+
+    bool mAsync{false};
+    bool mThreadSafe{false};
+    bool mThreadSafeStartedWriter{false};
+    std::thread mWriter;
+    std::mutex mQueueMutex;
+    std::condition_variable mQueueCv;
+    std::condition_variable mIdleCv;
+    Deque<Vector<uint8_t>> mHighLane{mAllocator};
+    /// Buffers of sent messages, reused by takeFrame().
+    Vector<Vector<uint8_t>> mFramePool{mAllocator};
+    /// Frames and slices of the writer thread's current write.
+    Vector<Vector<uint8_t>> mWriterFrames{mAllocator};
+    Vector<IoSlice> mWriterSlices{mAllocator};
+    size_t mPooledFrameBytes{0};
+    /// Image data copied by queued thread-safe updates, see copyImageData().
+    size_t mCopiedBytes{0};
+    std::condition_variable mCopiedSpaceCv;
+    Deque<UniquePtr<BulkJob>> mBulkJobs{mAllocator};
+    size_t mQueuedBytes{0};
+    size_t mMaxChunkSize{1024 * 1024};
+    SchedulingPolicy mSchedulingPolicy{SchedulingPolicy::WeightedFair};
+    const uint64_t mId{sNextClientId++};
+    std::atomic<UploadId> mNextUploadId{1};
+    UploadCallback mUploadCallback{nullptr};
+    void *mUploadCallbackUserData{nullptr};
+    UploadProgress mSyncUpload;
+    std::atomic<bool> mSyncUploadCancelled{false};
+    UploadProgress mFinishedUploads[MaxFinishedUploads];
+    size_t mFinishedUploadCount{0};
+    Map<String, ImageSchedule> mImageSchedules{mAllocator};
+    double mVirtualTime{0.0};
+    bool mWriterBusy{false};
+    bool mStopWriter{false};
+    Error mAsyncError{Error::Ok};
+    char mAsyncErrorString[MaxErrorLength]{};
+
+    std::mutex mErrorMutex;
+    Error mLastError{Error::Ok};
+    char mLastErrorString[MaxErrorLength]{};
+};
+
+bool initialize(const char **error)
+{
+    return internalInitialize(error);
+}
+
+void shutdown()
+{
+    internalShutdown();
+}
+
+/// Free range of an ArenaAllocator, stored at its start.
+struct ArenaAllocator::FreeBlock
+{
+    size_t size;
+    FreeBlock *next;
+};
+
+/// Allocations are rounded to this size, so that every free range can hold a FreeBlock.
+static constexpr size_t ArenaGranularity = 16;
+
+static size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/// The lock of an ArenaAllocator, constructed in storage reserved by the class.
+static std::mutex &arenaLock(unsigned char *storage)
+{
+    return *reinterpret_cast<std::mutex *>(storage);
+}
+
+ArenaAllocator::ArenaAllocator(void *buffer, size_t size)
+{
+    static_assert(sizeof(FreeBlock) <= ArenaGranularity, "FreeBlock does not fit into the smallest allocation");
+    static_assert(sizeof(std::mutex) <= sizeof(mLockStorage), "std::mutex does not fit into the lock storage");
+    static_assert(alignof(std::mutex) <= alignof(std::max_align_t), "std::mutex is over-aligned");
+    new (mLockStorage) std::mutex();
+    size_t begin = alignUp(reinterpret_cast<size_t>(buffer), ArenaGranularity);
+    size_t end = (reinterpret_cast<size_t>(buffer) + size) / ArenaGranularity * ArenaGranularity;
+    if (end > begin)
+    {
+        mFreeList = reinterpret_cast<FreeBlock *>(begin);
+        mFreeList->size = end - begin;
+        mFreeList->next = nullptr;
+    }
+}
+
+ArenaAllocator::~ArenaAllocator()
+{
+    arenaLock(mLockStorage).~mutex();
+}
+
+void *ArenaAllocator::allocate(size_t size, size_t alignment)
+{
+    size = alignUp(std::max<size_t>(size, 1), ArenaGranularity);
+    alignment = std::max(alignment, ArenaGranularity);
+
+    // First fit, the padding in front of an aligned allocation stays free.
+    std::lock_guard<std::mutex> lock(arenaLock(mLockStorage));
+    for (FreeBlock **link = &mFreeList; *link; link = &(*link)->next)
+    {
+        FreeBlock *block = *link;
+        size_t begin = reinterpret_cast<size_t>(block);
+        size_t end = begin + block->size;
+        size_t start = alignUp(begin, alignment);
+        if (start > end || end - start < size)
+        {
+            continue;
+        }
+
+        FreeBlock *next = block->next;
+        if (end - start > size)
+        {
+            FreeBlock *rest = reinterpret_cast<FreeBlock *>(start + size);
+            rest->size = end - start - size;
+            rest->next = next;
+            next = rest;
+        }
+        if (start > begin)
+        {
+            block->size = start - begin;
+            block->next = next;
+        }
+        else
+        {
+            *link = next;
+        }
+        mUsed += size;
+        return reinterpret_cast<void *>(start);
+    }
+    return nullptr;
+}
+
+void ArenaAllocator::deallocate(void *ptr, size_t size, size_t /* alignment */)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    size = alignUp(std::max<size_t>(size, 1), ArenaGranularity);
+    size_t begin = reinterpret_cast<size_t>(ptr);
+
+    std::lock_guard<std::mutex> lock(arenaLock(mLockStorage));
+    FreeBlock *prev = nullptr;
+    FreeBlock **link = &mFreeList;
+    while (*link && reinterpret_cast<size_t>(*link) < begin)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    // Merge with the free ranges right after and before.
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    block->size = size;
+    block->next = *link;
+    if (block->next && begin + size == reinterpret_cast<size_t>(block->next))
+    {
+        block->size += block->next->size;
+        block->next = block->next->next;
+    }
+    if (prev && reinterpret_cast<size_t>(prev) + prev->size == begin)
+    {
+        prev->size += block->size;
+        prev->next = block->next;
+    }
+    else
+    {
+        *link = block;
+    }
+    mUsed -= size;
+}
+
+size_t ArenaAllocator::used() const
+{
+    std::lock_guard<std::mutex> lock(arenaLock(mLockStorage));
+    return mUsed;
+}
+
+Client::Client(const char *hostname, uint16_t port) : Client(hostname, port, defaultAllocator())
+{
+}
+
+Client::Client(const char *hostname, uint16_t port, Allocator &allocator)
+{
+    void *memory = allocateOrThrow(allocator, sizeof(Client::Impl), alignof(Client::Impl));
+    mImpl = new (memory) Client::Impl(hostname, port, allocator);
+}
+
+Client::~Client()
+{
+    Allocator &allocator = mImpl->allocator();
+    mImpl->~Impl();
+    allocator.deallocate(mImpl, sizeof(Client::Impl), alignof(Client::Impl));
+}
+
+const char *Client::getHostname() const
+{
+    return mImpl->getHostname();
+}
+
+uint16_t Client::getPort() const
+{
+    return mImpl->getPort();
+}
+
+Error Client::connect()
+try
+{
+    return mImpl->connect();
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::disconnect()
+{
+    return mImpl->disconnect();
+}
+
+bool Client::isConnected() const
+{
+    return mImpl->isConnected();
+}
+
+Error Client::openImage(const char *imagePath, const char *channelSelector, bool grabFocus)
+try
+{
+    // tev names the image after its path, replacing any image of that name.
+    mImpl->forgetOverlay(imagePath);
+
+    return mImpl->sendPacket(protocol::OpenImageV2Packet{grabFocus, imagePath, channelSelector});
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::reloadImage(const char *imageName, bool grabFocus)
+try
+{
+    mImpl->forgetOverlay(imageName);
+
+    return mImpl->sendPacket(protocol::ReloadImagePacket{grabFocus, imageName});
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::closeImage(const char *imageName)
+try
+{
+    mImpl->cancelUploads(imageName);
+    mImpl->forgetOverlay(imageName);
+
+    return mImpl->sendPacket(protocol::CloseImagePacket{imageName});
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::createImage(const char *imageName, uint32_t width, uint32_t height, uint32_t channelCount,
+                          const char **channelNames, bool grabFocus)
+try
+{
+    if (width == 0 || height == 0)
+    {
+        return mImpl->setLastError(Error::ArgumentError, "Image width and height must be greater than 0.");
+    }
+    if (channelCount == 0)
+    {
+        return mImpl->setLastError(Error::ArgumentError, "Image must have at least one channel.");
+    }
+    if (channelCount > 4 && !channelNames)
+    {
+        return mImpl->setLastError(Error::ArgumentError,
+                                   "Channel names cannot be inferred for images with more than 4 channels.");
+    }
+
+    const char *defaultNames[] = {"R", "G", "B", "A"};
+
+    if (!channelNames)
+    {
+        channelNames = defaultNames;
+    }
+
+    mImpl->cancelUploads(imageName);
+    mImpl->forgetOverlay(imageName);
+
+    return mImpl->sendPacket(
+        protocol::CreateImagePacket{grabFocus, imageName, width, height, channelCount, channelNames});
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::updateImage(const char *imageName, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                          uint32_t channelCount, const char **channelNames, uint64_t *channelOffsets,
+                          uint64_t *channelStrides, const float *imageData, size_t imageDataCount, bool grabFocus)
+try
+{
+    UploadId uploadId = mImpl->nextUploadId();
+    ChannelLayout layout(channelCount);
+    RETURN_IF_FAILED(mImpl->resolveChannelLayout(channelCount, channelNames, channelOffsets, channelStrides, layout));
+    RETURN_IF_FAILED(
+        mImpl->checkImageDataCount(channelCount, layout.offsets, layout.strides, width, height, imageDataCount));
+
+    if (mImpl->isAsync() || mImpl->hasUploadCallback())
+    {
+        RegionUpdate update(mImpl->allocator());
+        update.imageName = imageName;
+        update.grabFocus = grabFocus;
+        update.x = x;
+        update.y = y;
+        update.width = width;
+        update.height = height;
+        update.channelNames.assign(layout.names, layout.names + channelCount);
+        update.channelOffsets.assign(layout.offsets, layout.offsets + channelCount);
+        update.channelStrides.assign(layout.strides, layout.strides + channelCount);
+        update.imageData = imageData;
+        if (mImpl->isAsync())
+        {
+            // Thread-safe updates copy the image data, so that it can be reused right away.
+            return mImpl->enqueueUpdate(std::move(update), uploadId, mImpl->isThreadSafe() ? imageDataCount : 0);
+        }
+        return mImpl->sendUploadChunks(update, uploadId);
+    }
+
+    protocol::UpdateImageV3Packet packet{grabFocus, imageName, channelCount, layout.names, x, y,
+                                         width, height, layout.offsets, layout.strides};
+    return mImpl->sendPacket(packet, imageData, imageDataCount * sizeof(float));
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::prepareUpdate(const char *imageName, uint32_t channelCount, const char **channelNames,
+                            const uint64_t *channelOffsets, const uint64_t *channelStrides, PreparedUpdate &handle,
+                            bool grabFocus)
+try
+{
+    ChannelLayout layout(channelCount);
+    RETURN_IF_FAILED(mImpl->resolveChannelLayout(channelCount, channelNames, channelOffsets, channelStrides, layout));
+
+    UniquePtr<PreparedLayout> prepared = makeUnique<PreparedLayout>(mImpl->allocator(), mImpl->allocator());
+    prepared->imageName = imageName;
+    prepared->grabFocus = grabFocus;
+    prepared->channelNames.assign(layout.names, layout.names + channelCount);
+    prepared->channelOffsets.assign(layout.offsets, layout.offsets + channelCount);
+    prepared->channelStrides.assign(layout.strides, layout.strides + channelCount);
+
+    protocol::UpdateImageV3Packet packet{grabFocus, imageName, channelCount, layout.names, 0, 0, 0, 0,
+                                         layout.offsets, layout.strides};
+    prepared->header.resize(protocol::packetSize(packet));
+    protocol::encodePacket(prepared->header.data(), packet);
+    prepared->regionOffset = protocol::regionOffset(packet);
+
+    handle = mImpl->addPrepared(std::move(prepared));
+    return Error::Ok;
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::sendPrepared(PreparedUpdate handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                           const float *imageData, size_t imageDataCount)
+try
+{
+    UploadId uploadId = mImpl->nextUploadId();
+    PreparedLayout *layout = mImpl->findPrepared(handle);
+    if (!layout)
+    {
+        return mImpl->setLastError(Error::ArgumentError, "Invalid prepared update handle.");
+    }
+
+    uint32_t channelCount = static_cast<uint32_t>(layout->channelNames.size());
+    RETURN_IF_FAILED(mImpl->checkImageDataCount(channelCount, layout->channelOffsets.data(),
+                                                layout->channelStrides.data(), width, height, imageDataCount));
+
+    if (mImpl->isAsync() || mImpl->hasUploadCallback())
+    {
+        RegionUpdate update(mImpl->allocator());
+        update.imageName = layout->imageName;
+        update.grabFocus = layout->grabFocus;
+        update.x = x;
+        update.y = y;
+        update.width = width;
+        update.height = height;
+        update.channelNames = layout->channelNames;
+        update.channelOffsets = layout->channelOffsets;
+        update.channelStrides = layout->channelStrides;
+        update.imageData = imageData;
+        if (mImpl->isAsync())
+        {
+            // Thread-safe updates copy the image data, so that it can be reused right away.
+            return mImpl->enqueueUpdate(std::move(update), uploadId, mImpl->isThreadSafe() ? imageDataCount : 0);
+        }
+        return mImpl->sendUploadChunks(update, uploadId);
+    }
+
+    uint32_t region[4] = {x, y, width, height};
+    std::memcpy(layout->header.data() + layout->regionOffset, region, sizeof(region));
+    return mImpl->sendMessage(layout->header.data(), layout->header.size(), imageData,
+                              imageDataCount * sizeof(float));
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+void Client::releasePrepared(PreparedUpdate handle)
+{
+    mImpl->releasePrepared(handle);
+}
+
+Error Client::updateImagePreview(const char *imageName, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                 uint32_t channelCount, const char **channelNames, uint64_t *channelOffsets,
+                                 uint64_t *channelStrides, const float *imageData, size_t imageDataCount,
+                                 bool grabFocus, uint32_t *downsampleFactor)
+try
+{
+    ChannelLayout layout(channelCount);
+    RETURN_IF_FAILED(mImpl->resolveChannelLayout(channelCount, channelNames, channelOffsets, channelStrides, layout));
+    if (width == 0 || height == 0)
+    {
+        return mImpl->setLastError(Error::ArgumentError, "Preview region must not be empty.");
     }
 
-    if (imageDataCount != stridedImageDataCount)
+    // The reduced region holds one pixel per block, with interleaved channels. Every block row
+    // is sent as its own region message, encoded once and only differing in the region.
+    Client::Impl::PreviewScratch &scratch = mImpl->previewScratch();
+    Vector<uint64_t> &rowOffsets = scratch.rowOffsets;
+    Vector<uint64_t> &rowStrides = scratch.rowStrides;
+    rowOffsets.resize(channelCount);
+    rowStrides.assign(channelCount, channelCount);
+    for (uint32_t i = 0; i < channelCount; ++i)
+    {
+        rowOffsets[i] = i;
+    }
+    protocol::UpdateImageV3Packet rowPacket{grabFocus, imageName, channelCount, layout.names, 0, 0, 0, 0,
+                                            rowOffsets.data(), rowStrides.data()};
+    Vector<uint8_t> &rowHeader = scratch.rowHeader;
+    rowHeader.resize(protocol::packetSize(rowPacket));
+    protocol::encodePacket(rowHeader.data(), rowPacket);
+    size_t regionOffset = protocol::regionOffset(rowPacket);
+
+    size_t rowBytes = 4 + rowHeader.size();
+    size_t fullBytes = rowBytes + imageDataCount * sizeof(float);
+    uint32_t factor = mImpl->selectPreviewDownsample(imageName, width, height, channelCount, fullBytes, rowBytes);
+    if (downsampleFactor)
+    {
+        *downsampleFactor = factor;
+    }
+    if (factor == 1)
     {
-        return mImpl->setLastError(
-            Error::ArgumentError,
-            "Image data size does not match specified dimensions, offset, and stride. (Expected: " +
-                std::to_string(stridedImageDataCount) + ")");
+        return updateImage(imageName, x, y, width, height, channelCount, channelNames, channelOffsets, channelStrides,
+                           imageData, imageDataCount, grabFocus);
     }
 
-    return mImpl->sendMessage(msg, imageData, imageDataCount * sizeof(float));
+    RETURN_IF_FAILED(
+        mImpl->checkImageDataCount(channelCount, layout.offsets, layout.strides, width, height, imageDataCount));
+
+    uint32_t blocksX = (width + factor - 1) / factor;
+    uint32_t blocksY = (height + factor - 1) / factor;
+    size_t rowValues = static_cast<size_t>(blocksX) * channelCount;
+    size_t frameBytes = rowBytes + rowValues * sizeof(float);
+    // In asynchronous mode the reduced region is queued like any other update, so previews
+    // share the connection fairly with the updates of other images.
+    bool encodeFrames = !mImpl->isAsync();
+    Vector<uint8_t> frames = encodeFrames ? mImpl->takeFrameBuffer() : Vector<uint8_t>(mImpl->allocator());
+    frames.resize(encodeFrames ? frameBytes * blocksY : 0);
+    Vector<float> &sums = scratch.sums;
+    sums.assign(rowValues * blocksY, 0.f);
+
+    // Block rows are filtered in parallel, each into its own sums and frame, so the frames
+    // stay in order.
+    const uint64_t *offsets = layout.offsets;
+    const uint64_t *strides = layout.strides;
+    uint32_t rowsPerTask = std::max<uint32_t>(
+        static_cast<uint32_t>(PreviewPixelsPerTask / (static_cast<size_t>(factor) * width)), 1);
+    size_t taskCount = (blocksY + rowsPerTask - 1) / rowsPerTask;
+    parallelFor(taskCount, [&](size_t task) {
+        uint32_t byEnd = std::min(static_cast<uint32_t>(task + 1) * rowsPerTask, blocksY);
+        for (uint32_t by = static_cast<uint32_t>(task) * rowsPerTask; by < byEnd; ++by)
+        {
+            // Box filter: accumulate the rows of a block row, one channel at a time so the
+            // inner loop runs over a constant stride.
+            uint32_t rowBegin = by * factor;
+            uint32_t rowEnd = std::min(rowBegin + factor, height);
+            float *rowSums = &sums[by * rowValues];
+            for (uint32_t c = 0; c < channelCount; ++c)
+            {
+                uint64_t stride = strides[c];
+                for (uint32_t row = rowBegin; row < rowEnd; ++row)
+                {
+                    const float *src = imageData + offsets[c] + static_cast<uint64_t>(row) * width * stride;
+                    for (uint32_t bx = 0; bx < blocksX; ++bx)
+                    {
+                        uint32_t colBegin = bx * factor;
+                        uint32_t colEnd = std::min(colBegin + factor, width);
+                        float sum = 0.f;
+                        for (uint32_t col = colBegin; col < colEnd; ++col)
+                        {
+                            sum += src[col * stride];
+                        }
+                        rowSums[bx * channelCount + c] += sum;
+                    }
+                }
+            }
+            for (uint32_t bx = 0; bx < blocksX; ++bx)
+            {
+                uint32_t colBegin = bx * factor;
+                float scale = 1.f / static_cast<float>(std::min(factor, width - colBegin) * (rowEnd - rowBegin));
+                for (uint32_t c = 0; c < channelCount; ++c)
+                {
+                    rowSums[bx * channelCount + c] *= scale;
+                }
+            }
+
+            if (encodeFrames)
+            {
+                uint8_t *dst = frames.data() + by * frameBytes;
+                uint32_t region[4] = {x, y + by, blocksX, 1};
+                uint32_t frameLen = static_cast<uint32_t>(frameBytes);
+                std::memcpy(dst, &frameLen, 4);
+                std::memcpy(dst + 4, rowHeader.data(), rowHeader.size());
+                std::memcpy(dst + 4 + regionOffset, region, sizeof(region));
+                std::memcpy(dst + rowBytes, rowSums, rowValues * sizeof(float));
+            }
+        }
+    });
+
+    if (!encodeFrames)
+    {
+        RegionUpdate update(mImpl->allocator());
+        update.imageName = imageName;
+        update.grabFocus = grabFocus;
+        update.x = x;
+        update.y = y;
+        update.width = blocksX;
+        update.height = blocksY;
+        update.channelNames.assign(layout.names, layout.names + channelCount);
+        update.channelOffsets = rowOffsets;
+        update.channelStrides = rowStrides;
+        update.imageData = sums.data();
+        // The block values are copied, as the scratch buffer is reused by the next preview.
+        return mImpl->enqueueUpdate(std::move(update), mImpl->nextUploadId(), sums.size());
+    }
+    return mImpl->sendFrames(std::move(frames));
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
 }
 
 Error Client::createImage(const char *imageName, uint32_t width, uint32_t height, uint32_t channelCount,
                           const float *imageData, size_t imageDataCount, bool grabFocus)
+try
 {
     RETURN_IF_FAILED(createImage(imageName, width, height, channelCount, nullptr, grabFocus));
     return updateImage(imageName, 0, 0, width, height, channelCount, nullptr, nullptr, nullptr, imageData,
                        imageDataCount, grabFocus);
 }
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
 
 Error Client::vectorGraphics(const char *imageName, const VgCommand *commands, size_t commandCount, bool append,
                              bool grabFocus)
+try
+{
+    return mImpl->sendVectorGraphics(&imageName, 1, commands, commandCount, append, grabFocus);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::vectorGraphics(const char *imageName, const VgBuffer &buffer, bool append, bool grabFocus)
+try
+{
+    return mImpl->sendEncodedVectorGraphics(&imageName, 1, buffer.commandCount(), buffer.data(), buffer.size(),
+                                            append, grabFocus);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::vectorGraphics(const char *const *imageNames, size_t imageCount, const VgCommand *commands,
+                             size_t commandCount, bool append, bool grabFocus)
+try
+{
+    if (imageCount == 0)
+    {
+        return Error::Ok;
+    }
+    return mImpl->sendVectorGraphics(imageNames, imageCount, commands, commandCount, append, grabFocus);
+}
+catch (const std::bad_alloc &)
 {
-    OStream msg;
-    msg << EPacketType::VectorGraphics;
-    msg << grabFocus;
-    msg << imageName;
-    msg << append;
-    msg << static_cast<uint32_t>(commandCount);
-    for (size_t i = 0; i < commandCount; ++i)
+    return mImpl->outOfMemory();
+}
+
+Error Client::vectorGraphics(const char *const *imageNames, size_t imageCount, const VgBuffer &buffer,
+                             bool append, bool grabFocus)
+try
+{
+    if (imageCount == 0)
     {
-        msg << commands[i].type;
-        for (size_t j = 0; j < commands[i].dataCount; ++j)
-            msg << commands[i].data[j];
+        return Error::Ok;
     }
-    return mImpl->sendMessage(msg);
+    return mImpl->sendEncodedVectorGraphics(imageNames, imageCount, buffer.commandCount(), buffer.data(),
+                                            buffer.size(), append, grabFocus);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::updateVectorGraphics(const char *imageName, const VgCommand *commands, size_t commandCount,
+                                   bool grabFocus)
+try
+{
+    return mImpl->updateVectorGraphics(imageName, commands, commandCount, grabFocus);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::updateVectorGraphics(const char *imageName, const VgBuffer &buffer, bool grabFocus)
+try
+{
+    return mImpl->updateVectorGraphics(imageName, buffer, grabFocus);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+void Client::forgetVectorGraphics(const char *imageName)
+{
+    mImpl->forgetOverlay(imageName);
+}
+
+void Client::beginBatch()
+{
+    mImpl->beginBatch();
+}
+
+Error Client::endBatch()
+try
+{
+    return mImpl->endBatch();
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+Error Client::flush()
+try
+{
+    return mImpl->flush();
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+void Client::setBatchThreshold(size_t bytes)
+{
+    mImpl->setBatchThreshold(bytes);
+}
+
+Error Client::setAsync(bool async)
+try
+{
+    return mImpl->setAsync(async);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+bool Client::isAsync() const
+{
+    return mImpl->isAsync();
+}
+
+Error Client::setThreadSafe(bool threadSafe)
+try
+{
+    return mImpl->setThreadSafe(threadSafe);
+}
+catch (const std::bad_alloc &)
+{
+    return mImpl->outOfMemory();
+}
+
+bool Client::isThreadSafe() const
+{
+    return mImpl->isThreadSafe();
+}
+
+void Client::setMaxChunkSize(size_t bytes)
+{
+    mImpl->setMaxChunkSize(bytes);
+}
+
+void Client::setMaxVectorGraphicsSize(size_t bytes)
+{
+    mImpl->setMaxVectorGraphicsSize(bytes);
+}
+
+void Client::setSchedulingPolicy(SchedulingPolicy policy)
+{
+    mImpl->setSchedulingPolicy(policy);
+}
+
+void Client::setImageWeight(const char *imageName, float weight)
+try
+{
+    mImpl->setImageWeight(imageName, weight);
+}
+catch (const std::bad_alloc &)
+{
+    mImpl->outOfMemory();
+}
+
+double Client::getBandwidth() const
+{
+    return mImpl->getBandwidth();
+}
+
+void Client::setPreviewFrameRate(float frameRate)
+{
+    mImpl->setPreviewFrameRate(frameRate);
+}
+
+void Client::setMaxPreviewDownsample(uint32_t factor)
+{
+    mImpl->setMaxPreviewDownsample(factor);
+}
+
+UploadId Client::lastUploadId() const
+{
+    return mImpl->lastUploadId();
+}
+
+Error Client::getUploadProgress(UploadId id, UploadProgress &progress)
+{
+    return mImpl->getUploadProgress(id, progress);
+}
+
+Error Client::cancelUpload(UploadId id)
+{
+    return mImpl->cancelUpload(id);
+}
+
+void Client::cancelUploads(const char *imageName)
+{
+    mImpl->cancelUploads(imageName);
+}
+
+void Client::setUploadCallback(UploadCallback callback, void *userData)
+{
+    mImpl->setUploadCallback(callback, userData);
+}
+
+Error Client::getBacklog(Backlog &backlog)
+{
+    return mImpl->getBacklog(backlog);
 }
 
 Error Client::lastError() const
@@ -562,7 +2860,7 @@ Error Client::lastError() const
 
 const char *Client::lastErrorString() const
 {
-    return mImpl->lastErrorString().c_str();
+    return mImpl->lastErrorString();
 }
 
 } // namespace tevclient
@@ -0,0 +1,1960 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "tevclient.h"
+#include "allocator.h"
+#include "parallel.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEVCLIENT_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace tevclient
+{
+
+// Encoded command sizes: type byte followed by the float arguments.
+static constexpr size_t PointCommandSize = 1 + 2 * sizeof(float);
+static constexpr size_t CircleCommandSize = 1 + 3 * sizeof(float);
+static constexpr size_t RectCommandSize = 1 + 4 * sizeof(float);
+
+// Arrows are a MoveTo and LineTo for the shaft, and a MoveTo and two LineTo for the head.
+static constexpr size_t ArrowCommandCount = 5;
+static constexpr size_t ArrowSize = ArrowCommandCount * PointCommandSize;
+
+// Angle between the shaft and each side of an arrow head.
+static constexpr float ArrowHeadAngle = 0.5f;
+
+// Minimum number of marching squares cells per parallel task.
+static constexpr size_t ContourCellsPerTask = 65536;
+
+// Minimum number of vertices or edges per parallel task of wireframe().
+static constexpr size_t WireframeItemsPerTask = 65536;
+
+// Edges are clipped where the homogeneous w drops below this.
+static constexpr float WireframeNearW = 1e-5f;
+
+static constexpr uint64_t EmptyEdge = UINT64_MAX;
+static constexpr uint32_t NoVertex = UINT32_MAX;
+
+/// Edge between two distinct vertices as key of the edge set, independent of direction.
+static bool edgeKey(const uint32_t *triangle, int k, size_t vertexCount, uint64_t &key)
+{
+    uint32_t a = triangle[k], b = triangle[(k + 1) % 3];
+    if (a == b || a >= vertexCount || b >= vertexCount)
+    {
+        return false;
+    }
+    key = a < b ? static_cast<uint64_t>(a) << 32 | b : static_cast<uint64_t>(b) << 32 | a;
+    return true;
+}
+
+// MurmurHash3 finalizer.
+static uint64_t hashEdge(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+/// Partition of the edge set holding a hash, from the high bits (the low bits select the slot).
+static size_t edgePartition(uint64_t hash, size_t partitionCount)
+{
+    return static_cast<size_t>(((hash >> 32) * partitionCount) >> 32);
+}
+
+// Line strips are simplified in chunks of at most this many points, whose end points are always kept.
+static constexpr size_t SimplifyChunkSize = 4096;
+
+// Minimum number of points per thread when simplifying line strips.
+static constexpr size_t SimplifyPointsPerTask = 32768;
+
+static inline void writeType(uint8_t *dst, VgCommand::EType type)
+{
+    *dst = static_cast<uint8_t>(type);
+}
+
+static inline void writeFloats(uint8_t *dst, const float *values, size_t count)
+{
+    std::memcpy(dst, values, count * sizeof(float));
+}
+
+/// Affine transform mapping (x, y) to (a * x + c * y + e, b * x + d * y + f).
+struct Transform
+{
+    float a{1.f}, b{0.f}, c{0.f}, d{1.f}, e{0.f}, f{0.f};
+
+    /// Return this * other, i.e. other is applied first.
+    Transform operator*(const Transform &other) const
+    {
+        Transform result;
+        result.a = a * other.a + c * other.b;
+        result.b = b * other.a + d * other.b;
+        result.c = a * other.c + c * other.d;
+        result.d = b * other.c + d * other.d;
+        result.e = a * other.e + c * other.f + e;
+        result.f = b * other.e + d * other.f + f;
+        return result;
+    }
+
+    bool isIdentity() const
+    {
+        return a == 1.f && b == 0.f && c == 0.f && d == 1.f && e == 0.f && f == 0.f;
+    }
+
+    /// True if axis-aligned rectangles stay axis-aligned (no rotation or shear).
+    bool isAxisAligned() const
+    {
+        return b == 0.f && c == 0.f;
+    }
+
+    void apply(float &x, float &y) const
+    {
+        float tx = a * x + c * y + e;
+        y = b * x + d * y + f;
+        x = tx;
+    }
+
+    /// Scale factor for lengths, exact for rotations and uniform scales.
+    float lengthScale() const
+    {
+        return std::sqrt(std::fabs(a * d - b * c));
+    }
+
+    /// Bounds {minX, minY, maxX, maxY} of the transformed rectangle.
+    void applyRect(float x, float y, float width, float height, float (&bounds)[4]) const
+    {
+        float corners[4][2] = {{x, y}, {x + width, y}, {x + width, y + height}, {x, y + height}};
+        apply(corners[0][0], corners[0][1]);
+        bounds[0] = bounds[2] = corners[0][0];
+        bounds[1] = bounds[3] = corners[0][1];
+        for (size_t k = 1; k < 4; ++k)
+        {
+            apply(corners[k][0], corners[k][1]);
+            bounds[0] = std::min(bounds[0], corners[k][0]);
+            bounds[1] = std::min(bounds[1], corners[k][1]);
+            bounds[2] = std::max(bounds[2], corners[k][0]);
+            bounds[3] = std::max(bounds[3], corners[k][1]);
+        }
+    }
+
+    /// Radii of the axis-aligned ellipse that fits the bounds of the transformed ellipse with radii (rx, ry).
+    void applyRadii(float &rx, float &ry) const
+    {
+        float tx = std::sqrt(a * a * rx * rx + c * c * ry * ry);
+        ry = std::sqrt(b * b * rx * rx + d * d * ry * ry);
+        rx = tx;
+    }
+};
+
+class VgBuffer::Impl
+{
+public:
+    explicit Impl(Allocator &allocator)
+        : mAllocator(allocator), mData(allocator), mTransformStack(allocator), mLodGrid(allocator),
+          mLodTouched(allocator), mKeptX(allocator), mKeptY(allocator), mKeptWidth(allocator), mKeptHeight(allocator),
+          mChunks(allocator), mKeep(allocator), mSimplifyStack(allocator), mSimplifiedX(allocator),
+          mSimplifiedY(allocator), mArrowBuckets(allocator), mBucketOffsets(allocator), mBucketFill(allocator),
+          mArrowX(allocator), mArrowY(allocator), mArrowU(allocator), mArrowV(allocator), mContourOffsets(allocator),
+          mLevelOffsets(allocator), mContourCursors(allocator), mContourSegments(allocator), mEdgeSegment(allocator),
+          mContourNext(allocator), mContourState(allocator), mStripX(allocator), mStripY(allocator),
+          mStripCounts(allocator), mProjectedX(allocator), mProjectedY(allocator), mProjectedW(allocator),
+          mEdgeCounts(allocator), mPartitionOffsets(allocator), mPartitionSizes(allocator),
+          mEdgeBucketOffsets(allocator), mEdgeKeys(allocator), mEdgeBuckets(allocator), mEdgeTable(allocator),
+          mWireSegments(allocator), mVertexOffsets(allocator), mVertexCursors(allocator), mVertexSegments(allocator),
+          mVertexRemaining(allocator), mSegmentUsed(allocator)
+    {
+    }
+
+    Allocator &allocator() const
+    {
+        return mAllocator;
+    }
+
+    /// Grow the buffer by size bytes and return a pointer to the new space. Must be followed by commit().
+    uint8_t *grow(size_t size)
+    {
+        size_t offset = mData.size();
+        mData.resize(offset + size);
+        return mData.data() + offset;
+    }
+
+    /// Finish adding commands, end points past the last encoded command (anything after it is discarded).
+    void commit(const uint8_t *end, size_t commandCount)
+    {
+        mData.resize(static_cast<size_t>(end - mData.data()));
+        mCommandCount += commandCount;
+    }
+
+    void add(const VgCommand *commands, size_t count)
+    {
+        if (mLodMerge)
+        {
+            // Primitives are only merged within a path, as paths may be filled differently.
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (commands[i].type == VgCommand::EType::BeginPath)
+                {
+                    resetLodGrid();
+                }
+            }
+        }
+
+        if (mIdentity)
+        {
+            uint8_t *dst = grow(protocol::vgCommandsSize(commands, count));
+            commit(protocol::encodeVgCommands(dst, commands, count), count);
+            return;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            addTransformed(commands[i]);
+        }
+    }
+
+    void lineStrip(const float *xs, const float *ys, size_t count)
+    {
+        lineStrips(xs, ys, &count, 1);
+    }
+
+    void lineStrips(const float *xs, const float *ys, const size_t *counts, size_t stripCount)
+    {
+        if (mLod.simplifyTolerance > 0.f)
+        {
+            simplifyLineStrips(xs, ys, counts, stripCount);
+        }
+
+        size_t offset = 0;
+        for (size_t strip = 0; strip < stripCount; ++strip)
+        {
+            size_t count = counts[strip];
+            if (mLod.simplifyTolerance > 0.f)
+            {
+                mSimplifiedX.clear();
+                mSimplifiedY.clear();
+                for (size_t i = offset; i < offset + count; ++i)
+                {
+                    if (mKeep[i])
+                    {
+                        mSimplifiedX.push_back(xs[i]);
+                        mSimplifiedY.push_back(ys[i]);
+                    }
+                }
+                mDroppedCount += count - mSimplifiedX.size();
+                addLineStrip(mSimplifiedX.data(), mSimplifiedY.data(), mSimplifiedX.size());
+            }
+            else
+            {
+                addLineStrip(xs + offset, ys + offset, count);
+            }
+            offset += count;
+        }
+    }
+
+    void circles(const float *cx, const float *cy, const float *radii, float radius, size_t count)
+    {
+        if (mLodActive)
+        {
+            circlesLod(cx, cy, radii, radius, count);
+        }
+        else
+        {
+            emitCircles(cx, cy, radii, radius, count);
+        }
+    }
+
+    void rects(const float *x, const float *y, const float *width, const float *height, size_t count)
+    {
+        if (mLodActive)
+        {
+            rectsLod(x, y, width, height, count);
+        }
+        else
+        {
+            emitRects(x, y, width, height, count);
+        }
+    }
+
+    void arrows(const float *field, uint32_t width, uint32_t height, const uint64_t *channelOffsets,
+                const uint64_t *channelStrides, const VgArrowStyle &style)
+    {
+        static const uint64_t DefaultOffsets[2] = {0, 1};
+        static const uint64_t DefaultStrides[2] = {2, 2};
+        const uint64_t *offsets = channelOffsets ? channelOffsets : DefaultOffsets;
+        const uint64_t *strides = channelStrides ? channelStrides : DefaultStrides;
+        uint32_t spacing = std::max<uint32_t>(style.spacing, 1);
+        size_t bucketCount = style.colors ? std::max<size_t>(style.colorCount, 1) : 1;
+        float minMagnitude2 = style.minMagnitude * style.minMagnitude;
+        float bucketScale = static_cast<float>(bucketCount) / std::max(style.maxMagnitude - style.minMagnitude, 1e-20f);
+
+        // Sample the field, keeping the arrows that are drawn along with their color bucket.
+        clearKept();
+        mArrowBuckets.clear();
+        mBucketOffsets.assign(bucketCount + 1, 0);
+        for (uint32_t y = spacing / 2; y < height; y += spacing)
+        {
+            for (uint32_t x = spacing / 2; x < width; x += spacing)
+            {
+                size_t pixel = static_cast<size_t>(y) * width + x;
+                float u = field[offsets[0] + pixel * strides[0]];
+                float v = field[offsets[1] + pixel * strides[1]];
+                float magnitude2 = u * u + v * v;
+                if (!(magnitude2 > minMagnitude2) || !std::isfinite(magnitude2))
+                {
+                    continue;
+                }
+                float bucket = (std::sqrt(magnitude2) - style.minMagnitude) * bucketScale;
+                size_t index = std::min(static_cast<size_t>(std::max(bucket, 0.f)), bucketCount - 1);
+                mKeptX.push_back(x + 0.5f);
+                mKeptY.push_back(y + 0.5f);
+                mKeptWidth.push_back(u * style.scale);
+                mKeptHeight.push_back(v * style.scale);
+                mArrowBuckets.push_back(static_cast<uint32_t>(index));
+                ++mBucketOffsets[index + 1];
+            }
+        }
+
+        // Sort the arrows by bucket.
+        for (size_t bucket = 0; bucket < bucketCount; ++bucket)
+        {
+            mBucketOffsets[bucket + 1] += mBucketOffsets[bucket];
+        }
+        size_t count = mKeptX.size();
+        for (Vector<float> *sorted : {&mArrowX, &mArrowY, &mArrowU, &mArrowV})
+        {
+            sorted->resize(count);
+        }
+        mBucketFill.assign(mBucketOffsets.begin(), mBucketOffsets.end() - 1);
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t index = mBucketFill[mArrowBuckets[i]]++;
+            mArrowX[index] = mKeptX[i];
+            mArrowY[index] = mKeptY[i];
+            mArrowU[index] = mKeptWidth[i];
+            mArrowV[index] = mKeptHeight[i];
+        }
+
+        for (size_t bucket = 0; bucket < bucketCount; ++bucket)
+        {
+            size_t begin = mBucketOffsets[bucket], end = mBucketOffsets[bucket + 1];
+            if (begin == end)
+            {
+                continue;
+            }
+            VgCommand commands[2] = {VgCommand::strokeColor(style.colors ? style.colors[bucket] : VgCommand::Color()),
+                                     VgCommand::beginPath()};
+            add(style.colors ? commands : commands + 1, style.colors ? 2 : 1);
+            emitArrows(mArrowX.data() + begin, mArrowY.data() + begin, mArrowU.data() + begin, mArrowV.data() + begin,
+                       end - begin, style.headSize);
+            VgCommand stroke = VgCommand::stroke();
+            add(&stroke, 1);
+        }
+    }
+
+    void isolines(const float *image, uint32_t width, uint32_t height, uint64_t channelOffset, uint64_t channelStride,
+                  const float *levels, size_t levelCount, const VgCommand::Color *colors)
+    {
+        if (width < 2 || height < 2 || levelCount == 0)
+        {
+            return;
+        }
+
+        // Count the segments of each level and task, then let each task write its segments to the
+        // ranges computed from the counts, so that the segments of a level are contiguous.
+        size_t rowCount = height - 1;
+        size_t taskCount = std::min(parallelTaskCount(rowCount * (width - 1), ContourCellsPerTask), rowCount);
+        mContourOffsets.assign(taskCount * levelCount, 0);
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, rowCount, begin, end);
+            contourRows(image, width, channelOffset, channelStride, begin, end, levels, levelCount,
+                        mContourOffsets.data() + task * levelCount, nullptr);
+        });
+
+        mLevelOffsets.resize(levelCount + 1);
+        mContourCursors.resize(taskCount * levelCount);
+        size_t total = 0;
+        for (size_t level = 0; level < levelCount; ++level)
+        {
+            mLevelOffsets[level] = total;
+            for (size_t task = 0; task < taskCount; ++task)
+            {
+                size_t count = mContourOffsets[task * levelCount + level];
+                mContourOffsets[task * levelCount + level] = total;
+                total += count;
+            }
+        }
+        mLevelOffsets[levelCount] = total;
+        mContourSegments.resize(total);
+        for (size_t i = 0; i < mContourCursors.size(); ++i)
+        {
+            mContourCursors[i] = mContourSegments.data() + mContourOffsets[i];
+        }
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, rowCount, begin, end);
+            contourRows(image, width, channelOffset, channelStride, begin, end, levels, levelCount, nullptr,
+                        mContourCursors.data() + task * levelCount);
+        });
+
+        size_t edgeCount = 2 * static_cast<size_t>(width) * height;
+        if (mEdgeSegment.size() < edgeCount)
+        {
+            mEdgeSegment.resize(edgeCount, UINT32_MAX);
+        }
+        for (size_t level = 0; level < levelCount; ++level)
+        {
+            size_t begin = mLevelOffsets[level], end = mLevelOffsets[level + 1];
+            if (begin == end)
+            {
+                continue;
+            }
+            traceContours(mContourSegments.data() + begin, end - begin);
+            VgCommand commands[2] = {VgCommand::strokeColor(colors ? colors[level] : VgCommand::Color()),
+                                     VgCommand::beginPath()};
+            add(colors ? commands : commands + 1, colors ? 2 : 1);
+            lineStrips(mStripX.data(), mStripY.data(), mStripCounts.data(), mStripCounts.size());
+            VgCommand stroke = VgCommand::stroke();
+            add(&stroke, 1);
+        }
+    }
+
+    void wireframe(const float *positions, size_t vertexCount, const uint32_t *indices, size_t triangleCount,
+                   const float *projection, uint32_t width, uint32_t height)
+    {
+        if (vertexCount == 0 || triangleCount == 0)
+        {
+            return;
+        }
+
+        mProjectedX.resize(vertexCount);
+        mProjectedY.resize(vertexCount);
+        mProjectedW.resize(vertexCount);
+        size_t taskCount = parallelTaskCount(vertexCount, WireframeItemsPerTask);
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, vertexCount, begin, end);
+            projectVertices(positions, projection, begin, end);
+        });
+
+        // Edges are deduplicated in a hash set with one partition per task, so that the tasks insert
+        // without synchronization. A counting pass bounds the number of edges of each partition and
+        // scatters the keys of each task into one bucket per partition, within the task's range of
+        // 3 slots per triangle, so that each partition only reads its own keys.
+        size_t partitionCount = parallelTaskCount(3 * triangleCount, WireframeItemsPerTask);
+        mEdgeCounts.assign(partitionCount * partitionCount, 0);
+        mEdgeBucketOffsets.resize(partitionCount * partitionCount);
+        mEdgeKeys.resize(3 * triangleCount);
+        mEdgeBuckets.resize(3 * triangleCount);
+        parallelFor(partitionCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, partitionCount, triangleCount, begin, end);
+            size_t *counts = mEdgeCounts.data() + task * partitionCount;
+            uint64_t *keys = mEdgeKeys.data() + 3 * begin;
+            size_t keyCount = 0;
+            for (size_t triangle = begin; triangle < end; ++triangle)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    uint64_t key;
+                    if (edgeKey(indices + 3 * triangle, k, vertexCount, key))
+                    {
+                        keys[keyCount++] = key;
+                        ++counts[edgePartition(hashEdge(key), partitionCount)];
+                    }
+                }
+            }
+
+            size_t *offsets = mEdgeBucketOffsets.data() + task * partitionCount;
+            size_t offset = 3 * begin;
+            for (size_t partition = 0; partition < partitionCount; ++partition)
+            {
+                offsets[partition] = offset;
+                offset += counts[partition];
+            }
+            for (size_t i = 0; i < keyCount; ++i)
+            {
+                mEdgeBuckets[offsets[edgePartition(hashEdge(keys[i]), partitionCount)]++] = keys[i];
+            }
+            for (size_t partition = 0; partition < partitionCount; ++partition)
+            {
+                offsets[partition] -= counts[partition];
+            }
+        });
+
+        mPartitionOffsets.resize(partitionCount + 1);
+        size_t tableSize = 0;
+        for (size_t partition = 0; partition < partitionCount; ++partition)
+        {
+            size_t count = 0;
+            for (size_t task = 0; task < partitionCount; ++task)
+            {
+                count += mEdgeCounts[task * partitionCount + partition];
+            }
+            // At most two thirds full, and at least one slot is always empty.
+            size_t capacity = 1;
+            while (capacity < count + count / 2 + 1)
+            {
+                capacity *= 2;
+            }
+            mPartitionOffsets[partition] = tableSize;
+            tableSize += capacity;
+        }
+        mPartitionOffsets[partitionCount] = tableSize;
+        mEdgeTable.assign(tableSize, EmptyEdge);
+        mPartitionSizes.resize(partitionCount);
+        parallelFor(partitionCount, [&](size_t partition) {
+            mPartitionSizes[partition] = insertEdges(partition, partitionCount);
+        });
+
+        // Clip the edges of each partition to the range of the segments it can produce.
+        size_t edgeCount = 0;
+        for (size_t partition = 0; partition < partitionCount; ++partition)
+        {
+            size_t size = mPartitionSizes[partition];
+            mPartitionSizes[partition] = edgeCount;
+            edgeCount += size;
+        }
+        mWireSegments.resize(edgeCount);
+        parallelFor(partitionCount, [&](size_t partition) {
+            WireSegment *segments = mWireSegments.data() + mPartitionSizes[partition];
+            size_t count = 0;
+            for (size_t slot = mPartitionOffsets[partition]; slot < mPartitionOffsets[partition + 1]; ++slot)
+            {
+                uint64_t key = mEdgeTable[slot];
+                if (key != EmptyEdge && clipEdge(static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key),
+                                                 static_cast<float>(width), static_cast<float>(height),
+                                                 segments[count]))
+                {
+                    ++count;
+                }
+            }
+            mEdgeCounts[partition] = count;
+        });
+        size_t segmentCount = 0;
+        for (size_t partition = 0; partition < partitionCount; ++partition)
+        {
+            const WireSegment *segments = mWireSegments.data() + mPartitionSizes[partition];
+            std::copy(segments, segments + mEdgeCounts[partition], mWireSegments.data() + segmentCount);
+            segmentCount += mEdgeCounts[partition];
+        }
+        mWireSegments.resize(segmentCount);
+        if (segmentCount == 0)
+        {
+            return;
+        }
+
+        chainSegments(vertexCount);
+        VgCommand begin = VgCommand::beginPath();
+        add(&begin, 1);
+        lineStrips(mStripX.data(), mStripY.data(), mStripCounts.data(), mStripCounts.size());
+        VgCommand stroke = VgCommand::stroke();
+        add(&stroke, 1);
+    }
+
+    void pushTransform()
+    {
+        mTransformStack.push_back(mTransform);
+    }
+
+    void popTransform()
+    {
+        if (mTransformStack.empty())
+        {
+            return;
+        }
+        setTransform(mTransformStack.back());
+        mTransformStack.pop_back();
+    }
+
+    void setTransform(const Transform &transform)
+    {
+        mTransform = transform;
+        mIdentity = transform.isIdentity();
+    }
+
+    const Transform &transform() const
+    {
+        return mTransform;
+    }
+
+    void setLod(const VgLod &lod)
+    {
+        mLod = lod;
+        mLodCull = lod.width > 0.f && lod.height > 0.f;
+        mLodMerge = mLodCull && lod.mergeSubPixel;
+        mLodActive = mLodCull || lod.commandBudget > 0;
+        mLodColumns = mLodMerge ? static_cast<size_t>(std::ceil(lod.width)) : 0;
+        size_t rows = mLodMerge ? static_cast<size_t>(std::ceil(lod.height)) : 0;
+        mLodGrid.assign((mLodColumns * rows + 7) / 8, 0);
+        mLodTouched.clear();
+    }
+
+    size_t droppedCount() const
+    {
+        return mDroppedCount;
+    }
+
+    void clear()
+    {
+        mData.clear();
+        mCommandCount = 0;
+        mTransformStack.clear();
+        setTransform(Transform());
+        mDroppedCount = 0;
+        resetLodGrid();
+    }
+
+    size_t commandCount() const
+    {
+        return mCommandCount;
+    }
+
+    const uint8_t *data() const
+    {
+        return mData.data();
+    }
+
+    size_t size() const
+    {
+        return mData.size();
+    }
+
+private:
+    enum : uint8_t
+    {
+        OutLeft = 1,
+        OutRight = 2,
+        OutTop = 4,
+        OutBottom = 8,
+    };
+
+    /// Sides of the view a point (in image space) lies beyond, 0 if inside or not culling.
+    uint8_t outcode(float x, float y) const
+    {
+        if (!mLodCull)
+        {
+            return 0;
+        }
+        return (x < 0.f ? OutLeft : 0) | (x > mLod.width ? OutRight : 0) | (y < 0.f ? OutTop : 0) |
+               (y > mLod.height ? OutBottom : 0);
+    }
+
+    void addLineStrip(const float *xs, const float *ys, size_t count)
+    {
+        if (mLodActive)
+        {
+            lineStripLod(xs, ys, count);
+        }
+        else
+        {
+            emitLineStrip(xs, ys, count);
+        }
+    }
+
+    /// Range of points, both end points included.
+    struct PointRange
+    {
+        size_t first, last;
+    };
+
+    /**
+     * Mark the points of the line strips to keep in mKeep, using Douglas-Peucker simplification in
+     * image space. Strips are split into chunks that are simplified in parallel.
+     */
+    void simplifyLineStrips(const float *xs, const float *ys, const size_t *counts, size_t stripCount)
+    {
+        size_t total = 0;
+        mChunks.clear();
+        for (size_t strip = 0; strip < stripCount; ++strip)
+        {
+            size_t end = total + counts[strip];
+            for (size_t first = total; first + 1 < end;)
+            {
+                size_t last = std::min(first + SimplifyChunkSize, end - 1);
+                mChunks.push_back({first, last});
+                first = last;
+            }
+            total = end;
+        }
+
+        mKeep.assign(total, 0);
+        for (const PointRange &chunk : mChunks)
+        {
+            mKeep[chunk.first] = mKeep[chunk.last] = 1;
+        }
+        // Single point strips.
+        total = 0;
+        for (size_t strip = 0; strip < stripCount; ++strip)
+        {
+            if (counts[strip] == 1)
+            {
+                mKeep[total] = 1;
+            }
+            total += counts[strip];
+        }
+
+        // The stack of a chunk never holds more entries than the chunk has points.
+        size_t taskCount = std::min(parallelTaskCount(total, SimplifyPointsPerTask), mChunks.size());
+        mSimplifyStack.resize(taskCount * SimplifyChunkSize);
+        float tolerance2 = mLod.simplifyTolerance * mLod.simplifyTolerance;
+        parallelFor(taskCount, [&](size_t task) {
+            size_t begin, end;
+            taskRange(task, taskCount, mChunks.size(), begin, end);
+            PointRange *stack = mSimplifyStack.data() + task * SimplifyChunkSize;
+            for (size_t chunk = begin; chunk < end; ++chunk)
+            {
+                simplifyChunk(xs, ys, mChunks[chunk], tolerance2, stack);
+            }
+        });
+    }
+
+    void simplifyChunk(const float *xs, const float *ys, PointRange chunk, float tolerance2, PointRange *stack)
+    {
+        size_t stackSize = 0;
+        stack[stackSize++] = chunk;
+        while (stackSize > 0)
+        {
+            PointRange range = stack[--stackSize];
+            if (range.last - range.first < 2)
+            {
+                continue;
+            }
+
+            float ax = xs[range.first], ay = ys[range.first], bx = xs[range.last], by = ys[range.last];
+            applyTransform(ax, ay);
+            applyTransform(bx, by);
+            float dx = bx - ax, dy = by - ay;
+            float length2 = dx * dx + dy * dy;
+
+            // Farthest point from the segment between the end points.
+            float maxDistance2 = -1.f;
+            size_t farthest = range.first;
+            for (size_t i = range.first + 1; i < range.last; ++i)
+            {
+                float px = xs[i], py = ys[i];
+                applyTransform(px, py);
+                px -= ax;
+                py -= ay;
+                float t = length2 > 0.f ? std::min(std::max((px * dx + py * dy) / length2, 0.f), 1.f) : 0.f;
+                float ex = px - t * dx, ey = py - t * dy;
+                float distance2 = ex * ex + ey * ey;
+                if (distance2 > maxDistance2)
+                {
+                    maxDistance2 = distance2;
+                    farthest = i;
+                }
+            }
+
+            if (maxDistance2 > tolerance2)
+            {
+                mKeep[farthest] = 1;
+                stack[stackSize++] = {range.first, farthest};
+                stack[stackSize++] = {farthest, range.last};
+            }
+        }
+    }
+
+    /// Number of commands the batch functions may still add.
+    size_t lodRemaining() const
+    {
+        if (mLod.commandBudget == 0)
+        {
+            return SIZE_MAX;
+        }
+        return mLod.commandBudget > mCommandCount ? mLod.commandBudget - mCommandCount : 0;
+    }
+
+    /**
+     * Return whether a primitive with the given bounds (in image space) is drawn. Primitives smaller
+     * than a pixel are drawn only if no other one was drawn in the same pixel of the current path.
+     */
+    bool lodKeep(float minX, float minY, float maxX, float maxY)
+    {
+        if ((outcode(minX, minY) & outcode(maxX, maxY)) != 0)
+        {
+            return false;
+        }
+        if (!mLodMerge || maxX - minX >= 1.f || maxY - minY >= 1.f)
+        {
+            return true;
+        }
+
+        float x = 0.5f * (minX + maxX), y = 0.5f * (minY + maxY);
+        size_t rows = mLodGrid.size() * 8 / mLodColumns;
+        size_t column = x >= 0.f ? std::min(static_cast<size_t>(x), mLodColumns - 1) : 0;
+        size_t row = y >= 0.f ? std::min(static_cast<size_t>(y), rows - 1) : 0;
+        size_t cell = row * mLodColumns + column;
+        uint8_t &bits = mLodGrid[cell / 8];
+        uint8_t bit = static_cast<uint8_t>(1 << (cell % 8));
+        if (bits & bit)
+        {
+            return false;
+        }
+        if (bits == 0)
+        {
+            mLodTouched.push_back(cell / 8);
+        }
+        bits |= bit;
+        return true;
+    }
+
+    void resetLodGrid()
+    {
+        for (size_t index : mLodTouched)
+        {
+            mLodGrid[index] = 0;
+        }
+        mLodTouched.clear();
+    }
+
+    /// Clear the arrays collecting the kept primitives.
+    void clearKept()
+    {
+        mKeptX.clear();
+        mKeptY.clear();
+        mKeptWidth.clear();
+        mKeptHeight.clear();
+    }
+
+    /// Add the collected points of a line strip unless they do not form a segment.
+    void flushLineStrip(size_t &remaining)
+    {
+        size_t count = mKeptX.size();
+        if (count >= 2 && remaining >= 2)
+        {
+            count = std::min(count, remaining);
+            emitLineStrip(mKeptX.data(), mKeptY.data(), count);
+            remaining -= count;
+        }
+        clearKept();
+    }
+
+    /**
+     * Segments entirely beyond one side of the view are culled, splitting the strip. Points in the
+     * same pixel as the previous drawn point are merged.
+     */
+    void lineStripLod(const float *xs, const float *ys, size_t count)
+    {
+        size_t remaining = lodRemaining();
+        size_t commandCount = mCommandCount;
+        float prevX = 0.f, prevY = 0.f, lastX = 0.f, lastY = 0.f;
+        uint8_t prevCode = 0;
+        clearKept();
+        for (size_t i = 0; i < count; ++i)
+        {
+            float x = xs[i], y = ys[i];
+            applyTransform(x, y);
+            uint8_t code = outcode(x, y);
+            if (i > 0 && (code & prevCode) == 0)
+            {
+                if (mKeptX.empty())
+                {
+                    mKeptX.push_back(xs[i - 1]);
+                    mKeptY.push_back(ys[i - 1]);
+                    lastX = prevX;
+                    lastY = prevY;
+                }
+                if (!mLodMerge || std::floor(x) != std::floor(lastX) || std::floor(y) != std::floor(lastY))
+                {
+                    mKeptX.push_back(xs[i]);
+                    mKeptY.push_back(ys[i]);
+                    lastX = x;
+                    lastY = y;
+                }
+            }
+            else if (i > 0)
+            {
+                flushLineStrip(remaining);
+            }
+            prevX = x;
+            prevY = y;
+            prevCode = code;
+        }
+        flushLineStrip(remaining);
+        mDroppedCount += count - (mCommandCount - commandCount);
+    }
+
+    void circlesLod(const float *cx, const float *cy, const float *radii, float radius, size_t count)
+    {
+        size_t remaining = lodRemaining();
+        clearKept();
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (mKeptX.size() == remaining)
+            {
+                mDroppedCount += count - i;
+                break;
+            }
+            float r = radii ? radii[i] : radius;
+            float x = cx[i], y = cy[i], rx = r, ry = r;
+            applyTransform(x, y);
+            mTransform.applyRadii(rx, ry);
+            if (!lodKeep(x - rx, y - ry, x + rx, y + ry))
+            {
+                ++mDroppedCount;
+                continue;
+            }
+            mKeptX.push_back(cx[i]);
+            mKeptY.push_back(cy[i]);
+            mKeptWidth.push_back(r);
+        }
+        emitCircles(mKeptX.data(), mKeptY.data(), mKeptWidth.data(), 0.f, mKeptX.size());
+    }
+
+    void rectsLod(const float *x, const float *y, const float *width, const float *height, size_t count)
+    {
+        // Rotated rectangles are added as 5 commands.
+        size_t remaining = lodRemaining() / (mTransform.isAxisAligned() ? 1 : 5);
+        clearKept();
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (mKeptX.size() == remaining)
+            {
+                mDroppedCount += count - i;
+                break;
+            }
+            float bounds[4];
+            mTransform.applyRect(x[i], y[i], width[i], height[i], bounds);
+            if (!lodKeep(bounds[0], bounds[1], bounds[2], bounds[3]))
+            {
+                ++mDroppedCount;
+                continue;
+            }
+            mKeptX.push_back(x[i]);
+            mKeptY.push_back(y[i]);
+            mKeptWidth.push_back(width[i]);
+            mKeptHeight.push_back(height[i]);
+        }
+        emitRects(mKeptX.data(), mKeptY.data(), mKeptWidth.data(), mKeptHeight.data(), mKeptX.size());
+    }
+
+    /// Isoline segment between two cell edges, identified by edge index.
+    struct ContourSegment
+    {
+        size_t startEdge, endEdge;
+        float startX, startY, endX, endY;
+    };
+
+    /**
+     * Run marching squares over the cells whose top row of pixels is in [rowBegin, rowEnd).
+     *
+     * Segments are oriented with the values above the level on their left, so that each segment
+     * ending on an edge is followed by the one starting on it. If cursors is nullptr, the segments
+     * are only counted in counts[level], otherwise they are written to cursors[level]++.
+     */
+    static void contourRows(const float *image, uint32_t width, uint64_t offset, uint64_t stride, size_t rowBegin,
+                            size_t rowEnd, const float *levels, size_t levelCount, size_t *counts,
+                            ContourSegment **cursors)
+    {
+        // Corners in clockwise order from the top left, edge k connects corners k and k + 1.
+        static const float CornerX[4] = {0.5f, 1.5f, 1.5f, 0.5f};
+        static const float CornerY[4] = {0.5f, 0.5f, 1.5f, 1.5f};
+        // Edges are interpolated from the corner of the pixel with the lower index, so that both cells
+        // sharing an edge compute the same point.
+        static const int EdgeFrom[4] = {0, 1, 3, 0};
+        static const int EdgeTo[4] = {1, 2, 2, 3};
+
+        for (size_t y = rowBegin; y < rowEnd; ++y)
+        {
+            const float *row = image + offset + y * width * stride;
+            const float *nextRow = row + width * stride;
+            for (size_t x = 0; x + 1 < width; ++x)
+            {
+                float v[4] = {row[x * stride], row[(x + 1) * stride], nextRow[(x + 1) * stride], nextRow[x * stride]};
+                // Horizontal edges have even indices, vertical edges odd ones.
+                size_t pixel = y * width + x;
+                size_t edges[4] = {2 * pixel, 2 * (pixel + 1) + 1, 2 * (pixel + width), 2 * pixel + 1};
+                for (size_t level = 0; level < levelCount; ++level)
+                {
+                    float value = levels[level];
+                    unsigned inside = (v[0] > value) | (v[1] > value) << 1 | (v[2] > value) << 2 | (v[3] > value) << 3;
+                    if (inside == 0 || inside == 15)
+                    {
+                        continue;
+                    }
+                    // Saddles are resolved by the value at the center of the cell.
+                    bool centerInside = 0.25f * (v[0] + v[1] + v[2] + v[3]) > value;
+                    bool saddle = inside == 5 || inside == 10;
+                    for (int enter = 0; enter < 4; ++enter)
+                    {
+                        if ((inside >> enter & 1) || !(inside >> ((enter + 1) & 3) & 1))
+                        {
+                            continue;
+                        }
+                        int leave = (enter + 1) & 3;
+                        if (saddle)
+                        {
+                            leave = centerInside ? (enter + 3) & 3 : leave;
+                        }
+                        else
+                        {
+                            while (!(inside >> leave & 1) || (inside >> ((leave + 1) & 3) & 1))
+                            {
+                                leave = (leave + 1) & 3;
+                            }
+                        }
+                        if (!cursors)
+                        {
+                            ++counts[level];
+                            continue;
+                        }
+                        ContourSegment &segment = *cursors[level]++;
+                        segment.startEdge = edges[enter];
+                        segment.endEdge = edges[leave];
+                        float points[2][2];
+                        int crossing[2] = {enter, leave};
+                        for (int i = 0; i < 2; ++i)
+                        {
+                            int from = EdgeFrom[crossing[i]], to = EdgeTo[crossing[i]];
+                            float t = (value - v[from]) / (v[to] - v[from]);
+                            // Non-finite values give a crossing in the middle of the edge.
+                            t = t >= 0.f && t <= 1.f ? t : 0.5f;
+                            points[i][0] = x + CornerX[from] + t * (CornerX[to] - CornerX[from]);
+                            points[i][1] = y + CornerY[from] + t * (CornerY[to] - CornerY[from]);
+                        }
+                        segment.startX = points[0][0];
+                        segment.startY = points[0][1];
+                        segment.endX = points[1][0];
+                        segment.endY = points[1][1];
+                    }
+                }
+            }
+        }
+    }
+
+    /// Join the segments of one level into polylines in mStripX/Y and mStripCounts.
+    void traceContours(const ContourSegment *segments, size_t count)
+    {
+        // Each edge starts at most one segment of a level, so it maps to its successor directly.
+        for (size_t i = 0; i < count; ++i)
+        {
+            mEdgeSegment[segments[i].startEdge] = static_cast<uint32_t>(i);
+        }
+        mContourNext.resize(count);
+        mContourState.assign(count, 0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint32_t next = mEdgeSegment[segments[i].endEdge];
+            mContourNext[i] = next;
+            if (next != UINT32_MAX)
+            {
+                mContourState[next] |= HasPrevious;
+            }
+        }
+
+        mStripX.clear();
+        mStripY.clear();
+        mStripCounts.clear();
+        // Open polylines start at segments without predecessor, what is left afterwards are loops.
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (size_t first = 0; first < count; ++first)
+            {
+                if ((mContourState[first] & Visited) || (pass == 0 && (mContourState[first] & HasPrevious)))
+                {
+                    continue;
+                }
+                size_t start = mStripX.size();
+                size_t last = first;
+                for (uint32_t i = static_cast<uint32_t>(first); i != UINT32_MAX && !(mContourState[i] & Visited);
+                     i = mContourNext[i])
+                {
+                    mContourState[i] |= Visited;
+                    mStripX.push_back(segments[i].startX);
+                    mStripY.push_back(segments[i].startY);
+                    last = i;
+                }
+                mStripX.push_back(segments[last].endX);
+                mStripY.push_back(segments[last].endY);
+                mStripCounts.push_back(mStripX.size() - start);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            mEdgeSegment[segments[i].startEdge] = UINT32_MAX;
+        }
+    }
+
+    /// Edge of a wireframe after clipping, ends cut by clipping have no vertex.
+    struct WireSegment
+    {
+        uint32_t from, to;
+        float fromX, fromY, toX, toY;
+    };
+
+    /// Project positions [begin, end) to homogeneous pixel coordinates in mProjectedX/Y/W.
+    void projectVertices(const float *positions, const float *projection, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const float *p = positions + 3 * i;
+            if (!projection)
+            {
+                mProjectedX[i] = p[0];
+                mProjectedY[i] = p[1];
+                mProjectedW[i] = 1.f;
+                continue;
+            }
+            const float *m = projection;
+            mProjectedX[i] = m[0] * p[0] + m[1] * p[1] + m[2] * p[2] + m[3];
+            mProjectedY[i] = m[4] * p[0] + m[5] * p[1] + m[6] * p[2] + m[7];
+            mProjectedW[i] = m[12] * p[0] + m[13] * p[1] + m[14] * p[2] + m[15];
+        }
+    }
+
+    /// Insert the edges of the buckets of a partition into its part of mEdgeTable, returns the number added.
+    size_t insertEdges(size_t partition, size_t partitionCount)
+    {
+        uint64_t *table = mEdgeTable.data() + mPartitionOffsets[partition];
+        size_t mask = mPartitionOffsets[partition + 1] - mPartitionOffsets[partition] - 1;
+        size_t count = 0;
+        for (size_t task = 0; task < partitionCount; ++task)
+        {
+            const uint64_t *keys = mEdgeBuckets.data() + mEdgeBucketOffsets[task * partitionCount + partition];
+            size_t keyCount = mEdgeCounts[task * partitionCount + partition];
+            for (size_t i = 0; i < keyCount; ++i)
+            {
+                uint64_t key = keys[i];
+                for (size_t slot = hashEdge(key) & mask;; slot = (slot + 1) & mask)
+                {
+                    if (table[slot] == key)
+                    {
+                        break;
+                    }
+                    if (table[slot] == EmptyEdge)
+                    {
+                        table[slot] = key;
+                        ++count;
+                        break;
+                    }
+                }
+            }
+        }
+        return count;
+    }
+
+    /// Clip the edge between two vertices to the near plane and the image, returns false if nothing is left.
+    bool clipEdge(uint32_t a, uint32_t b, float width, float height, WireSegment &segment) const
+    {
+        float ax = mProjectedX[a], ay = mProjectedY[a], aw = mProjectedW[a];
+        float bx = mProjectedX[b], by = mProjectedY[b], bw = mProjectedW[b];
+        segment.from = a;
+        segment.to = b;
+        if (!(aw >= WireframeNearW))
+        {
+            if (!(bw >= WireframeNearW))
+            {
+                return false;
+            }
+            float t = (WireframeNearW - aw) / (bw - aw);
+            ax += t * (bx - ax);
+            ay += t * (by - ay);
+            aw = WireframeNearW;
+            segment.from = NoVertex;
+        }
+        else if (!(bw >= WireframeNearW))
+        {
+            float t = (WireframeNearW - bw) / (aw - bw);
+            bx += t * (ax - bx);
+            by += t * (ay - by);
+            bw = WireframeNearW;
+            segment.to = NoVertex;
+        }
+
+        float x0 = ax / aw, y0 = ay / aw, x1 = bx / bw, y1 = by / bw;
+        if (!std::isfinite(x0 + y0 + x1 + y1))
+        {
+            return false;
+        }
+
+        // Liang-Barsky clipping to the image.
+        float dx = x1 - x0, dy = y1 - y0;
+        float p[4] = {-dx, dx, -dy, dy};
+        float q[4] = {x0, width - x0, y0, height - y0};
+        float t0 = 0.f, t1 = 1.f;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (p[i] == 0.f)
+            {
+                if (q[i] < 0.f)
+                {
+                    return false;
+                }
+                continue;
+            }
+            float r = q[i] / p[i];
+            if (p[i] < 0.f)
+            {
+                t0 = std::max(t0, r);
+            }
+            else
+            {
+                t1 = std::min(t1, r);
+            }
+        }
+        if (t0 > t1)
+        {
+            return false;
+        }
+
+        segment.fromX = t0 > 0.f ? x0 + t0 * dx : x0;
+        segment.fromY = t0 > 0.f ? y0 + t0 * dy : y0;
+        segment.toX = t1 < 1.f ? x0 + t1 * dx : x1;
+        segment.toY = t1 < 1.f ? y0 + t1 * dy : y1;
+        segment.from = t0 > 0.f ? NoVertex : segment.from;
+        segment.to = t1 < 1.f ? NoVertex : segment.to;
+        return true;
+    }
+
+    /**
+     * Join mWireSegments into polylines in mStripX/Y and mStripCounts.
+     *
+     * Polylines start at the clipped ends and at vertices with an odd number of edges left, as
+     * every polyline through a vertex uses two of its edges, and then continue along unused edges.
+     */
+    void chainSegments(size_t vertexCount)
+    {
+        mVertexOffsets.assign(vertexCount + 1, 0);
+        for (const WireSegment &segment : mWireSegments)
+        {
+            for (uint32_t vertex : {segment.from, segment.to})
+            {
+                if (vertex != NoVertex)
+                {
+                    ++mVertexOffsets[vertex + 1];
+                }
+            }
+        }
+        mVertexRemaining.resize(vertexCount);
+        for (size_t vertex = 0; vertex < vertexCount; ++vertex)
+        {
+            mVertexRemaining[vertex] = static_cast<uint32_t>(mVertexOffsets[vertex + 1]);
+            mVertexOffsets[vertex + 1] += mVertexOffsets[vertex];
+        }
+        mVertexCursors.assign(mVertexOffsets.begin(), mVertexOffsets.end() - 1);
+        mVertexSegments.resize(mVertexOffsets[vertexCount]);
+        for (size_t i = 0; i < mWireSegments.size(); ++i)
+        {
+            for (uint32_t vertex : {mWireSegments[i].from, mWireSegments[i].to})
+            {
+                if (vertex != NoVertex)
+                {
+                    mVertexSegments[mVertexCursors[vertex]++] = static_cast<uint32_t>(i);
+                }
+            }
+        }
+        mVertexCursors.assign(mVertexOffsets.begin(), mVertexOffsets.end() - 1);
+        mSegmentUsed.assign(mWireSegments.size(), 0);
+
+        mStripX.clear();
+        mStripY.clear();
+        mStripCounts.clear();
+        for (size_t i = 0; i < mWireSegments.size(); ++i)
+        {
+            const WireSegment &segment = mWireSegments[i];
+            if (!mSegmentUsed[i] && (segment.from == NoVertex) != (segment.to == NoVertex))
+            {
+                bool reverse = segment.to == NoVertex;
+                size_t start = mStripX.size();
+                mStripX.push_back(reverse ? segment.toX : segment.fromX);
+                mStripY.push_back(reverse ? segment.toY : segment.fromY);
+                useSegment(static_cast<uint32_t>(i), reverse);
+                walkSegments(reverse ? segment.from : segment.to);
+                mStripCounts.push_back(mStripX.size() - start);
+            }
+        }
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (size_t vertex = 0; vertex < vertexCount; ++vertex)
+            {
+                while (pass == 0 ? (mVertexRemaining[vertex] & 1) : mVertexRemaining[vertex] > 0)
+                {
+                    size_t start = mStripX.size();
+                    float w = mProjectedW[vertex];
+                    mStripX.push_back(mProjectedX[vertex] / w);
+                    mStripY.push_back(mProjectedY[vertex] / w);
+                    walkSegments(static_cast<uint32_t>(vertex));
+                    mStripCounts.push_back(mStripX.size() - start);
+                }
+            }
+        }
+        for (size_t i = 0; i < mWireSegments.size(); ++i)
+        {
+            if (!mSegmentUsed[i])
+            {
+                const WireSegment &segment = mWireSegments[i];
+                mStripX.insert(mStripX.end(), {segment.fromX, segment.toX});
+                mStripY.insert(mStripY.end(), {segment.fromY, segment.toY});
+                mStripCounts.push_back(2);
+            }
+        }
+    }
+
+    /// Mark a segment as used and add its end point, or its start point if reverse.
+    void useSegment(uint32_t segmentIndex, bool reverse)
+    {
+        const WireSegment &segment = mWireSegments[segmentIndex];
+        mSegmentUsed[segmentIndex] = 1;
+        for (uint32_t end : {segment.from, segment.to})
+        {
+            if (end != NoVertex)
+            {
+                --mVertexRemaining[end];
+            }
+        }
+        mStripX.push_back(reverse ? segment.fromX : segment.toX);
+        mStripY.push_back(reverse ? segment.fromY : segment.toY);
+    }
+
+    /// Extend the polyline ending at a vertex along unused segments until none is left.
+    void walkSegments(uint32_t vertex)
+    {
+        while (vertex != NoVertex)
+        {
+            size_t &cursor = mVertexCursors[vertex];
+            size_t end = mVertexOffsets[vertex + 1];
+            while (cursor < end && mSegmentUsed[mVertexSegments[cursor]])
+            {
+                ++cursor;
+            }
+            if (cursor == end)
+            {
+                return;
+            }
+            uint32_t segmentIndex = mVertexSegments[cursor++];
+            const WireSegment &segment = mWireSegments[segmentIndex];
+            bool reverse = segment.from != vertex;
+            useSegment(segmentIndex, reverse);
+            vertex = reverse ? segment.from : segment.to;
+        }
+    }
+
+    /// Add arrows centered on (x, y) along (u, v), with the head size relative to the arrow length.
+    void emitArrows(const float *x, const float *y, const float *u, const float *v, size_t count, float headSize)
+    {
+        // The head sides are the arrow vector rotated by +-ArrowHeadAngle and scaled by headSize, from the tip.
+        float headCos = headSize * std::cos(ArrowHeadAngle), headSin = headSize * std::sin(ArrowHeadAngle);
+        uint8_t *dst = grow(count * ArrowSize);
+
+        size_t i = 0;
+#ifdef TEVCLIENT_SSE2
+        __m128 half = _mm_set1_ps(0.5f), hc = _mm_set1_ps(headCos), hs = _mm_set1_ps(headSin);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 cx = _mm_loadu_ps(x + i), cy = _mm_loadu_ps(y + i);
+            __m128 du = _mm_loadu_ps(u + i), dv = _mm_loadu_ps(v + i);
+            __m128 tailX = _mm_sub_ps(cx, _mm_mul_ps(du, half)), tailY = _mm_sub_ps(cy, _mm_mul_ps(dv, half));
+            __m128 tipX = _mm_add_ps(cx, _mm_mul_ps(du, half)), tipY = _mm_add_ps(cy, _mm_mul_ps(dv, half));
+            __m128 cu = _mm_mul_ps(hc, du), cv = _mm_mul_ps(hc, dv), su = _mm_mul_ps(hs, du), sv = _mm_mul_ps(hs, dv);
+            __m128 leftX = _mm_sub_ps(tipX, _mm_sub_ps(cu, sv)), leftY = _mm_sub_ps(tipY, _mm_add_ps(su, cv));
+            __m128 rightX = _mm_sub_ps(tipX, _mm_add_ps(cu, sv)), rightY = _mm_sub_ps(tipY, _mm_sub_ps(cv, su));
+            applyTransform(tailX, tailY);
+            applyTransform(tipX, tipY);
+            applyTransform(leftX, leftY);
+            applyTransform(rightX, rightY);
+            storeArrowPoints(dst, 0, VgCommand::EType::MoveTo, tailX, tailY);
+            storeArrowPoints(dst, 1, VgCommand::EType::LineTo, tipX, tipY);
+            storeArrowPoints(dst, 2, VgCommand::EType::MoveTo, leftX, leftY);
+            storeArrowPoints(dst, 3, VgCommand::EType::LineTo, tipX, tipY);
+            storeArrowPoints(dst, 4, VgCommand::EType::LineTo, rightX, rightY);
+            dst += 4 * ArrowSize;
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            float cu = headCos * u[i], cv = headCos * v[i], su = headSin * u[i], sv = headSin * v[i];
+            float tipX = x[i] + 0.5f * u[i], tipY = y[i] + 0.5f * v[i];
+            float points[ArrowCommandCount][2] = {{x[i] - 0.5f * u[i], y[i] - 0.5f * v[i]},
+                                                  {tipX, tipY},
+                                                  {tipX - (cu - sv), tipY - (su + cv)},
+                                                  {tipX, tipY},
+                                                  {tipX - (cu + sv), tipY - (cv - su)}};
+            for (size_t k = 0; k < ArrowCommandCount; ++k)
+            {
+                applyTransform(points[k][0], points[k][1]);
+                writeType(dst, k == 0 || k == 2 ? VgCommand::EType::MoveTo : VgCommand::EType::LineTo);
+                writeFloats(dst + 1, points[k], 2);
+                dst += PointCommandSize;
+            }
+        }
+        commit(dst, count * ArrowCommandCount);
+    }
+
+#ifdef TEVCLIENT_SSE2
+    /// Store point number point of 4 consecutive arrows.
+    static void storeArrowPoints(uint8_t *dst, size_t point, VgCommand::EType type, __m128 x, __m128 y)
+    {
+        __m128 lo = _mm_unpacklo_ps(x, y);
+        __m128 hi = _mm_unpackhi_ps(x, y);
+        dst += point * PointCommandSize;
+        for (size_t k = 0; k < 4; ++k)
+        {
+            writeType(dst + k * ArrowSize, type);
+        }
+        _mm_storel_pi(reinterpret_cast<__m64 *>(dst + 1), lo);
+        _mm_storeh_pi(reinterpret_cast<__m64 *>(dst + ArrowSize + 1), lo);
+        _mm_storel_pi(reinterpret_cast<__m64 *>(dst + 2 * ArrowSize + 1), hi);
+        _mm_storeh_pi(reinterpret_cast<__m64 *>(dst + 3 * ArrowSize + 1), hi);
+    }
+#endif
+
+    void emitLineStrip(const float *xs, const float *ys, size_t count)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+
+        uint8_t *dst = grow(count * PointCommandSize);
+        float first[2] = {xs[0], ys[0]};
+        applyTransform(first[0], first[1]);
+        writeType(dst, VgCommand::EType::MoveTo);
+        writeFloats(dst + 1, first, 2);
+        dst += PointCommandSize;
+
+        size_t i = 1;
+#ifdef TEVCLIENT_SSE2
+        // Interleave 4 points at a time: (x0 y0 x1 y1) and (x2 y2 x3 y3).
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(xs + i);
+            __m128 y = _mm_loadu_ps(ys + i);
+            applyTransform(x, y);
+            __m128 lo = _mm_unpacklo_ps(x, y);
+            __m128 hi = _mm_unpackhi_ps(x, y);
+            writeType(dst, VgCommand::EType::LineTo);
+            _mm_storel_pi(reinterpret_cast<__m64 *>(dst + 1), lo);
+            writeType(dst + PointCommandSize, VgCommand::EType::LineTo);
+            _mm_storeh_pi(reinterpret_cast<__m64 *>(dst + PointCommandSize + 1), lo);
+            writeType(dst + 2 * PointCommandSize, VgCommand::EType::LineTo);
+            _mm_storel_pi(reinterpret_cast<__m64 *>(dst + 2 * PointCommandSize + 1), hi);
+            writeType(dst + 3 * PointCommandSize, VgCommand::EType::LineTo);
+            _mm_storeh_pi(reinterpret_cast<__m64 *>(dst + 3 * PointCommandSize + 1), hi);
+            dst += 4 * PointCommandSize;
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            float point[2] = {xs[i], ys[i]};
+            applyTransform(point[0], point[1]);
+            writeType(dst, VgCommand::EType::LineTo);
+            writeFloats(dst + 1, point, 2);
+            dst += PointCommandSize;
+        }
+        commit(dst, count);
+    }
+
+    /**
+     * Add circles, radii is nullptr if all circles have the given radius.
+     * Under a non-uniform scale, circles become ellipses.
+     */
+    void emitCircles(const float *cx, const float *cy, const float *radii, float radius, size_t count)
+    {
+        float scaleX = 1.f, scaleY = 1.f;
+        mTransform.applyRadii(scaleX, scaleY);
+        if (std::fabs(scaleX - scaleY) > 1e-5f * std::max(scaleX, scaleY))
+        {
+            ellipses(cx, cy, radii, radius, scaleX, scaleY, count);
+            return;
+        }
+
+        // The vectorized loop writes 16 bytes per circle, overlapping the next command.
+        uint8_t *dst = grow(count * CircleCommandSize + sizeof(float));
+
+        size_t i = 0;
+#ifdef TEVCLIENT_SSE2
+        __m128 scale = _mm_set1_ps(scaleX);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 c0 = _mm_loadu_ps(cx + i);
+            __m128 c1 = _mm_loadu_ps(cy + i);
+            __m128 c2 = radii ? _mm_loadu_ps(radii + i) : _mm_set1_ps(radius);
+            __m128 c3 = _mm_setzero_ps();
+            if (!mIdentity)
+            {
+                applyTransform(c0, c1);
+                c2 = _mm_mul_ps(c2, scale);
+            }
+            _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 1), c0);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + CircleCommandSize + 1), c1);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 2 * CircleCommandSize + 1), c2);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 3 * CircleCommandSize + 1), c3);
+            // Type bytes go last, as they are overwritten by the stores of the previous circle.
+            for (size_t k = 0; k < 4; ++k)
+            {
+                writeType(dst + k * CircleCommandSize, VgCommand::EType::Circle);
+            }
+            dst += 4 * CircleCommandSize;
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            float circle[3] = {cx[i], cy[i], (radii ? radii[i] : radius) * scaleX};
+            applyTransform(circle[0], circle[1]);
+            writeType(dst, VgCommand::EType::Circle);
+            writeFloats(dst + 1, circle, 3);
+            dst += CircleCommandSize;
+        }
+        commit(dst, count);
+    }
+
+    void emitRects(const float *x, const float *y, const float *width, const float *height, size_t count)
+    {
+        if (!mTransform.isAxisAligned())
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                addQuad(x[i], y[i], width[i], height[i]);
+            }
+            return;
+        }
+
+        uint8_t *dst = grow(count * RectCommandSize);
+
+        size_t i = 0;
+#ifdef TEVCLIENT_SSE2
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 r0 = _mm_loadu_ps(x + i);
+            __m128 r1 = _mm_loadu_ps(y + i);
+            __m128 r2 = _mm_loadu_ps(width + i);
+            __m128 r3 = _mm_loadu_ps(height + i);
+            if (!mIdentity)
+            {
+                applyAxisAligned(r0, r2, mTransform.a, mTransform.e);
+                applyAxisAligned(r1, r3, mTransform.d, mTransform.f);
+            }
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            writeType(dst, VgCommand::EType::Rect);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 1), r0);
+            writeType(dst + RectCommandSize, VgCommand::EType::Rect);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + RectCommandSize + 1), r1);
+            writeType(dst + 2 * RectCommandSize, VgCommand::EType::Rect);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 2 * RectCommandSize + 1), r2);
+            writeType(dst + 3 * RectCommandSize, VgCommand::EType::Rect);
+            _mm_storeu_ps(reinterpret_cast<float *>(dst + 3 * RectCommandSize + 1), r3);
+            dst += 4 * RectCommandSize;
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            float rect[4] = {x[i], y[i], width[i], height[i]};
+            if (!mIdentity)
+            {
+                applyAxisAligned(rect[0], rect[2], mTransform.a, mTransform.e);
+                applyAxisAligned(rect[1], rect[3], mTransform.d, mTransform.f);
+            }
+            writeType(dst, VgCommand::EType::Rect);
+            writeFloats(dst + 1, rect, 4);
+            dst += RectCommandSize;
+        }
+        commit(dst, count);
+    }
+
+    void applyTransform(float &x, float &y) const
+    {
+        if (!mIdentity)
+        {
+            mTransform.apply(x, y);
+        }
+    }
+
+    /// Transform a position and extent along one axis, keeping the extent positive.
+    static void applyAxisAligned(float &pos, float &size, float scale, float offset)
+    {
+        pos = pos * scale + offset;
+        size *= scale;
+        if (size < 0.f)
+        {
+            pos += size;
+            size = -size;
+        }
+    }
+
+#ifdef TEVCLIENT_SSE2
+    void applyTransform(__m128 &x, __m128 &y) const
+    {
+        if (mIdentity)
+        {
+            return;
+        }
+        __m128 tx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(mTransform.a), x),
+                                          _mm_mul_ps(_mm_set1_ps(mTransform.c), y)),
+                               _mm_set1_ps(mTransform.e));
+        __m128 ty = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(mTransform.b), x),
+                                          _mm_mul_ps(_mm_set1_ps(mTransform.d), y)),
+                               _mm_set1_ps(mTransform.f));
+        x = tx;
+        y = ty;
+    }
+
+    static void applyAxisAligned(__m128 &pos, __m128 &size, float scale, float offset)
+    {
+        pos = _mm_add_ps(_mm_mul_ps(pos, _mm_set1_ps(scale)), _mm_set1_ps(offset));
+        size = _mm_mul_ps(size, _mm_set1_ps(scale));
+        pos = _mm_add_ps(pos, _mm_min_ps(size, _mm_setzero_ps()));
+        size = _mm_max_ps(size, _mm_sub_ps(_mm_setzero_ps(), size));
+    }
+#endif
+
+    /// Circles under a non-uniform scale, radii are scaled by (scaleX, scaleY).
+    void ellipses(const float *cx, const float *cy, const float *radii, float radius, float scaleX, float scaleY,
+                  size_t count)
+    {
+        uint8_t *dst = grow(count * RectCommandSize);
+        for (size_t i = 0; i < count; ++i)
+        {
+            float r = radii ? radii[i] : radius;
+            float ellipse[4] = {cx[i], cy[i], r * scaleX, r * scaleY};
+            applyTransform(ellipse[0], ellipse[1]);
+            writeType(dst, VgCommand::EType::Ellipse);
+            writeFloats(dst + 1, ellipse, 4);
+            dst += RectCommandSize;
+        }
+        commit(dst, count);
+    }
+
+    /// Rectangle under a rotation or shear, added as a closed polygon.
+    void addQuad(float x, float y, float width, float height)
+    {
+        float corners[4][2] = {{x, y}, {x + width, y}, {x + width, y + height}, {x, y + height}};
+        uint8_t *dst = grow(4 * PointCommandSize + 1);
+        for (size_t k = 0; k < 4; ++k)
+        {
+            mTransform.apply(corners[k][0], corners[k][1]);
+            writeType(dst, k == 0 ? VgCommand::EType::MoveTo : VgCommand::EType::LineTo);
+            writeFloats(dst + 1, corners[k], 2);
+            dst += PointCommandSize;
+        }
+        writeType(dst++, VgCommand::EType::ClosePath);
+        commit(dst, 5);
+    }
+
+    void addEncoded(const VgCommand &command)
+    {
+        uint8_t *dst = grow(protocol::vgCommandsSize(&command, 1));
+        commit(protocol::encodeVgCommands(dst, &command, 1), 1);
+    }
+
+    /// Add a single command with all coordinates transformed.
+    void addTransformed(VgCommand command)
+    {
+        const Transform &t = mTransform;
+        float *data = command.data;
+        switch (command.type)
+        {
+        case VgCommand::EType::MoveTo:
+        case VgCommand::EType::LineTo:
+            t.apply(data[0], data[1]);
+            break;
+        case VgCommand::EType::QuadTo:
+            t.apply(data[0], data[1]);
+            t.apply(data[2], data[3]);
+            break;
+        case VgCommand::EType::BezierTo:
+            t.apply(data[0], data[1]);
+            t.apply(data[2], data[3]);
+            t.apply(data[4], data[5]);
+            break;
+        case VgCommand::EType::ArcTo:
+            t.apply(data[0], data[1]);
+            t.apply(data[2], data[3]);
+            data[4] *= t.lengthScale();
+            break;
+        case VgCommand::EType::Arc: {
+            // Exact for similarity transforms: angles rotate with the transform, and a mirroring
+            // transform reverses them along with the winding.
+            t.apply(data[0], data[1]);
+            data[2] *= t.lengthScale();
+            float rotation = std::atan2(t.b, t.a);
+            if (t.a * t.d - t.b * t.c < 0.f)
+            {
+                data[3] = rotation - data[3];
+                data[4] = rotation - data[4];
+                data[5] = data[5] == (float)VgCommand::Clockwise ? (float)VgCommand::CounterClockwise
+                                                                  : (float)VgCommand::Clockwise;
+            }
+            else
+            {
+                data[3] += rotation;
+                data[4] += rotation;
+            }
+            break;
+        }
+        case VgCommand::EType::Circle: {
+            // Same as circles(), so that both produce identical output.
+            float scaleX = 1.f, scaleY = 1.f;
+            t.applyRadii(scaleX, scaleY);
+            t.apply(data[0], data[1]);
+            if (std::fabs(scaleX - scaleY) > 1e-5f * std::max(scaleX, scaleY))
+            {
+                command = VgCommand::ellipse({data[0], data[1]}, {data[2] * scaleX, data[2] * scaleY});
+            }
+            else
+            {
+                data[2] *= scaleX;
+            }
+            break;
+        }
+        case VgCommand::EType::Ellipse:
+            t.apply(data[0], data[1]);
+            t.applyRadii(data[2], data[3]);
+            break;
+        case VgCommand::EType::Rect:
+            if (!t.isAxisAligned())
+            {
+                addQuad(data[0], data[1], data[2], data[3]);
+                return;
+            }
+            applyAxisAligned(data[0], data[2], t.a, t.e);
+            applyAxisAligned(data[1], data[3], t.d, t.f);
+            break;
+        case VgCommand::EType::RoundedRect:
+        case VgCommand::EType::RoundedRectVarying: {
+            // Rounded rectangles have no polygon equivalent, they keep their axis alignment
+            // and cover the bounds of the transformed rectangle.
+            float bounds[4];
+            t.applyRect(data[0], data[1], data[2], data[3], bounds);
+            data[0] = bounds[0];
+            data[1] = bounds[1];
+            data[2] = bounds[2] - bounds[0];
+            data[3] = bounds[3] - bounds[1];
+            float scale = t.lengthScale();
+            for (uint8_t k = 4; k < command.dataCount; ++k)
+            {
+                data[k] *= scale;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        addEncoded(command);
+    }
+
+    Allocator &mAllocator;
+    Vector<uint8_t> mData;
+    size_t mCommandCount{0};
+
+    Transform mTransform;
+    bool mIdentity{true};
+    Vector<Transform> mTransformStack;
+
+    VgLod mLod;
+    bool mLodActive{false};
+    bool mLodCull{false};
+    bool mLodMerge{false};
+    size_t mDroppedCount{0};
+    /// One bit per pixel, set if a sub-pixel primitive was drawn there in the current path.
+    Vector<uint8_t> mLodGrid;
+    size_t mLodColumns{0};
+    /// Indices of the non-zero bytes in mLodGrid.
+    Vector<size_t> mLodTouched;
+    Vector<float> mKeptX, mKeptY, mKeptWidth, mKeptHeight;
+
+    Vector<PointRange> mChunks;
+    /// Points of the line strips kept by simplification.
+    Vector<uint8_t> mKeep;
+    Vector<PointRange> mSimplifyStack;
+    Vector<float> mSimplifiedX, mSimplifiedY;
+
+    Vector<uint32_t> mArrowBuckets;
+    Vector<size_t> mBucketOffsets, mBucketFill;
+    Vector<float> mArrowX, mArrowY, mArrowU, mArrowV;
+
+    enum ContourState : uint8_t
+    {
+        HasPrevious = 1,
+        Visited = 2,
+    };
+
+    Vector<size_t> mContourOffsets, mLevelOffsets;
+    Vector<ContourSegment *> mContourCursors;
+    Vector<ContourSegment> mContourSegments;
+    /// Segment starting on each edge, UINT32_MAX outside of traceContours().
+    Vector<uint32_t> mEdgeSegment;
+    Vector<uint32_t> mContourNext;
+    Vector<uint8_t> mContourState;
+    Vector<float> mStripX, mStripY;
+    Vector<size_t> mStripCounts;
+
+    Vector<float> mProjectedX, mProjectedY, mProjectedW;
+    Vector<size_t> mEdgeCounts, mPartitionOffsets, mPartitionSizes;
+    /// Keys of each task in their order of appearance, and grouped by partition at mEdgeBucketOffsets.
+    Vector<size_t> mEdgeBucketOffsets;
+    Vector<uint64_t> mEdgeKeys, mEdgeBuckets;
+    Vector<uint64_t> mEdgeTable;
+    Vector<WireSegment> mWireSegments;
+    /// Segments of each vertex, in the ranges given by mVertexOffsets.
+    Vector<size_t> mVertexOffsets, mVertexCursors;
+    Vector<uint32_t> mVertexSegments, mVertexRemaining;
+    Vector<uint8_t> mSegmentUsed;
+};
+
+VgBuffer::VgBuffer() : VgBuffer(defaultAllocator())
+{
+}
+
+VgBuffer::VgBuffer(Allocator &allocator)
+{
+    void *memory = allocateOrThrow(allocator, sizeof(VgBuffer::Impl), alignof(VgBuffer::Impl));
+    mImpl = new (memory) VgBuffer::Impl(allocator);
+}
+
+VgBuffer::~VgBuffer()
+{
+    Allocator &allocator = mImpl->allocator();
+    mImpl->~Impl();
+    allocator.deallocate(mImpl, sizeof(VgBuffer::Impl), alignof(VgBuffer::Impl));
+}
+
+void VgBuffer::add(const VgCommand &command)
+{
+    mImpl->add(&command, 1);
+}
+
+void VgBuffer::add(const VgCommand *commands, size_t count)
+{
+    mImpl->add(commands, count);
+}
+
+void VgBuffer::lineStrip(const float *xs, const float *ys, size_t count)
+{
+    mImpl->lineStrip(xs, ys, count);
+}
+
+void VgBuffer::lineStrips(const float *xs, const float *ys, const size_t *counts, size_t stripCount)
+{
+    mImpl->lineStrips(xs, ys, counts, stripCount);
+}
+
+void VgBuffer::circles(const float *cx, const float *cy, const float *radii, size_t count)
+{
+    mImpl->circles(cx, cy, radii, 0.f, count);
+}
+
+void VgBuffer::circles(const float *cx, const float *cy, float radius, size_t count)
+{
+    mImpl->circles(cx, cy, nullptr, radius, count);
+}
+
+void VgBuffer::rects(const float *x, const float *y, const float *width, const float *height, size_t count)
+{
+    mImpl->rects(x, y, width, height, count);
+}
+
+void VgBuffer::arrows(const float *field, uint32_t width, uint32_t height, const uint64_t *channelOffsets,
+                      const uint64_t *channelStrides, const VgArrowStyle &style)
+{
+    mImpl->arrows(field, width, height, channelOffsets, channelStrides, style);
+}
+
+void VgBuffer::isolines(const float *image, uint32_t width, uint32_t height, uint64_t channelOffset,
+                        uint64_t channelStride, const float *levels, size_t levelCount, const VgCommand::Color *colors)
+{
+    mImpl->isolines(image, width, height, channelOffset, channelStride, levels, levelCount, colors);
+}
+
+void VgBuffer::wireframe(const float *positions, size_t vertexCount, const uint32_t *indices, size_t triangleCount,
+                         const float *projection, uint32_t width, uint32_t height)
+{
+    mImpl->wireframe(positions, vertexCount, indices, triangleCount, projection, width, height);
+}
+
+void VgBuffer::pushTransform()
+{
+    mImpl->pushTransform();
+}
+
+void VgBuffer::popTransform()
+{
+    mImpl->popTransform();
+}
+
+void VgBuffer::resetTransform()
+{
+    mImpl->setTransform(Transform());
+}
+
+void VgBuffer::translate(float x, float y)
+{
+    Transform translation;
+    translation.e = x;
+    translation.f = y;
+    mImpl->setTransform(mImpl->transform() * translation);
+}
+
+void VgBuffer::scale(float x, float y)
+{
+    Transform scaling;
+    scaling.a = x;
+    scaling.d = y;
+    mImpl->setTransform(mImpl->transform() * scaling);
+}
+
+void VgBuffer::rotate(float angle)
+{
+    Transform rotation;
+    rotation.a = std::cos(angle);
+    rotation.b = std::sin(angle);
+    rotation.c = -rotation.b;
+    rotation.d = rotation.a;
+    mImpl->setTransform(mImpl->transform() * rotation);
+}
+
+void VgBuffer::transform(float a, float b, float c, float d, float e, float f)
+{
+    Transform transform;
+    transform.a = a;
+    transform.b = b;
+    transform.c = c;
+    transform.d = d;
+    transform.e = e;
+    transform.f = f;
+    mImpl->setTransform(mImpl->transform() * transform);
+}
+
+void VgBuffer::setLod(const VgLod &lod)
+{
+    mImpl->setLod(lod);
+}
+
+size_t VgBuffer::droppedCount() const
+{
+    return mImpl->droppedCount();
+}
+
+void VgBuffer::clear()
+{
+    mImpl->clear();
+}
+
+size_t VgBuffer::commandCount() const
+{
+    return mImpl->commandCount();
+}
+
+const uint8_t *VgBuffer::data() const
+{
+    return mImpl->data();
+}
+
+size_t VgBuffer::size() const
+{
+    return mImpl->size();
+}
+
+} // namespace tevclient
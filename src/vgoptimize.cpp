@@ -0,0 +1,454 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "tevclient.h"
+#include "allocator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace tevclient
+{
+
+// Bounds of paths are grown by these margins when checking whether reordering is safe: fills by
+// the antialiasing fringe, strokes additionally by the miter joins of nanovg's default stroke width
+// (1) and miter limit (10).
+static constexpr float FillMargin = 1.f;
+static constexpr float StrokeMargin = 6.f;
+
+/// Number of earlier batches a path may be moved past when reordering.
+static constexpr size_t MaxReorderDistance = 64;
+
+/// Maximum number of Fill/Stroke commands of a path that can be merged.
+static constexpr size_t MaxDrawOps = 4;
+
+/// Fill or stroke color, unknown after a Restore until it is set again.
+struct StateColor
+{
+    VgCommand::Color color;
+    bool known{false};
+
+    bool operator==(const StateColor &other) const
+    {
+        return known && other.known && color.r == other.color.r && color.g == other.color.g &&
+               color.b == other.color.b && color.a == other.color.a;
+    }
+
+    bool opaque() const
+    {
+        return known && color.a >= 1.f;
+    }
+};
+
+static StateColor stateColor(const VgCommand &command)
+{
+    StateColor result;
+    result.color = {command.data[0], command.data[1], command.data[2], command.data[3]};
+    result.known = true;
+    return result;
+}
+
+static bool isPathCommand(VgCommand::EType type)
+{
+    switch (type)
+    {
+    case VgCommand::EType::ClosePath:
+    case VgCommand::EType::PathWinding:
+    case VgCommand::EType::MoveTo:
+    case VgCommand::EType::LineTo:
+    case VgCommand::EType::ArcTo:
+    case VgCommand::EType::Arc:
+    case VgCommand::EType::BezierTo:
+    case VgCommand::EType::Circle:
+    case VgCommand::EType::Ellipse:
+    case VgCommand::EType::QuadTo:
+    case VgCommand::EType::Rect:
+    case VgCommand::EType::RoundedRect:
+    case VgCommand::EType::RoundedRectVarying:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// True if the command starts a new subpath, so that the path can be appended to another one.
+static bool startsSubpath(VgCommand::EType type)
+{
+    switch (type)
+    {
+    case VgCommand::EType::MoveTo:
+    case VgCommand::EType::Circle:
+    case VgCommand::EType::Ellipse:
+    case VgCommand::EType::Rect:
+    case VgCommand::EType::RoundedRect:
+    case VgCommand::EType::RoundedRectVarying:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void addBounds(float (&bounds)[4], float minX, float minY, float maxX, float maxY)
+{
+    bounds[0] = std::min(bounds[0], minX);
+    bounds[1] = std::min(bounds[1], minY);
+    bounds[2] = std::max(bounds[2], maxX);
+    bounds[3] = std::max(bounds[3], maxY);
+}
+
+/// Compute the bounds of a path, returns false if they are not known (e.g. for ArcTo).
+static bool pathBounds(const VgCommand *begin, const VgCommand *end, float (&bounds)[4])
+{
+    for (const VgCommand *command = begin; command != end; ++command)
+    {
+        const float *data = command->data;
+        switch (command->type)
+        {
+        case VgCommand::EType::MoveTo:
+        case VgCommand::EType::LineTo:
+        case VgCommand::EType::QuadTo:
+        case VgCommand::EType::BezierTo:
+            // Curves lie within the hull of their control points.
+            for (size_t i = 0; i + 1 < command->dataCount; i += 2)
+            {
+                addBounds(bounds, data[i], data[i + 1], data[i], data[i + 1]);
+            }
+            break;
+        case VgCommand::EType::Arc:
+        case VgCommand::EType::Circle:
+            addBounds(bounds, data[0] - std::abs(data[2]), data[1] - std::abs(data[2]), data[0] + std::abs(data[2]),
+                      data[1] + std::abs(data[2]));
+            break;
+        case VgCommand::EType::Ellipse:
+            addBounds(bounds, data[0] - std::abs(data[2]), data[1] - std::abs(data[3]), data[0] + std::abs(data[2]),
+                      data[1] + std::abs(data[3]));
+            break;
+        case VgCommand::EType::Rect:
+        case VgCommand::EType::RoundedRect:
+        case VgCommand::EType::RoundedRectVarying:
+            addBounds(bounds, std::min(data[0], data[0] + data[2]), std::min(data[1], data[1] + data[3]),
+                      std::max(data[0], data[0] + data[2]), std::max(data[1], data[1] + data[3]));
+            break;
+        case VgCommand::EType::ClosePath:
+        case VgCommand::EType::PathWinding:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Rewrites a command sequence into batches, each a path with its Fill/Stroke commands.
+ *
+ * A path (BeginPath, path commands, draw commands) is appended to an earlier batch drawn with the
+ * same color. This is only done if the path is drawn by a single opaque Fill or Stroke and has no
+ * PathWinding commands, as overlapping shapes are then drawn the same whether they are in one path
+ * or several. Paths that are both filled and stroked are not merged, as the outline of one would
+ * then be drawn on top of the fill of the next. Without
+ * reordering, only the previous batch is considered. With reordering, a path may move past
+ * batches whose bounds it does not overlap.
+ *
+ * Color commands are only emitted before a draw command whose color differs from the last one
+ * emitted. Save, Restore, and any command not part of a path as above, are passed through
+ * unchanged and end the current batches.
+ */
+class VgOptimizer
+{
+public:
+    VgOptimizer(bool reorder, Allocator &allocator)
+        : mReorder(reorder), mBatches(allocator), mSegments(allocator), mOutput(allocator)
+    {
+    }
+
+    size_t run(VgCommand *commands, size_t count)
+    {
+        mCommands = commands;
+        mOutput.reserve(count);
+        size_t i = 0;
+        while (i < count)
+        {
+            const VgCommand &command = commands[i];
+            switch (command.type)
+            {
+            case VgCommand::EType::FillColor:
+                mFill = stateColor(command);
+                ++i;
+                break;
+            case VgCommand::EType::StrokeColor:
+                mStroke = stateColor(command);
+                ++i;
+                break;
+            case VgCommand::EType::BeginPath:
+                i = addPath(commands, i, count);
+                break;
+            case VgCommand::EType::Restore:
+                flush();
+                mOutput.push_back(command);
+                mFill = mStroke = mOutputFill = mOutputStroke = StateColor();
+                ++i;
+                break;
+            default:
+                passThrough(commands, i, i + 1);
+                ++i;
+                break;
+            }
+        }
+        flush();
+        // Colors set at the end still apply to commands appended later.
+        syncColors(mFill, mStroke);
+
+        // Each color command emitted replaces one in the input, so the output is never longer.
+        if (mOutput.size() > count)
+        {
+            return count;
+        }
+        std::copy(mOutput.begin(), mOutput.end(), commands);
+        return mOutput.size();
+    }
+
+private:
+    struct DrawOp
+    {
+        VgCommand::EType type;
+        StateColor color;
+    };
+
+    /// Range of path commands, linked to the next range of the same batch.
+    struct Segment
+    {
+        size_t begin, end;
+        size_t next;
+    };
+
+    struct Batch
+    {
+        DrawOp ops[MaxDrawOps];
+        size_t opCount;
+        bool mergeable;
+        bool boundsKnown;
+        float bounds[4];
+        size_t firstSegment, lastSegment;
+
+        bool sameStyle(const Batch &other) const
+        {
+            if (opCount != other.opCount)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < opCount; ++i)
+            {
+                if (ops[i].type != other.ops[i].type || !(ops[i].color == other.ops[i].color))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool overlaps(const Batch &other) const
+        {
+            return bounds[0] <= other.bounds[2] && other.bounds[0] <= bounds[2] && bounds[1] <= other.bounds[3] &&
+                   other.bounds[1] <= bounds[3];
+        }
+    };
+
+    /// Add the path starting with the BeginPath at begin, returns the index past its last command.
+    size_t addPath(const VgCommand *commands, size_t begin, size_t count)
+    {
+        size_t pathEnd = begin + 1;
+        bool hasWinding = false;
+        while (pathEnd < count && isPathCommand(commands[pathEnd].type))
+        {
+            hasWinding |= commands[pathEnd].type == VgCommand::EType::PathWinding;
+            ++pathEnd;
+        }
+
+        Batch batch;
+        batch.opCount = 0;
+        StateColor fill = mFill, stroke = mStroke;
+        size_t end = pathEnd;
+        bool simple = true;
+        for (; end < count; ++end)
+        {
+            const VgCommand &command = commands[end];
+            if (command.type == VgCommand::EType::FillColor)
+            {
+                fill = stateColor(command);
+            }
+            else if (command.type == VgCommand::EType::StrokeColor)
+            {
+                stroke = stateColor(command);
+            }
+            else if (command.type == VgCommand::EType::Fill || command.type == VgCommand::EType::Stroke)
+            {
+                if (batch.opCount == MaxDrawOps)
+                {
+                    simple = false;
+                    break;
+                }
+                bool isFill = command.type == VgCommand::EType::Fill;
+                batch.ops[batch.opCount++] = {command.type, isFill ? fill : stroke};
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        // Paths continued after drawing, or never drawn (and possibly drawn by later messages), are kept as is.
+        if (!simple || batch.opCount == 0 || (end < count && isPathCommand(commands[end].type)))
+        {
+            while (end < count && commands[end].type != VgCommand::EType::BeginPath &&
+                   commands[end].type != VgCommand::EType::Restore)
+            {
+                ++end;
+            }
+            passThrough(commands, begin, end);
+            return end;
+        }
+
+        mFill = fill;
+        mStroke = stroke;
+
+        bool hasStroke = false;
+        batch.mergeable = !hasWinding && batch.opCount == 1;
+        for (size_t i = 0; i < batch.opCount; ++i)
+        {
+            batch.mergeable &= batch.ops[i].color.opaque();
+            hasStroke |= batch.ops[i].type == VgCommand::EType::Stroke;
+        }
+        float margin = hasStroke ? StrokeMargin : FillMargin;
+        batch.bounds[0] = batch.bounds[1] = std::numeric_limits<float>::max();
+        batch.bounds[2] = batch.bounds[3] = std::numeric_limits<float>::lowest();
+        batch.boundsKnown = pathBounds(commands + begin + 1, commands + pathEnd, batch.bounds);
+        batch.bounds[0] -= margin;
+        batch.bounds[1] -= margin;
+        batch.bounds[2] += margin;
+        batch.bounds[3] += margin;
+
+        size_t segment = mSegments.size();
+        mSegments.push_back({begin + 1, pathEnd, SIZE_MAX});
+        bool canAppend = batch.mergeable && pathEnd > begin + 1 && startsSubpath(commands[begin + 1].type);
+
+        size_t distance = 0;
+        for (size_t i = mBatches.size(); canAppend && i-- > 0 && distance++ < MaxReorderDistance;)
+        {
+            Batch &other = mBatches[i];
+            if (other.mergeable && other.sameStyle(batch))
+            {
+                mSegments[other.lastSegment].next = segment;
+                other.lastSegment = segment;
+                addBounds(other.bounds, batch.bounds[0], batch.bounds[1], batch.bounds[2], batch.bounds[3]);
+                other.boundsKnown &= batch.boundsKnown;
+                return end;
+            }
+            if (!mReorder || !batch.boundsKnown || !other.boundsKnown || batch.overlaps(other))
+            {
+                break;
+            }
+        }
+
+        batch.firstSegment = batch.lastSegment = segment;
+        mBatches.push_back(batch);
+        return end;
+    }
+
+    /// Copy commands unchanged, after emitting all batches.
+    void passThrough(const VgCommand *commands, size_t begin, size_t end)
+    {
+        flush();
+        syncColors(mFill, mStroke);
+        for (size_t i = begin; i < end; ++i)
+        {
+            const VgCommand &command = commands[i];
+            if (command.type == VgCommand::EType::FillColor)
+            {
+                mFill = mOutputFill = stateColor(command);
+            }
+            else if (command.type == VgCommand::EType::StrokeColor)
+            {
+                mStroke = mOutputStroke = stateColor(command);
+            }
+            mOutput.push_back(command);
+        }
+    }
+
+    void syncColors(const StateColor &fill, const StateColor &stroke)
+    {
+        if (fill.known && !(fill == mOutputFill))
+        {
+            mOutput.push_back(VgCommand::fillColor(fill.color));
+            mOutputFill = fill;
+        }
+        if (stroke.known && !(stroke == mOutputStroke))
+        {
+            mOutput.push_back(VgCommand::strokeColor(stroke.color));
+            mOutputStroke = stroke;
+        }
+    }
+
+    void flush()
+    {
+        for (const Batch &batch : mBatches)
+        {
+            // Set the colors of the first Fill and Stroke before the path.
+            StateColor fill, stroke;
+            for (size_t i = batch.opCount; i-- > 0;)
+            {
+                (batch.ops[i].type == VgCommand::EType::Fill ? fill : stroke) = batch.ops[i].color;
+            }
+            syncColors(fill, stroke);
+            mOutput.push_back(VgCommand::beginPath());
+            for (size_t segment = batch.firstSegment; segment != SIZE_MAX; segment = mSegments[segment].next)
+            {
+                mOutput.insert(mOutput.end(), mCommands + mSegments[segment].begin,
+                               mCommands + mSegments[segment].end);
+            }
+            for (size_t i = 0; i < batch.opCount; ++i)
+            {
+                const DrawOp &op = batch.ops[i];
+                if (op.type == VgCommand::EType::Fill)
+                {
+                    syncColors(op.color, StateColor());
+                    mOutput.push_back(VgCommand::fill());
+                }
+                else
+                {
+                    syncColors(StateColor(), op.color);
+                    mOutput.push_back(VgCommand::stroke());
+                }
+            }
+        }
+        mBatches.clear();
+        mSegments.clear();
+    }
+
+    bool mReorder;
+    const VgCommand *mCommands{nullptr};
+
+    Vector<Batch> mBatches;
+    Vector<Segment> mSegments;
+    Vector<VgCommand> mOutput;
+
+    /// Colors at the current input position.
+    StateColor mFill, mStroke;
+    /// Colors at the end of the output.
+    StateColor mOutputFill, mOutputStroke;
+};
+
+size_t optimizeVgCommands(VgCommand *commands, size_t count, bool reorder)
+{
+    return optimizeVgCommands(commands, count, reorder, defaultAllocator());
+}
+
+size_t optimizeVgCommands(VgCommand *commands, size_t count, bool reorder, Allocator &allocator)
+{
+    VgOptimizer optimizer(reorder, allocator);
+    return optimizer.run(commands, count);
+}
+
+} // namespace tevclient
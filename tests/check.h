@@ -0,0 +1,34 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+
+/// Number of failed checks, the test exits with a non-zero status if there are any.
+inline std::atomic<int> &checkFailures()
+{
+    static std::atomic<int> failures{0};
+    return failures;
+}
+
+#define CHECK(condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(condition))                                                                                              \
+        {                                                                                                              \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                         \
+            ++checkFailures();                                                                                         \
+        }                                                                                                              \
+    } while (0)
+
+inline int checkResult()
+{
+    if (checkFailures() > 0)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", checkFailures().load());
+        return 1;
+    }
+    return 0;
+}
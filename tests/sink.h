@@ -0,0 +1,164 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Stand-in for tev: accepts one connection on an ephemeral port of 127.0.0.1 and records what it receives.
+class TestSink
+{
+public:
+    /// Create the sink, with paused set it does not read until resume() is called.
+    explicit TestSink(bool paused = false) : mPaused(paused)
+    {
+        mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(mListenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+            listen(mListenFd, 1) == 0 && getsockname(mListenFd, reinterpret_cast<sockaddr *>(&address), &length) == 0)
+        {
+            mPort = ntohs(address.sin_port);
+        }
+        mThread = std::thread(&TestSink::receive, this);
+    }
+
+    ~TestSink()
+    {
+        resume();
+        shutdown(mListenFd, SHUT_RDWR);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mConnectionFd >= 0)
+            {
+                shutdown(mConnectionFd, SHUT_RDWR);
+            }
+        }
+        mThread.join();
+        close(mListenFd);
+    }
+
+    uint16_t port() const
+    {
+        return mPort;
+    }
+
+    /// Wait until at least size bytes were received, returns false on timeout.
+    bool waitFor(size_t size, double timeout = 10.0)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mCv.wait_for(lock, std::chrono::duration<double>(timeout), [&] { return mData.size() >= size; });
+    }
+
+    /// Wait until the client closed its connection, returns false on timeout.
+    bool waitForDisconnect(double timeout = 10.0)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mCv.wait_for(lock, std::chrono::duration<double>(timeout), [&] { return mClosed; });
+    }
+
+    /// Return the bytes received so far.
+    std::vector<uint8_t> data()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mData;
+    }
+
+    /// Start reading after the sink was created paused.
+    void resume()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPaused = false;
+        mCv.notify_all();
+    }
+
+    /// A message received by the sink.
+    struct Message
+    {
+        uint8_t type;
+        /// Size including the length prefix.
+        size_t size;
+        /// The message without its length prefix, starting with the type byte.
+        std::vector<uint8_t> packet;
+    };
+
+    /// Split the bytes received so far into messages.
+    std::vector<Message> messages()
+    {
+        std::vector<uint8_t> bytes = data();
+        std::vector<Message> result;
+        size_t offset = 0;
+        while (offset + 5 <= bytes.size())
+        {
+            uint32_t length;
+            std::memcpy(&length, bytes.data() + offset, 4);
+            if (length < 5 || offset + length > bytes.size())
+            {
+                break;
+            }
+            result.push_back({bytes[offset + 4], length,
+                              std::vector<uint8_t>(bytes.begin() + offset + 4, bytes.begin() + offset + length)});
+            offset += length;
+        }
+        return result;
+    }
+
+private:
+    void receive()
+    {
+        int fd = accept(mListenFd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mConnectionFd = fd;
+        }
+        uint8_t buffer[64 * 1024];
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCv.wait(lock, [this] { return !mPaused; });
+            }
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+            {
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mMutex);
+            mData.insert(mData.end(), buffer, buffer + received);
+            mCv.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        close(fd);
+        mConnectionFd = -1;
+        mClosed = true;
+        mCv.notify_all();
+    }
+
+    int mListenFd{-1};
+    uint16_t mPort{0};
+    std::thread mThread;
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    bool mPaused;
+    int mConnectionFd{-1};
+    bool mClosed{false};
+    std::vector<uint8_t> mData;
+};
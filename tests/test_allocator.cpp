@@ -0,0 +1,94 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "sink.h"
+
+#include <tevclient.h>
+
+#include <cstdint>
+
+using namespace tevclient;
+
+static void testExhaustion()
+{
+    alignas(16) static unsigned char buffer[1024];
+    ArenaAllocator arena(buffer, sizeof(buffer));
+    void *a = arena.allocate(1000, 8);
+    CHECK(a != nullptr);
+    CHECK(arena.allocate(100, 8) == nullptr);
+    arena.deallocate(a, 1000, 8);
+    CHECK(arena.used() == 0);
+}
+
+static void testReuseAndMerge()
+{
+    alignas(16) static unsigned char buffer[4096];
+    ArenaAllocator arena(buffer, sizeof(buffer));
+    void *a = arena.allocate(1024, 8);
+    void *b = arena.allocate(1024, 8);
+    void *c = arena.allocate(1024, 8);
+    CHECK(a && b && c);
+
+    // Freed ranges are reused, and adjacent ones merged into a larger range.
+    arena.deallocate(b, 1024, 8);
+    CHECK(arena.allocate(1024, 8) == b);
+    arena.deallocate(b, 1024, 8);
+    arena.deallocate(a, 1024, 8);
+    CHECK(arena.allocate(2048, 8) == a);
+    arena.deallocate(a, 2048, 8);
+    arena.deallocate(c, 1024, 8);
+    CHECK(arena.used() == 0);
+    CHECK(arena.allocate(4096, 8) == buffer);
+}
+
+static void testAlignment()
+{
+    alignas(16) static unsigned char buffer[4096];
+    ArenaAllocator arena(buffer, sizeof(buffer));
+    void *a = arena.allocate(3, 1);
+    void *b = arena.allocate(64, 256);
+    CHECK(a && b);
+    CHECK(reinterpret_cast<uintptr_t>(b) % 256 == 0);
+    // The padding in front of the aligned allocation stays usable.
+    void *c = arena.allocate(16, 16);
+    CHECK(c && c < b);
+    arena.deallocate(a, 3, 1);
+    arena.deallocate(b, 64, 256);
+    arena.deallocate(c, 16, 16);
+    CHECK(arena.used() == 0);
+    CHECK(arena.allocate(4096, 16) == buffer);
+}
+
+/// Running out of memory fails the call, and the memory of sent messages is reused afterwards.
+static void testClientOutOfMemory()
+{
+    static unsigned char buffer[256 * 1024];
+    ArenaAllocator arena(buffer, sizeof(buffer));
+    TestSink sink;
+    Client client("127.0.0.1", sink.port(), arena);
+    CHECK(client.connect() == Error::Ok);
+    // Thread-safe mode copies the image data into the queued message.
+    CHECK(client.setThreadSafe(true) == Error::Ok);
+
+    static float data[128 * 128 * 4];
+    Error error = client.updateImage("image", 0, 0, 128, 128, 4, nullptr, nullptr, nullptr, data, 128 * 128 * 4);
+    CHECK(error == Error::OutOfMemory);
+    CHECK(client.lastError() == Error::OutOfMemory);
+    for (int i = 0; i < 100; ++i)
+    {
+        CHECK(client.updateImage("image", 0, 0, 32, 32, 4, nullptr, nullptr, nullptr, data, 32 * 32 * 4) == Error::Ok);
+        CHECK(client.flush() == Error::Ok);
+    }
+    CHECK(sink.waitFor(100 * 32 * 32 * 4 * sizeof(float)));
+    CHECK(client.disconnect() == Error::Ok);
+}
+
+int main()
+{
+    testExhaustion();
+    testReuseAndMerge();
+    testAlignment();
+    testClientOutOfMemory();
+    return checkResult();
+}
@@ -0,0 +1,297 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+// Runs producers -> tevbroker -> tevbroker --sink and checks what the sink received.
+
+#include "check.h"
+#include "protocol.h"
+
+#include <tevclient.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace tevclient;
+
+/// A tevbroker process with its output captured.
+class BrokerProcess
+{
+public:
+    BrokerProcess(const char *path, const std::vector<std::string> &args)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            return;
+        }
+        mPid = fork();
+        if (mPid == 0)
+        {
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            std::vector<char *> argv{const_cast<char *>(path)};
+            for (const std::string &arg : args)
+            {
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv(path, argv.data());
+            _exit(127);
+        }
+        close(fds[1]);
+        mOutputFd = fds[0];
+    }
+
+    ~BrokerProcess()
+    {
+        stop();
+        if (mOutputFd >= 0)
+        {
+            close(mOutputFd);
+        }
+    }
+
+    /// Read output until it contains text, returns false if the process exits or stays silent for 10 seconds.
+    bool waitForOutput(const char *text)
+    {
+        while (mOutput.find(text) == std::string::npos)
+        {
+            pollfd fd{mOutputFd, POLLIN, 0};
+            if (poll(&fd, 1, 10000) <= 0)
+            {
+                return false;
+            }
+            char buffer[4096];
+            ssize_t count = read(mOutputFd, buffer, sizeof(buffer));
+            if (count <= 0)
+            {
+                return false;
+            }
+            mOutput.append(buffer, count);
+        }
+        return true;
+    }
+
+    /// Stop the process and return its exit status.
+    int stop()
+    {
+        if (mPid > 0)
+        {
+            kill(mPid, SIGTERM);
+            waitpid(mPid, &mStatus, 0);
+            mPid = -1;
+        }
+        return mStatus;
+    }
+
+    const std::string &output() const
+    {
+        return mOutput;
+    }
+
+private:
+    pid_t mPid{-1};
+    int mOutputFd{-1};
+    int mStatus{-1};
+    std::string mOutput;
+};
+
+/// Return a loopback port that is currently free.
+static uint16_t freePort()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length);
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+static bool connectWithRetry(Client &client)
+{
+    for (int attempt = 0; attempt < 100; ++attempt)
+    {
+        if (client.connect() == Error::Ok)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+}
+
+/// Send an update with no channels, which the broker must reject without losing its upstream connection.
+static bool sendInvalidUpdate(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    protocol::UpdateImageV3Packet packet{false, "invalid", 0, nullptr, 0, 0, 1, 1, nullptr, nullptr};
+    std::vector<uint8_t> frame(4 + protocol::packetSize(packet));
+    uint32_t length = static_cast<uint32_t>(frame.size());
+    std::memcpy(frame.data(), &length, 4);
+    protocol::encodePacket(frame.data() + 4, packet);
+    bool sent = send(fd, frame.data(), frame.size(), 0) == static_cast<ssize_t>(frame.size());
+    close(fd);
+    return sent;
+}
+
+static void testPipeline(const char *brokerPath)
+{
+    uint16_t sinkPort = freePort();
+    BrokerProcess sink(brokerPath, {"--sink", std::to_string(sinkPort)});
+    CHECK(sink.waitForOutput("sink: listening"));
+
+    uint16_t brokerPort = freePort();
+    std::string socketPath = "/tmp/tevbroker-test-" + std::to_string(getpid()) + ".sock";
+    BrokerProcess broker(brokerPath, {"--upstream", "127.0.0.1:" + std::to_string(sinkPort), "--port",
+                                      std::to_string(brokerPort), "--socket", socketPath, "--interval", "50"});
+    CHECK(broker.waitForOutput("tevbroker: listening"));
+
+    // A second broker must not take over the socket of a running one.
+    BrokerProcess second(brokerPath, {"--port", std::to_string(freePort()), "--socket", socketPath});
+    CHECK(!second.waitForOutput("tevbroker: listening"));
+    CHECK(access(socketPath.c_str(), F_OK) == 0);
+
+    Client tcpProducer("127.0.0.1", brokerPort);
+    Client unixProducer(("unix:" + socketPath).c_str());
+    CHECK(connectWithRetry(tcpProducer));
+    CHECK(connectWithRetry(unixProducer));
+
+    // Four tiles of one image, merged into a single update by the broker.
+    constexpr uint32_t Size = 64, Tile = Size / 2;
+    std::vector<float> data(Tile * Tile * 4, 1.f);
+    CHECK(tcpProducer.createImage("tiles", Size, Size, 4) == Error::Ok);
+    for (uint32_t y = 0; y < Size; y += Tile)
+    {
+        for (uint32_t x = 0; x < Size; x += Tile)
+        {
+            CHECK(tcpProducer.updateImage("tiles", x, y, Tile, Tile, 4, nullptr, nullptr, nullptr, data.data(),
+                                          data.size()) == Error::Ok);
+        }
+    }
+
+    // Two overlapping tiles stay separate, but focus is only requested once for them.
+    CHECK(tcpProducer.createImage("focus", Size, Size, 4, nullptr, false) == Error::Ok);
+    CHECK(tcpProducer.updateImage("focus", 0, 0, Tile, Tile, 4, nullptr, nullptr, nullptr, data.data(), data.size(),
+                                  false) == Error::Ok);
+    CHECK(tcpProducer.updateImage("focus", Tile / 2, Tile / 2, Tile, Tile, 4, nullptr, nullptr, nullptr, data.data(),
+                                  data.size(), true) == Error::Ok);
+
+    CHECK(sendInvalidUpdate(brokerPort));
+    VgCommand commands[] = {VgCommand::beginPath(), VgCommand::fill()};
+    CHECK(unixProducer.createImage("overlay", 16, 16, 4) == Error::Ok);
+    CHECK(unixProducer.vectorGraphics("overlay", commands, 2) == Error::Ok);
+    CHECK(unixProducer.closeImage("overlay") == Error::Ok);
+    CHECK(tcpProducer.disconnect() == Error::Ok);
+    CHECK(unixProducer.disconnect() == Error::Ok);
+
+    CHECK(sink.waitForOutput("CloseImage 'overlay'"));
+    int status = broker.stop();
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(access(socketPath.c_str(), F_OK) != 0);
+    sink.stop();
+
+    const std::string &output = sink.output();
+    CHECK(output.find("CreateImage 'tiles'") != std::string::npos);
+    CHECK(output.find("UpdateImageV3 'tiles' region 0,0 64x64, 4 channel(s)") != std::string::npos);
+    CHECK(output.find("VectorGraphics 'overlay' 2 command(s)") != std::string::npos);
+    size_t firstFocusTile = output.find("UpdateImageV3 'focus'");
+    size_t secondFocusTile = output.find("UpdateImageV3 'focus'", firstFocusTile + 1);
+    CHECK(firstFocusTile != std::string::npos && secondFocusTile != std::string::npos);
+    CHECK(output.find(", grab focus", firstFocusTile) < output.find('\n', firstFocusTile));
+    CHECK(output.find(", grab focus", secondFocusTile) > output.find('\n', secondFocusTile));
+    CHECK(output.find("'invalid'") == std::string::npos);
+    CHECK(output.find("invalid packet") == std::string::npos);
+}
+
+/// While upstream is down the broker buffers a bounded amount and then stops reading, which blocks producers.
+static void testBackpressure(const char *brokerPath)
+{
+    uint16_t sinkPort = freePort();
+    uint16_t brokerPort = freePort();
+    BrokerProcess broker(brokerPath, {"--upstream", "127.0.0.1:" + std::to_string(sinkPort), "--port",
+                                      std::to_string(brokerPort), "--socket", "", "--buffer", "1"});
+    CHECK(broker.waitForOutput("tevbroker: listening"));
+
+    // Far more than the socket buffers and the broker's 1 MB hold, in tiles that do not cover each other.
+    constexpr uint32_t Size = 512, UpdateCount = 64;
+    std::atomic<uint32_t> sent{0};
+    std::thread producer([&] {
+        Client client("127.0.0.1", brokerPort);
+        CHECK(connectWithRetry(client));
+        std::vector<float> data(Size * Size, 1.f);
+        CHECK(client.createImage("blocked", Size, Size * UpdateCount, 1) == Error::Ok);
+        for (uint32_t i = 0; i < UpdateCount; ++i)
+        {
+            CHECK(client.updateImage("blocked", 0, i * Size, Size, Size, 1, nullptr, nullptr, nullptr, data.data(),
+                                     data.size()) == Error::Ok);
+            ++sent;
+        }
+        CHECK(client.closeImage("blocked") == Error::Ok);
+        CHECK(client.disconnect() == Error::Ok);
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    CHECK(sent < UpdateCount);
+
+    // Once upstream is reachable, everything arrives.
+    BrokerProcess sink(brokerPath, {"--sink", std::to_string(sinkPort)});
+    CHECK(sink.waitForOutput("sink: listening"));
+    producer.join();
+    CHECK(sent == UpdateCount);
+    CHECK(sink.waitForOutput("CloseImage 'blocked'"));
+    broker.stop();
+    sink.stop();
+
+    uint32_t rows = 0;
+    const std::string &output = sink.output();
+    for (size_t pos = output.find("UpdateImageV3 'blocked'"); pos != std::string::npos;
+         pos = output.find("UpdateImageV3 'blocked'", pos + 1))
+    {
+        uint32_t x, y, width, height;
+        if (std::sscanf(output.c_str() + pos, "UpdateImageV3 'blocked' region %u,%u %ux%u", &x, &y, &width, &height) ==
+            4)
+        {
+            rows += height;
+        }
+    }
+    CHECK(rows == Size * UpdateCount);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "Usage: test_broker <path to tevbroker>\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    testPipeline(argv[1]);
+    testBackpressure(argv[1]);
+    return checkResult();
+}
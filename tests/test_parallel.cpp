@@ -0,0 +1,163 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace tevclient;
+
+/// Count how often every task runs.
+class TaskCounter
+{
+public:
+    explicit TaskCounter(size_t taskCount) : mCounts(new std::atomic<int>[taskCount]), mTaskCount(taskCount)
+    {
+        for (size_t i = 0; i < taskCount; ++i)
+        {
+            mCounts[i] = 0;
+        }
+    }
+
+    void run(size_t task)
+    {
+        if (task < mTaskCount)
+        {
+            ++mCounts[task];
+        }
+        else
+        {
+            ++mOutOfRange;
+        }
+    }
+
+    /// Every task ran exactly once.
+    bool exactlyOnce() const
+    {
+        for (size_t i = 0; i < mTaskCount; ++i)
+        {
+            if (mCounts[i] != 1)
+            {
+                return false;
+            }
+        }
+        return mOutOfRange == 0;
+    }
+
+private:
+    std::unique_ptr<std::atomic<int>[]> mCounts;
+    size_t mTaskCount;
+    std::atomic<int> mOutOfRange{0};
+};
+
+/// Busy work whose length depends on the task, so that threads finish their ranges at different times.
+static void unevenWork(size_t task)
+{
+    volatile size_t sink = 0;
+    size_t iterations = (task * 7919) % 97 == 0 ? 100000 : (task % 13) * 100;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        sink = sink + i;
+    }
+}
+
+static void testTaskCounts()
+{
+    for (size_t taskCount : {0, 1, 2, 3, 7, 16, 17, 100, 1000, 100000})
+    {
+        TaskCounter counter(taskCount);
+        parallelFor(taskCount, [&](size_t task) {
+            unevenWork(task);
+            counter.run(task);
+        });
+        CHECK(counter.exactlyOnce());
+    }
+}
+
+/// A few slow tasks at the start, the remaining tasks are stolen by other threads.
+static void testStealing()
+{
+    constexpr size_t TaskCount = 4096;
+    TaskCounter counter(TaskCount);
+    std::vector<std::thread::id> runners(TaskCount);
+    parallelFor(TaskCount, [&](size_t task) {
+        if (task < 4)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        runners[task] = std::this_thread::get_id();
+        counter.run(task);
+    });
+    CHECK(counter.exactlyOnce());
+    if (parallelThreadCount() > 1)
+    {
+        bool severalThreads = false;
+        for (std::thread::id id : runners)
+        {
+            severalThreads |= id != runners[0];
+        }
+        CHECK(severalThreads);
+    }
+}
+
+static void testNested()
+{
+    constexpr size_t Outer = 64, Inner = 257;
+    TaskCounter counter(Outer * Inner);
+    parallelFor(Outer, [&](size_t outer) {
+        parallelFor(Inner, [&](size_t inner) {
+            unevenWork(inner);
+            counter.run(outer * Inner + inner);
+        });
+    });
+    CHECK(counter.exactlyOnce());
+}
+
+static void testConcurrentCallers()
+{
+    constexpr size_t ThreadCount = 8, CallsPerThread = 50, TaskCount = 333;
+    std::vector<std::unique_ptr<TaskCounter>> counters;
+    for (size_t i = 0; i < ThreadCount * CallsPerThread; ++i)
+    {
+        counters.emplace_back(new TaskCounter(TaskCount));
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < ThreadCount; ++t)
+    {
+        threads.emplace_back([&, t] {
+            for (size_t call = 0; call < CallsPerThread; ++call)
+            {
+                TaskCounter &counter = *counters[t * CallsPerThread + call];
+                parallelFor(TaskCount, [&](size_t task) {
+                    unevenWork(task + call);
+                    counter.run(task);
+                });
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (const auto &counter : counters)
+    {
+        CHECK(counter->exactlyOnce());
+    }
+}
+
+int main()
+{
+    CHECK(parallelThreadCount() >= 1 && parallelThreadCount() <= MaxParallelTasks);
+    testTaskCounts();
+    testStealing();
+    testNested();
+    testConcurrentCallers();
+    return checkResult();
+}
@@ -0,0 +1,183 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "protocol.h"
+#include "sink.h"
+
+#include <tevclient.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace tevclient;
+
+static constexpr uint8_t UpdateImageV3Type = 6;
+
+/// Send enough data for the client to measure its bandwidth.
+static bool measureBandwidth(Client &client, TestSink &sink)
+{
+    constexpr uint32_t Size = 512;
+    std::vector<float> data(Size * Size);
+    if (client.createImage("warmup", Size, Size, 1) != Error::Ok ||
+        client.updateImage("warmup", 0, 0, Size, Size, 1, nullptr, nullptr, nullptr, data.data(), data.size()) !=
+            Error::Ok)
+    {
+        return false;
+    }
+    return sink.waitFor(data.size() * sizeof(float)) && client.getBandwidth() > 0.0;
+}
+
+/// Image whose value is the column plus 100 times the row, so block averages are easy to compute.
+static std::vector<float> gradient(uint32_t width, uint32_t height)
+{
+    std::vector<float> data(width * height);
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            data[y * width + x] = static_cast<float>(x + 100 * y);
+        }
+    }
+    return data;
+}
+
+/// Decoded preview rows of an image in the order they were received.
+struct PreviewRow
+{
+    uint32_t x, y, width, height;
+    std::vector<float> values;
+};
+
+static std::vector<PreviewRow> previewRows(TestSink &sink, const char *imageName)
+{
+    std::vector<PreviewRow> rows;
+    for (const TestSink::Message &message : sink.messages())
+    {
+        if (message.type != UpdateImageV3Type)
+        {
+            continue;
+        }
+        protocol::DecodeArena arena;
+        protocol::UpdateImageV3Packet packet{};
+        const uint8_t *data = protocol::decodePacket(message.packet.data(), message.packet.size(), packet, arena);
+        if (!data || std::strcmp(packet.imageName, imageName) != 0)
+        {
+            continue;
+        }
+        PreviewRow row{packet.x, packet.y, packet.width, packet.height, {}};
+        row.values.resize((message.packet.data() + message.packet.size() - data) / sizeof(float));
+        std::memcpy(row.values.data(), data, row.values.size() * sizeof(float));
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+/// Until the bandwidth is known, previews are sent at full resolution.
+static void testFullResolutionUntilMeasured()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+
+    std::vector<float> data = gradient(8, 8);
+    uint32_t factor = 0;
+    CHECK(client.updateImagePreview("image", 0, 0, 8, 8, 1, nullptr, nullptr, nullptr, data.data(), data.size(),
+                                    false, &factor) == Error::Ok);
+    CHECK(factor == 1);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    std::vector<PreviewRow> rows = previewRows(sink, "image");
+    CHECK(rows.size() == 1);
+    CHECK(rows.size() == 1 && rows[0].width == 8 && rows[0].height == 8 && rows[0].values == data);
+}
+
+/// A region without pixels is rejected before a factor is chosen.
+static void testEmptyRegion()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    CHECK(measureBandwidth(client, sink));
+    client.setPreviewFrameRate(1e30f);
+
+    float value = 0.f;
+    CHECK(client.updateImagePreview("image", 0, 0, 0, 8, 1, nullptr, nullptr, nullptr, &value, 0) ==
+          Error::ArgumentError);
+    CHECK(client.updateImagePreview("image", 0, 0, 8, 0, 1, nullptr, nullptr, nullptr, &value, 0) ==
+          Error::ArgumentError);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+}
+
+/// Each block row is sent as its own message holding the block averages.
+static void testDownsampledRows()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    CHECK(measureBandwidth(client, sink));
+    client.setPreviewFrameRate(1e30f);
+    client.setMaxPreviewDownsample(4);
+
+    // 10x6 does not divide evenly, so the last column and row of blocks are partial.
+    constexpr uint32_t Width = 10, Height = 6, X = 3, Y = 5;
+    std::vector<float> data = gradient(Width, Height);
+    uint32_t factor = 0;
+    CHECK(client.updateImagePreview("image", X, Y, Width, Height, 1, nullptr, nullptr, nullptr, data.data(),
+                                    data.size(), false, &factor) == Error::Ok);
+    CHECK(factor == 4);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    std::vector<PreviewRow> rows = previewRows(sink, "image");
+    CHECK(rows.size() == 2);
+    for (uint32_t by = 0; by < rows.size(); ++by)
+    {
+        const PreviewRow &row = rows[by];
+        CHECK(row.x == X && row.y == Y + by && row.width == 3 && row.height == 1);
+        CHECK(row.values.size() == 3);
+        uint32_t rowBegin = by * 4, rowEnd = std::min(rowBegin + 4, Height);
+        for (uint32_t bx = 0; bx < 3 && bx < row.values.size(); ++bx)
+        {
+            uint32_t colBegin = bx * 4, colEnd = std::min(colBegin + 4, Width);
+            float expected = (colBegin + colEnd - 1) / 2.f + 100.f * (rowBegin + rowEnd - 1) / 2.f;
+            CHECK(row.values[bx] == expected);
+        }
+    }
+}
+
+/// A huge maximum factor is clamped, so the factor search cannot overflow.
+static void testLargeMaxDownsample()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    CHECK(measureBandwidth(client, sink));
+    client.setPreviewFrameRate(1e30f);
+    client.setMaxPreviewDownsample(UINT32_MAX);
+
+    std::vector<float> data = gradient(64, 64);
+    uint32_t factor = 0;
+    CHECK(client.updateImagePreview("image", 0, 0, 64, 64, 1, nullptr, nullptr, nullptr, data.data(), data.size(),
+                                    false, &factor) == Error::Ok);
+    CHECK(factor == 1u << 16);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    std::vector<PreviewRow> rows = previewRows(sink, "image");
+    CHECK(rows.size() == 1);
+    CHECK(rows.size() == 1 && rows[0].width == 1 && rows[0].height == 1 && rows[0].values.size() == 1);
+    CHECK(rows.size() == 1 && rows[0].values.size() == 1 && rows[0].values[0] == 31.5f + 100.f * 31.5f);
+}
+
+int main()
+{
+    testFullResolutionUntilMeasured();
+    testEmptyRegion();
+    testDownsampledRows();
+    testLargeMaxDownsample();
+    return checkResult();
+}
@@ -0,0 +1,220 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "protocol.h"
+
+#include <cstring>
+#include <vector>
+
+using namespace tevclient;
+
+/// Encode a packet and check that it fills exactly packetSize() bytes.
+template <typename Packet> static std::vector<uint8_t> encode(const Packet &packet)
+{
+    std::vector<uint8_t> buffer(protocol::packetSize(packet));
+    CHECK(protocol::encodePacket(buffer.data(), packet) == buffer.data() + buffer.size());
+    CHECK(buffer[0] == static_cast<uint8_t>(protocol::Schema<Packet>::Type));
+    return buffer;
+}
+
+/// Decode a whole packet, after checking that every truncation of it and a wrong type byte are rejected.
+template <typename Packet>
+static bool decode(const std::vector<uint8_t> &buffer, Packet &packet, protocol::DecodeArena &arena)
+{
+    for (size_t size = 0; size < buffer.size(); ++size)
+    {
+        Packet truncated{};
+        CHECK(protocol::decodePacket(buffer.data(), size, truncated, arena) == nullptr);
+    }
+    std::vector<uint8_t> wrongType = buffer;
+    wrongType[0] = 0xff;
+    CHECK(protocol::decodePacket(wrongType.data(), wrongType.size(), packet, arena) == nullptr);
+
+    return protocol::decodePacket(buffer.data(), buffer.size(), packet, arena) == buffer.data() + buffer.size();
+}
+
+static bool sameStrings(const char *const *a, const char *const *b, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (std::strcmp(a[i], b[i]) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// The original tevclient sends true as 0 and false as 1, so tev reads it that way.
+static void testBoolEncoding()
+{
+    for (bool grabFocus : {true, false})
+    {
+        std::vector<uint8_t> buffer = encode(protocol::ReloadImagePacket{grabFocus, "a"});
+        CHECK(buffer[1] == (grabFocus ? 0 : 1));
+    }
+    for (bool append : {true, false})
+    {
+        std::vector<uint8_t> buffer = encode(protocol::VectorGraphicsPacket{false, "a", append, 0, nullptr});
+        CHECK(buffer[1] == 1);
+        CHECK(buffer[4] == (append ? 0 : 1));
+    }
+}
+
+static void testOpenImage(bool grabFocus)
+{
+    std::vector<uint8_t> buffer = encode(protocol::OpenImagePacket{grabFocus, "image.exr:R"});
+    protocol::DecodeArena arena;
+    protocol::OpenImagePacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageString, "image.exr:R") == 0);
+}
+
+static void testReloadImage(bool grabFocus)
+{
+    std::vector<uint8_t> buffer = encode(protocol::ReloadImagePacket{grabFocus, "image"});
+    protocol::DecodeArena arena;
+    protocol::ReloadImagePacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+}
+
+static void testCloseImage()
+{
+    std::vector<uint8_t> buffer = encode(protocol::CloseImagePacket{"image"});
+    protocol::DecodeArena arena;
+    protocol::CloseImagePacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+}
+
+static void testUpdateImage(bool grabFocus)
+{
+    std::vector<uint8_t> buffer = encode(protocol::UpdateImagePacket{grabFocus, "image", "R", 1, 2, 3, 4});
+    protocol::DecodeArena arena;
+    protocol::UpdateImagePacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+    CHECK(std::strcmp(decoded.channel, "R") == 0);
+    CHECK(decoded.x == 1 && decoded.y == 2 && decoded.width == 3 && decoded.height == 4);
+}
+
+static void testCreateImage(bool grabFocus)
+{
+    const char *names[] = {"R", "G", "B", "A", "depth"};
+    std::vector<uint8_t> buffer = encode(protocol::CreateImagePacket{grabFocus, "image", 640, 480, 5, names});
+    protocol::DecodeArena arena;
+    protocol::CreateImagePacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+    CHECK(decoded.width == 640 && decoded.height == 480);
+    CHECK(decoded.channelCount == 5 && sameStrings(decoded.channelNames, names, 5));
+}
+
+static void testUpdateImageV2(bool grabFocus)
+{
+    const char *names[] = {"R", "G"};
+    std::vector<uint8_t> buffer = encode(protocol::UpdateImageV2Packet{grabFocus, "image", 2, names, 5, 6, 7, 8});
+    protocol::DecodeArena arena;
+    protocol::UpdateImageV2Packet decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+    CHECK(decoded.channelCount == 2 && sameStrings(decoded.channelNames, names, 2));
+    CHECK(decoded.x == 5 && decoded.y == 6 && decoded.width == 7 && decoded.height == 8);
+}
+
+static void testUpdateImageV3(bool grabFocus)
+{
+    const char *names[] = {"R", "G", "B"};
+    uint64_t offsets[] = {0, 1, 2};
+    uint64_t strides[] = {3, 3, 1ull << 40};
+    protocol::UpdateImageV3Packet packet{grabFocus, "image", 3, names, 9, 10, 11, 12, offsets, strides};
+    std::vector<uint8_t> buffer = encode(packet);
+
+    protocol::DecodeArena arena;
+    protocol::UpdateImageV3Packet decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+    CHECK(decoded.channelCount == 3 && sameStrings(decoded.channelNames, names, 3));
+    CHECK(decoded.x == 9 && decoded.y == 10 && decoded.width == 11 && decoded.height == 12);
+    CHECK(std::memcmp(decoded.channelOffsets, offsets, sizeof(offsets)) == 0);
+    CHECK(std::memcmp(decoded.channelStrides, strides, sizeof(strides)) == 0);
+
+    uint32_t region[4];
+    std::memcpy(region, buffer.data() + protocol::regionOffset(packet), sizeof(region));
+    CHECK(region[0] == 9 && region[1] == 10 && region[2] == 11 && region[3] == 12);
+}
+
+static void testOpenImageV2(bool grabFocus)
+{
+    std::vector<uint8_t> buffer = encode(protocol::OpenImageV2Packet{grabFocus, "image.exr", "R"});
+    protocol::DecodeArena arena;
+    protocol::OpenImageV2Packet decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus);
+    CHECK(std::strcmp(decoded.imagePath, "image.exr") == 0);
+    CHECK(std::strcmp(decoded.channelSelector, "R") == 0);
+}
+
+static void testVectorGraphics(bool grabFocus, bool append)
+{
+    VgCommand commands[] = {
+        VgCommand::save(),
+        VgCommand::fillColor({1.f, 0.5f, 0.25f, 1.f}),
+        VgCommand::beginPath(),
+        VgCommand::moveTo({1.f, 2.f}),
+        VgCommand::bezierTo({3.f, 4.f}, {5.f, 6.f}, {7.f, 8.f}),
+        VgCommand::roundedRectVarying({0.f, 0.f}, {10.f, 20.f}, 1.f, 2.f, 3.f, 4.f),
+        VgCommand::pathWinding(VgCommand::Clockwise),
+        VgCommand::fill(),
+        VgCommand::restore(),
+    };
+    uint32_t count = sizeof(commands) / sizeof(commands[0]);
+    protocol::VectorGraphicsPacket packet{grabFocus, "image", append, count, commands};
+    std::vector<uint8_t> buffer = encode(packet);
+    CHECK(buffer.size() == 1 + 1 + 6 + 1 + 4 + protocol::vgCommandsSize(commands, count));
+
+    protocol::DecodeArena arena;
+    protocol::VectorGraphicsPacket decoded{};
+    CHECK(decode(buffer, decoded, arena));
+    CHECK(decoded.grabFocus == grabFocus && decoded.append == append);
+    CHECK(std::strcmp(decoded.imageName, "image") == 0);
+    CHECK(decoded.commandCount == count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CHECK(decoded.commands[i].type == commands[i].type);
+        CHECK(decoded.commands[i].dataCount == commands[i].dataCount);
+        CHECK(std::memcmp(decoded.commands[i].data, commands[i].data, commands[i].dataCount * sizeof(float)) == 0);
+    }
+
+    // Commands of unknown type cannot be skipped, as their size is unknown.
+    std::vector<uint8_t> invalid = buffer;
+    invalid[buffer.size() - protocol::vgCommandsSize(commands, count)] = 100;
+    CHECK(protocol::decodePacket(invalid.data(), invalid.size(), decoded, arena) == nullptr);
+}
+
+int main()
+{
+    testBoolEncoding();
+    testCloseImage();
+    for (bool grabFocus : {true, false})
+    {
+        testOpenImage(grabFocus);
+        testReloadImage(grabFocus);
+        testUpdateImage(grabFocus);
+        testCreateImage(grabFocus);
+        testUpdateImageV2(grabFocus);
+        testUpdateImageV3(grabFocus);
+        testOpenImageV2(grabFocus);
+        testVectorGraphics(grabFocus, true);
+        testVectorGraphics(grabFocus, false);
+    }
+    return checkResult();
+}
@@ -0,0 +1,133 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "sink.h"
+
+#include <tevclient.h>
+
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace tevclient;
+
+static constexpr uint8_t UpdateImageV3Type = 6;
+static constexpr uint8_t VectorGraphicsType = 8;
+
+/// Updates from several threads get unique ids, can be queried and arrive completely.
+static void testConcurrentUpdates()
+{
+    constexpr size_t ThreadCount = 4, UpdatesPerThread = 8, Size = 64, Channels = 4;
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    CHECK(client.setThreadSafe(true) == Error::Ok);
+
+    std::vector<UploadId> ids(ThreadCount * UpdatesPerThread);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < ThreadCount; ++t)
+    {
+        threads.emplace_back([&, t] {
+            std::string name = "image" + std::to_string(t);
+            std::vector<float> data(Size * Size * Channels);
+            for (size_t i = 0; i < UpdatesPerThread; ++i)
+            {
+                // The data is reused right away, the update keeps its own copy.
+                std::fill(data.begin(), data.end(), float(i));
+                CHECK(client.updateImage(name.c_str(), 0, 0, Size, Size, Channels, nullptr, nullptr, nullptr,
+                                         data.data(), data.size()) == Error::Ok);
+                ids[t * UpdatesPerThread + i] = client.lastUploadId();
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    CHECK(client.flush() == Error::Ok);
+
+    std::set<UploadId> unique(ids.begin(), ids.end());
+    CHECK(unique.size() == ids.size());
+    CHECK(unique.count(0) == 0);
+    for (UploadId id : ids)
+    {
+        UploadProgress progress;
+        CHECK(client.getUploadProgress(id, progress) == Error::Ok);
+        CHECK(progress.state == UploadState::Completed);
+    }
+
+    size_t payload = ids.size() * Size * Size * Channels * sizeof(float);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    size_t updateBytes = 0;
+    for (const TestSink::Message &message : sink.messages())
+    {
+        if (message.type == UpdateImageV3Type)
+        {
+            updateBytes += message.size;
+        }
+    }
+    CHECK(updateBytes >= payload);
+}
+
+/// Thread-safe updates are queued as bulk jobs, so other messages overtake them.
+static void testUpdatesYieldToOtherMessages()
+{
+    constexpr size_t ThreadCount = 4, UpdatesPerThread = 4, Size = 512, Channels = 4;
+    TestSink sink(true);
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    CHECK(client.setThreadSafe(true) == Error::Ok);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < ThreadCount; ++t)
+    {
+        threads.emplace_back([&, t] {
+            std::string name = "image" + std::to_string(t);
+            std::vector<float> data(Size * Size * Channels);
+            for (size_t i = 0; i < UpdatesPerThread; ++i)
+            {
+                CHECK(client.updateImage(name.c_str(), 0, 0, Size, Size, Channels, nullptr, nullptr, nullptr,
+                                         data.data(), data.size()) == Error::Ok);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    VgCommand commands[] = {VgCommand::beginPath(), VgCommand::fill()};
+    CHECK(client.vectorGraphics("image0", commands, 2) == Error::Ok);
+    sink.resume();
+    CHECK(client.flush() == Error::Ok);
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    size_t updateBytes = 0, bytesBeforeGraphics = 0;
+    bool foundGraphics = false;
+    for (const TestSink::Message &message : sink.messages())
+    {
+        if (message.type == UpdateImageV3Type)
+        {
+            updateBytes += message.size;
+        }
+        else if (message.type == VectorGraphicsType)
+        {
+            foundGraphics = true;
+            bytesBeforeGraphics = updateBytes;
+        }
+    }
+    CHECK(foundGraphics);
+    // Only what fit into the socket buffers while the sink was paused went out first.
+    CHECK(bytesBeforeGraphics < updateBytes / 2);
+}
+
+int main()
+{
+    testConcurrentUpdates();
+    testUpdatesYieldToOtherMessages();
+    return checkResult();
+}
@@ -0,0 +1,185 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "protocol.h"
+#include "sink.h"
+
+#include <tevclient.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace tevclient;
+
+static constexpr uint8_t UpdateImageV3Type = 6;
+
+/// Size of the image uploaded in chunks, every row is 16 bytes.
+static constexpr uint32_t Width = 4, Height = 10, RowBytes = Width * sizeof(float);
+
+/// Calls that fail validation are assigned an id, and id 0 is never a valid upload.
+static void testUploadIds()
+{
+    Client client;
+    UploadProgress progress;
+    CHECK(client.lastUploadId() == 0);
+    CHECK(client.getUploadProgress(0, progress) == Error::ArgumentError);
+
+    float data[4] = {};
+    CHECK(client.updateImage("image", 0, 0, 2, 2, 1, nullptr, nullptr, nullptr, data, 3) == Error::ArgumentError);
+    CHECK(client.lastUploadId() == 1);
+    CHECK(client.sendPrepared(PreparedUpdate{}, 0, 0, 2, 2, data, 4) == Error::ArgumentError);
+    CHECK(client.lastUploadId() == 2);
+    CHECK(client.getUploadProgress(0, progress) == Error::ArgumentError);
+    CHECK(client.cancelUpload(0) == Error::ArgumentError);
+}
+
+/// A region message received by the sink.
+struct Chunk
+{
+    uint32_t x, y, width, height;
+    bool grabFocus;
+    std::vector<float> values;
+};
+
+static std::vector<Chunk> chunks(TestSink &sink)
+{
+    std::vector<Chunk> result;
+    for (const TestSink::Message &message : sink.messages())
+    {
+        if (message.type != UpdateImageV3Type)
+        {
+            continue;
+        }
+        protocol::DecodeArena arena;
+        protocol::UpdateImageV3Packet packet{};
+        const uint8_t *data = protocol::decodePacket(message.packet.data(), message.packet.size(), packet, arena);
+        CHECK(data != nullptr);
+        if (!data)
+        {
+            continue;
+        }
+        Chunk chunk{packet.x, packet.y, packet.width, packet.height, packet.grabFocus, {}};
+        chunk.values.resize((message.packet.data() + message.packet.size() - data) / sizeof(float));
+        std::memcpy(chunk.values.data(), data, chunk.values.size() * sizeof(float));
+        result.push_back(chunk);
+    }
+    return result;
+}
+
+/// Records the progress reports and cancels the upload once enough rows were sent.
+struct Recorder
+{
+    Client *client;
+    uint32_t cancelAfterRows;
+    bool useCancelUpload;
+    std::vector<UploadProgress> reports;
+
+    static bool callback(const UploadProgress &progress, void *userData)
+    {
+        Recorder &recorder = *static_cast<Recorder *>(userData);
+        recorder.reports.push_back(progress);
+        if (progress.state == UploadState::Cancelled || progress.rowsSent < recorder.cancelAfterRows)
+        {
+            return true;
+        }
+        if (recorder.useCancelUpload)
+        {
+            CHECK(recorder.client->cancelUpload(progress.id) == Error::Ok);
+            return true;
+        }
+        return false;
+    }
+};
+
+/// Upload a single channel image whose values are the pixel index, in chunks of at most chunkSize bytes.
+static void upload(size_t chunkSize, uint32_t cancelAfterRows, bool useCancelUpload, Error expectedError,
+                   uint32_t expectedRowsPerChunk, uint32_t expectedRowsSent)
+{
+    std::vector<float> data(Width * Height);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = static_cast<float>(i);
+    }
+
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+    Recorder recorder{&client, cancelAfterRows, useCancelUpload, {}};
+    client.setMaxChunkSize(chunkSize);
+    client.setUploadCallback(Recorder::callback, &recorder);
+    CHECK(client.updateImage("image", 0, 0, Width, Height, 1, nullptr, nullptr, nullptr, data.data(), data.size()) ==
+          expectedError);
+    UploadId id = client.lastUploadId();
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    // One report per chunk, then a final one when the upload was cancelled.
+    uint32_t chunkCount = (expectedRowsSent + expectedRowsPerChunk - 1) / expectedRowsPerChunk;
+    bool cancelled = expectedError == Error::Cancelled;
+    CHECK(recorder.reports.size() == chunkCount + (cancelled ? 1 : 0));
+    for (size_t i = 0; i < recorder.reports.size(); ++i)
+    {
+        const UploadProgress &progress = recorder.reports[i];
+        uint32_t rowsSent = std::min<uint32_t>(static_cast<uint32_t>(i + 1) * expectedRowsPerChunk, expectedRowsSent);
+        bool last = i + 1 == recorder.reports.size();
+        UploadState state = !last     ? UploadState::InProgress
+                            : cancelled ? UploadState::Cancelled
+                                        : UploadState::Completed;
+        CHECK(progress.id == id);
+        CHECK(progress.state == state);
+        CHECK(progress.rowsSent == rowsSent && progress.rowsTotal == Height);
+        CHECK(progress.bytesSent == static_cast<uint64_t>(RowBytes) * rowsSent);
+        CHECK(progress.bytesTotal == static_cast<uint64_t>(RowBytes) * Height);
+    }
+
+    UploadProgress progress;
+    CHECK(client.getUploadProgress(id, progress) == Error::Ok);
+    CHECK(progress.state == (cancelled ? UploadState::Cancelled : UploadState::Completed));
+    CHECK(progress.rowsSent == expectedRowsSent);
+
+    // Every chunk is a complete region message of whole rows, and nothing follows a cancellation.
+    std::vector<Chunk> received = chunks(sink);
+    CHECK(received.size() == chunkCount);
+    uint32_t row = 0;
+    for (const Chunk &chunk : received)
+    {
+        CHECK(chunk.x == 0 && chunk.y == row && chunk.width == Width);
+        CHECK(chunk.height == std::min(expectedRowsPerChunk, expectedRowsSent - row));
+        CHECK(chunk.grabFocus == (row == 0));
+        CHECK(chunk.values.size() == Width * chunk.height);
+        CHECK(std::equal(chunk.values.begin(), chunk.values.end(), data.begin() + row * Width));
+        row += chunk.height;
+    }
+    CHECK(row == expectedRowsSent);
+}
+
+static void testProgress()
+{
+    // Two rows per chunk, the last chunk is complete.
+    upload(2 * RowBytes, Height, false, Error::Ok, 2, Height);
+    // Chunks that are not a multiple of the row size round down, the last chunk is partial.
+    upload(50, Height, false, Error::Ok, 3, Height);
+    // Chunks smaller than a row still hold one row.
+    upload(1, Height, false, Error::Ok, 1, Height);
+}
+
+static void testCancel()
+{
+    // The callback cancels after the second chunk.
+    upload(2 * RowBytes, 4, false, Error::Cancelled, 2, 4);
+    // cancelUpload() from within the callback stops at the same boundary.
+    upload(50, 3, true, Error::Cancelled, 3, 3);
+    // Cancelling after the last chunk has no effect.
+    upload(50, Height, true, Error::Ok, 3, Height);
+}
+
+int main()
+{
+    testUploadIds();
+    testProgress();
+    testCancel();
+    return checkResult();
+}
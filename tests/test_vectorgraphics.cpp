@@ -0,0 +1,275 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "protocol.h"
+#include "sink.h"
+
+#include <tevclient.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace tevclient;
+
+static constexpr uint8_t VectorGraphicsType = 8;
+
+/// A vector graphics message received by the sink.
+struct VgMessage
+{
+    std::string imageName;
+    bool grabFocus;
+    bool append;
+    std::vector<VgCommand> commands;
+    size_t size;
+};
+
+static std::vector<VgMessage> vgMessages(TestSink &sink)
+{
+    std::vector<VgMessage> result;
+    for (const TestSink::Message &message : sink.messages())
+    {
+        if (message.type != VectorGraphicsType)
+        {
+            continue;
+        }
+        protocol::DecodeArena arena;
+        protocol::VectorGraphicsPacket packet{};
+        const uint8_t *end = protocol::decodePacket(message.packet.data(), message.packet.size(), packet, arena);
+        CHECK(end == message.packet.data() + message.packet.size());
+        if (end)
+        {
+            result.push_back({packet.imageName, packet.grabFocus, packet.append,
+                              std::vector<VgCommand>(packet.commands, packet.commands + packet.commandCount),
+                              message.size});
+        }
+    }
+    return result;
+}
+
+static bool sameCommands(const std::vector<VgCommand> &a, const VgCommand *b, size_t count)
+{
+    if (a.size() != count)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (a[i].type != b[i].type || a[i].dataCount != b[i].dataCount ||
+            std::memcmp(a[i].data, b[i].data, a[i].dataCount * sizeof(float)) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Only what changed since the last updateVectorGraphics() call of an image is sent.
+static void testRetainedUpdates()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+
+    std::vector<VgCommand> commands = {VgCommand::beginPath(), VgCommand::moveTo({1.f, 2.f}),
+                                       VgCommand::lineTo({3.f, 4.f}), VgCommand::stroke()};
+    CHECK(client.updateVectorGraphics("image", commands.data(), 4) == Error::Ok);
+    // Unchanged, nothing is sent.
+    CHECK(client.updateVectorGraphics("image", commands.data(), 4) == Error::Ok);
+    // Appended, only the tail is sent.
+    commands.push_back(VgCommand::beginPath());
+    commands.push_back(VgCommand::circle({5.f, 6.f}, 7.f));
+    CHECK(client.updateVectorGraphics("image", commands.data(), 6) == Error::Ok);
+    // A shorter list replaces everything.
+    CHECK(client.updateVectorGraphics("image", commands.data(), 2) == Error::Ok);
+    // So does a modified prefix.
+    commands[1] = VgCommand::moveTo({1.f, 2.5f});
+    CHECK(client.updateVectorGraphics("image", commands.data(), 6) == Error::Ok);
+    // Re-creating the image forgets what it showed.
+    CHECK(client.createImage("image", 16, 16, 1) == Error::Ok);
+    CHECK(client.updateVectorGraphics("image", commands.data(), 6) == Error::Ok);
+    CHECK(client.updateVectorGraphics("image", commands.data(), 6) == Error::Ok);
+    // Other images are tracked separately.
+    CHECK(client.updateVectorGraphics("other", commands.data(), 6) == Error::Ok);
+
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    std::vector<VgMessage> messages = vgMessages(sink);
+    CHECK(messages.size() == 6);
+    if (messages.size() == 6)
+    {
+        CHECK(!messages[0].append && messages[0].grabFocus && messages[0].commands.size() == 4);
+        CHECK(messages[1].append && sameCommands(messages[1].commands, commands.data() + 4, 2));
+        CHECK(!messages[2].append && messages[2].commands.size() == 2 && messages[2].commands[1].data[1] == 2.f);
+        CHECK(!messages[3].append && sameCommands(messages[3].commands, commands.data(), 6));
+        CHECK(!messages[4].append && sameCommands(messages[4].commands, commands.data(), 6));
+        CHECK(messages[4].imageName == "image");
+        CHECK(!messages[5].append && messages[5].imageName == "other" && messages[5].commands.size() == 6);
+    }
+}
+
+/// The buffer overload tracks the encoded commands the same way.
+static void testRetainedBufferUpdates()
+{
+    TestSink sink;
+    Client client("127.0.0.1", sink.port());
+    CHECK(client.connect() == Error::Ok);
+
+    VgBuffer buffer;
+    const float xs[3] = {0.f, 10.f, 20.f}, ys[3] = {0.f, 5.f, 0.f};
+    buffer.add(VgCommand::beginPath());
+    buffer.lineStrip(xs, ys, 3);
+    CHECK(client.updateVectorGraphics("image", buffer) == Error::Ok);
+    CHECK(client.updateVectorGraphics("image", buffer) == Error::Ok);
+    buffer.add(VgCommand::stroke());
+    CHECK(client.updateVectorGraphics("image", buffer) == Error::Ok);
+    client.forgetVectorGraphics("image");
+    CHECK(client.updateVectorGraphics("image", buffer) == Error::Ok);
+    buffer.clear();
+    buffer.add(VgCommand::beginPath());
+    buffer.add(VgCommand::fill());
+    CHECK(client.updateVectorGraphics("image", buffer) == Error::Ok);
+
+    CHECK(client.disconnect() == Error::Ok);
+    CHECK(sink.waitForDisconnect());
+
+    std::vector<VgMessage> messages = vgMessages(sink);
+    CHECK(messages.size() == 4);
+    if (messages.size() == 4)
+    {
+        CHECK(!messages[0].append && messages[0].commands.size() == 4);
+        CHECK(messages[1].append && messages[1].commands.size() == 1 &&
+              messages[1].commands[0].type == VgCommand::EType::Stroke);
+        CHECK(!messages[2].append && messages[2].commands.size() == 5);
+        CHECK(!messages[3].append && messages[3].commands.size() == 2);
+    }
+}
+
+/// Check that messages split commands into chunks of chunkSize, the first one with append as passed.
+static void checkChunks(const std::vector<VgMessage> &messages, const std::vector<VgCommand> &commands,
+                        size_t chunkSize, bool append)
+{
+    size_t chunkCount = (commands.size() + chunkSize - 1) / chunkSize;
+    CHECK(messages.size() == chunkCount);
+    for (size_t i = 0; i < messages.size() && i < chunkCount; ++i)
+    {
+        size_t count = std::min(chunkSize, commands.size() - i * chunkSize);
+        CHECK(messages[i].imageName == "image");
+        CHECK(messages[i].append == (i == 0 ? append : true));
+        CHECK(messages[i].grabFocus == (i == 0));
+        CHECK(sameCommands(messages[i].commands, commands.data() + i * chunkSize, count));
+        protocol::VectorGraphicsPacket packet{true, "image", true, static_cast<uint32_t>(count),
+                                              commands.data() + i * chunkSize};
+        CHECK(messages[i].size == 4 + protocol::packetSize(packet));
+    }
+}
+
+/// Command lists larger than the limit are split at command boundaries.
+static void testChunking()
+{
+    // Every MoveTo encodes to 9 bytes, so 20 bytes hold two of them and 5 bytes none.
+    std::vector<VgCommand> commands;
+    for (int i = 0; i < 11; ++i)
+    {
+        commands.push_back(VgCommand::moveTo({static_cast<float>(i), static_cast<float>(2 * i)}));
+    }
+    VgBuffer buffer;
+    buffer.add(commands.data(), commands.size());
+
+    struct Case
+    {
+        size_t limit, chunkSize;
+        bool append, useBuffer;
+    };
+    for (Case c : {Case{20, 2, false, false}, Case{20, 2, true, true}, Case{5, 1, false, false},
+                   Case{5, 1, false, true}, Case{1024, 11, false, false}, Case{1024, 11, true, true}})
+    {
+        TestSink sink;
+        Client client("127.0.0.1", sink.port());
+        CHECK(client.connect() == Error::Ok);
+        client.setMaxVectorGraphicsSize(c.limit);
+        if (c.useBuffer)
+        {
+            CHECK(client.vectorGraphics("image", buffer, c.append) == Error::Ok);
+        }
+        else
+        {
+            CHECK(client.vectorGraphics("image", commands.data(), commands.size(), c.append) == Error::Ok);
+        }
+        CHECK(client.disconnect() == Error::Ok);
+        CHECK(sink.waitForDisconnect());
+        checkChunks(vgMessages(sink), commands, c.chunkSize, c.append);
+    }
+}
+
+/// Every image gets its own message with the same commands, chunk by chunk.
+static void testMultipleImages()
+{
+    const char *const imageNames[3] = {"a", "bb", "ccc"};
+    std::vector<VgCommand> commands = {VgCommand::beginPath(), VgCommand::moveTo({1.f, 2.f}),
+                                       VgCommand::lineTo({3.f, 4.f}), VgCommand::stroke()};
+    VgBuffer buffer;
+    buffer.add(commands.data(), commands.size());
+
+    struct Case
+    {
+        size_t limit, chunkSize;
+        bool useBuffer, batched;
+    };
+    // 10 bytes hold beginPath and moveTo, then lineTo and stroke.
+    for (Case c : {Case{1024, 4, false, false}, Case{1024, 4, true, false}, Case{1024, 4, false, true},
+                   Case{10, 2, false, false}, Case{10, 2, true, true}})
+    {
+        TestSink sink;
+        Client client("127.0.0.1", sink.port());
+        CHECK(client.connect() == Error::Ok);
+        client.setMaxVectorGraphicsSize(c.limit);
+        if (c.batched)
+        {
+            client.beginBatch();
+        }
+        if (c.useBuffer)
+        {
+            CHECK(client.vectorGraphics(imageNames, 3, buffer, false) == Error::Ok);
+        }
+        else
+        {
+            CHECK(client.vectorGraphics(imageNames, 3, commands.data(), commands.size(), false) == Error::Ok);
+        }
+        if (c.batched)
+        {
+            CHECK(client.endBatch() == Error::Ok);
+        }
+        CHECK(client.vectorGraphics(imageNames, 0, commands.data(), commands.size()) == Error::Ok);
+        CHECK(client.disconnect() == Error::Ok);
+        CHECK(sink.waitForDisconnect());
+
+        std::vector<VgMessage> messages = vgMessages(sink);
+        size_t chunkCount = commands.size() / c.chunkSize;
+        CHECK(messages.size() == 3 * chunkCount);
+        for (size_t i = 0; i < messages.size() && i < 3 * chunkCount; ++i)
+        {
+            size_t chunk = i / 3;
+            const VgMessage &message = messages[i];
+            CHECK(message.imageName == imageNames[i % 3]);
+            CHECK(message.append == (chunk > 0));
+            CHECK(message.grabFocus == (chunk == 0));
+            CHECK(sameCommands(message.commands, commands.data() + chunk * c.chunkSize, c.chunkSize));
+            protocol::VectorGraphicsPacket packet{true, imageNames[i % 3], true, static_cast<uint32_t>(c.chunkSize),
+                                                  commands.data() + chunk * c.chunkSize};
+            CHECK(message.size == 4 + protocol::packetSize(packet));
+        }
+    }
+}
+
+int main()
+{
+    testRetainedUpdates();
+    testRetainedBufferUpdates();
+    testChunking();
+    testMultipleImages();
+    return checkResult();
+}
@@ -0,0 +1,300 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+#include "protocol.h"
+
+#include <tevclient.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+using namespace tevclient;
+
+/// Decode the commands held by a buffer.
+static std::vector<VgCommand> commands(const VgBuffer &buffer)
+{
+    std::vector<VgCommand> result;
+    protocol::DecodeArena arena;
+    const uint8_t *src = buffer.data(), *end = buffer.data() + buffer.size();
+    while (src && src < end)
+    {
+        VgCommand command;
+        src = protocol::VgCommandCodec::decode(src, end, command, arena);
+        if (src)
+        {
+            result.push_back(command);
+        }
+    }
+    CHECK(src == end);
+    return result;
+}
+
+struct Segment
+{
+    float x0, y0, x1, y1;
+};
+
+/// Line segments drawn by the MoveTo and LineTo commands, in order.
+static std::vector<Segment> segments(const std::vector<VgCommand> &commands)
+{
+    std::vector<Segment> result;
+    float x = 0.f, y = 0.f;
+    for (const VgCommand &command : commands)
+    {
+        if (command.type == VgCommand::EType::LineTo)
+        {
+            result.push_back({x, y, command.data[0], command.data[1]});
+        }
+        if (command.type == VgCommand::EType::MoveTo || command.type == VgCommand::EType::LineTo)
+        {
+            x = command.data[0];
+            y = command.data[1];
+        }
+    }
+    return result;
+}
+
+static size_t countType(const std::vector<VgCommand> &commands, VgCommand::EType type)
+{
+    return std::count_if(commands.begin(), commands.end(), [type](const VgCommand &c) { return c.type == type; });
+}
+
+static bool near(float a, float b)
+{
+    return std::fabs(a - b) < 1e-4f;
+}
+
+/// Whether a segment connects the two points, in either direction.
+static bool connects(const Segment &s, float x0, float y0, float x1, float y1)
+{
+    return (near(s.x0, x0) && near(s.y0, y0) && near(s.x1, x1) && near(s.y1, y1)) ||
+           (near(s.x0, x1) && near(s.y0, y1) && near(s.x1, x0) && near(s.y1, y0));
+}
+
+static size_t countConnecting(const std::vector<Segment> &segments, float x0, float y0, float x1, float y1)
+{
+    return std::count_if(segments.begin(), segments.end(),
+                         [&](const Segment &s) { return connects(s, x0, y0, x1, y1); });
+}
+
+/// Two triangles sharing their diagonal have five edges, each drawn once.
+static void testWireframeQuad()
+{
+    const float positions[] = {10.f, 10.f, 0.f, 30.f, 10.f, 0.f, 30.f, 30.f, 0.f, 10.f, 30.f, 0.f};
+    const uint32_t indices[] = {0, 1, 2, 0, 2, 3};
+    VgBuffer buffer;
+    buffer.wireframe(positions, 4, indices, 2, nullptr, 100, 100);
+
+    std::vector<VgCommand> result = commands(buffer);
+    CHECK(countType(result, VgCommand::EType::BeginPath) == 1);
+    CHECK(countType(result, VgCommand::EType::Stroke) == 1);
+    std::vector<Segment> lines = segments(result);
+    CHECK(lines.size() == 5);
+    CHECK(countConnecting(lines, 10.f, 10.f, 30.f, 10.f) == 1);
+    CHECK(countConnecting(lines, 30.f, 10.f, 30.f, 30.f) == 1);
+    CHECK(countConnecting(lines, 30.f, 30.f, 10.f, 30.f) == 1);
+    CHECK(countConnecting(lines, 10.f, 30.f, 10.f, 10.f) == 1);
+    CHECK(countConnecting(lines, 10.f, 10.f, 30.f, 30.f) == 1);
+}
+
+/// Shared edges are drawn once however many triangles share them and in which direction.
+static void testWireframeSharedEdges()
+{
+    // A fan of four triangles around the center vertex, with the first triangle repeated reversed.
+    const float positions[] = {20.f, 20.f, 0.f, 10.f, 10.f, 0.f, 30.f, 10.f, 0.f,
+                               30.f, 30.f, 0.f, 10.f, 30.f, 0.f};
+    const uint32_t indices[] = {0, 1, 2, 0, 2, 3, 0, 3, 4, 0, 4, 1, 2, 1, 0};
+    VgBuffer buffer;
+    buffer.wireframe(positions, 5, indices, 5, nullptr, 100, 100);
+
+    std::vector<Segment> lines = segments(commands(buffer));
+    CHECK(lines.size() == 8);
+    const float outer[5][2] = {{10.f, 10.f}, {30.f, 10.f}, {30.f, 30.f}, {10.f, 30.f}, {10.f, 10.f}};
+    for (int i = 0; i < 4; ++i)
+    {
+        CHECK(countConnecting(lines, 20.f, 20.f, outer[i][0], outer[i][1]) == 1);
+        CHECK(countConnecting(lines, outer[i][0], outer[i][1], outer[i + 1][0], outer[i + 1][1]) == 1);
+    }
+}
+
+/// A grid large enough to be split across partitions still draws every edge exactly once.
+static void testWireframeGrid()
+{
+    constexpr uint32_t N = 200;
+    std::vector<float> positions;
+    for (uint32_t y = 0; y <= N; ++y)
+    {
+        for (uint32_t x = 0; x <= N; ++x)
+        {
+            positions.insert(positions.end(), {static_cast<float>(x), static_cast<float>(y), 0.f});
+        }
+    }
+    std::vector<uint32_t> indices;
+    for (uint32_t y = 0; y < N; ++y)
+    {
+        for (uint32_t x = 0; x < N; ++x)
+        {
+            uint32_t v = y * (N + 1) + x;
+            indices.insert(indices.end(), {v, v + 1, v + N + 2, v, v + N + 2, v + N + 1});
+        }
+    }
+    VgBuffer buffer;
+    buffer.wireframe(positions.data(), positions.size() / 3, indices.data(), indices.size() / 3, nullptr, N, N);
+
+    // Edges as sorted pairs of endpoints, each must be unique and there are 3 N^2 + 2 N of them.
+    std::vector<std::pair<std::pair<float, float>, std::pair<float, float>>> edges;
+    for (const Segment &s : segments(commands(buffer)))
+    {
+        auto a = std::make_pair(s.x0, s.y0), b = std::make_pair(s.x1, s.y1);
+        edges.push_back(std::min(a, b) == a ? std::make_pair(a, b) : std::make_pair(b, a));
+    }
+    std::sort(edges.begin(), edges.end());
+    CHECK(std::adjacent_find(edges.begin(), edges.end()) == edges.end());
+    CHECK(edges.size() == 3 * N * N + 2 * N);
+}
+
+/// Edges crossing the border of the image end on it, edges outside of it are dropped.
+static void testWireframeClipping()
+{
+    const float positions[] = {5.f, 5.f, 0.f, 40.f, 5.f, 0.f, 5.f, 15.f, 0.f, 30.f, 30.f, 0.f, 40.f, 30.f, 0.f};
+    const uint32_t indices[] = {0, 1, 2, 1, 3, 4};
+    VgBuffer buffer;
+    buffer.wireframe(positions, 5, indices, 2, nullptr, 20, 20);
+
+    std::vector<Segment> lines = segments(commands(buffer));
+    CHECK(lines.size() == 3);
+    CHECK(countConnecting(lines, 5.f, 5.f, 20.f, 5.f) == 1);
+    CHECK(countConnecting(lines, 20.f, 5.f + 10.f * 20.f / 35.f, 5.f, 15.f) == 1);
+    CHECK(countConnecting(lines, 5.f, 15.f, 5.f, 5.f) == 1);
+    for (const Segment &s : lines)
+    {
+        CHECK(s.x0 >= 0.f && s.x0 <= 20.f && s.x1 >= 0.f && s.x1 <= 20.f);
+        CHECK(s.y0 >= 0.f && s.y0 <= 20.f && s.y1 >= 0.f && s.y1 <= 20.f);
+    }
+}
+
+/// Isolines of a single cell, with its corners in clockwise order from the top left.
+static std::vector<Segment> cellIsolines(const float (&corners)[4], float level)
+{
+    const float image[4] = {corners[0], corners[1], corners[3], corners[2]};
+    VgBuffer buffer;
+    buffer.isolines(image, 2, 2, 0, 1, &level, 1);
+    return segments(commands(buffer));
+}
+
+/// Every non-saddle case of a cell gives one segment between the midpoints of the edges it crosses.
+static void testIsolineCells()
+{
+    // Midpoints of the edges between corners k and k + 1, the cell spans the pixel centers.
+    const float midX[4] = {1.f, 1.5f, 1.f, 0.5f};
+    const float midY[4] = {0.5f, 1.f, 1.5f, 1.f};
+    for (unsigned inside = 1; inside < 15; ++inside)
+    {
+        if (inside == 5 || inside == 10)
+        {
+            continue;
+        }
+        float corners[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            corners[k] = inside >> k & 1 ? 1.f : 0.f;
+        }
+        int crossed[2], crossedCount = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            if ((inside >> k & 1) != (inside >> ((k + 1) & 3) & 1))
+            {
+                crossed[crossedCount++] = k;
+            }
+        }
+
+        std::vector<Segment> lines = cellIsolines(corners, 0.5f);
+        CHECK(lines.size() == 1);
+        CHECK(countConnecting(lines, midX[crossed[0]], midY[crossed[0]], midX[crossed[1]], midY[crossed[1]]) == 1);
+    }
+
+    // Cells entirely above or below the level have no isoline.
+    CHECK(cellIsolines({0.f, 0.f, 0.f, 0.f}, 0.5f).empty());
+    CHECK(cellIsolines({1.f, 1.f, 1.f, 1.f}, 0.5f).empty());
+}
+
+/// Saddles are resolved by the average of the corners.
+static void testIsolineSaddle()
+{
+    // The center is not above the level, so the two corners above it are cut off separately.
+    std::vector<Segment> lines = cellIsolines({1.f, 0.f, 1.f, 0.f}, 0.5f);
+    CHECK(lines.size() == 2);
+    CHECK(countConnecting(lines, 0.5f, 1.f, 1.f, 0.5f) == 1);
+    CHECK(countConnecting(lines, 1.5f, 1.f, 1.f, 1.5f) == 1);
+
+    // The center is above the level, so the two corners below it are cut off instead.
+    lines = cellIsolines({1.f, 0.2f, 1.f, 0.2f}, 0.5f);
+    CHECK(lines.size() == 2);
+    CHECK(countConnecting(lines, 1.125f, 0.5f, 1.5f, 0.875f) == 1);
+    CHECK(countConnecting(lines, 0.875f, 1.5f, 0.5f, 1.125f) == 1);
+}
+
+/// The isoline around a block of pixels is chained into a single closed polyline.
+static void testIsolineClosedContour()
+{
+    const float image[16] = {
+        0.f, 0.f, 0.f, 0.f, //
+        0.f, 1.f, 1.f, 0.f, //
+        0.f, 1.f, 1.f, 0.f, //
+        0.f, 0.f, 0.f, 0.f, //
+    };
+    const float levels[2] = {0.25f, 0.75f};
+    const VgCommand::Color colors[2] = {{1.f, 0.f, 0.f, 1.f}, {0.f, 0.f, 1.f, 1.f}};
+    VgBuffer buffer;
+    buffer.isolines(image, 4, 4, 0, 1, levels, 2, colors);
+
+    std::vector<VgCommand> result = commands(buffer);
+    CHECK(countType(result, VgCommand::EType::StrokeColor) == 2);
+    CHECK(countType(result, VgCommand::EType::BeginPath) == 2);
+    CHECK(countType(result, VgCommand::EType::Stroke) == 2);
+    // One polyline per level, through one crossing on each of the 8 edges around the block.
+    CHECK(countType(result, VgCommand::EType::MoveTo) == 2);
+    CHECK(countType(result, VgCommand::EType::LineTo) == 16);
+
+    size_t path = 0;
+    for (size_t i = 0; i < result.size(); ++i)
+    {
+        if (result[i].type != VgCommand::EType::MoveTo)
+        {
+            continue;
+        }
+        CHECK(i + 8 < result.size());
+        if (i + 8 >= result.size())
+        {
+            break;
+        }
+        CHECK(result[i + 8].type == VgCommand::EType::LineTo);
+        CHECK(near(result[i + 8].data[0], result[i].data[0]) && near(result[i + 8].data[1], result[i].data[1]));
+        // The first level crosses closer to the outer pixels than the second.
+        float distance = path == 0 ? 0.25f : 0.75f;
+        for (size_t k = i; k < i + 8; ++k)
+        {
+            float x = result[k].data[0], y = result[k].data[1];
+            bool onColumn = near(x, 0.5f + distance) || near(x, 3.5f - distance);
+            bool onRow = near(y, 0.5f + distance) || near(y, 3.5f - distance);
+            CHECK(onColumn || onRow);
+        }
+        ++path;
+    }
+    CHECK(path == 2);
+}
+
+int main()
+{
+    testWireframeQuad();
+    testWireframeSharedEdges();
+    testWireframeGrid();
+    testWireframeClipping();
+    testIsolineCells();
+    testIsolineSaddle();
+    testIsolineClosedContour();
+    return checkResult();
+}
@@ -0,0 +1,65 @@
+// This file was developed by Simon Kallweit and Thomas Müller <thomas94@gmx.net>.
+// It is published under the BSD 3-Clause License within the LICENSE file.
+
+#include "check.h"
+
+#include <tevclient.h>
+
+#include <vector>
+
+using namespace tevclient;
+
+static std::vector<VgCommand::EType> types(const std::vector<VgCommand> &commands, size_t count)
+{
+    std::vector<VgCommand::EType> result;
+    for (size_t i = 0; i < count; ++i)
+    {
+        result.push_back(commands[i].type);
+    }
+    return result;
+}
+
+/// Overlapping paths that are filled and stroked must keep their order, else the outline of the
+/// first would be drawn on top of the fill of the second.
+static void testFillAndStrokeNotMerged(bool reorder)
+{
+    using T = VgCommand::EType;
+    std::vector<VgCommand> commands = {
+        VgCommand::fillColor({1.f, 0.f, 0.f, 1.f}), VgCommand::strokeColor({0.f, 0.f, 0.f, 1.f}),
+        VgCommand::beginPath(),                     VgCommand::rect({0.f, 0.f}, {10.f, 10.f}),
+        VgCommand::fill(),                          VgCommand::stroke(),
+        VgCommand::beginPath(),                     VgCommand::rect({5.f, 5.f}, {10.f, 10.f}),
+        VgCommand::fill(),                          VgCommand::stroke(),
+    };
+    size_t count = optimizeVgCommands(commands.data(), commands.size(), reorder);
+    std::vector<T> expected = {T::FillColor, T::StrokeColor, T::BeginPath, T::Rect, T::Fill, T::Stroke,
+                               T::BeginPath, T::Rect,        T::Fill,      T::Stroke};
+    CHECK(types(commands, count) == expected);
+    CHECK(commands[7].data[0] == 5.f);
+}
+
+/// Paths drawn by a single opaque fill of the same color are merged.
+static void testSingleFillsMerged()
+{
+    using T = VgCommand::EType;
+    std::vector<VgCommand> commands = {
+        VgCommand::fillColor({1.f, 0.f, 0.f, 1.f}),
+        VgCommand::beginPath(),
+        VgCommand::rect({0.f, 0.f}, {10.f, 10.f}),
+        VgCommand::fill(),
+        VgCommand::beginPath(),
+        VgCommand::rect({5.f, 5.f}, {10.f, 10.f}),
+        VgCommand::fill(),
+    };
+    size_t count = optimizeVgCommands(commands.data(), commands.size(), false);
+    std::vector<T> expected = {T::FillColor, T::BeginPath, T::Rect, T::Rect, T::Fill};
+    CHECK(types(commands, count) == expected);
+}
+
+int main()
+{
+    testFillAndStrokeNotMerged(false);
+    testFillAndStrokeNotMerged(true);
+    testSingleFillsMerged();
+    return checkResult();
+}